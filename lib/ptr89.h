@@ -1,3 +1,4 @@
 #pragma once
 
+#include "src/MappedFile.h"
 #include "src/Pattern.h"
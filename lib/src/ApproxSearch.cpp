@@ -0,0 +1,91 @@
+#include "Pattern.h"
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace Ptr89 {
+
+/*
+ * Search with at most maxMismatches mismatched bytes, e.g. for porting the patterns to the other firmware revision.
+ * Only the bytes of the root pattern are compared, sub-patterns are not followed: their code is usually changed too.
+ * Results are sorted by the mismatches, then by the address, so the limit keeps the closest results.
+ * */
+std::vector<Pattern::ApproxSearchResult> Pattern::findApprox(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, int maxMismatches, size_t maxResults, int threads) {
+	if (pattern->type == PATTERN_TYPE_STATIC_VALUE)
+		return { { { 0, 0, pattern->staticValue }, 0 } };
+
+	size_t patternSize = pattern->bytes.size();
+	if (!patternSize || memory.size < patternSize)
+		return {};
+
+	ShiftAddMatcher matcher(pattern->bytes.data(), pattern->masks.data(), patternSize, maxMismatches);
+	maxMismatches = matcher.getMaxMismatches();
+	int align = findAlignForPattern(pattern, memory.align);
+
+	size_t endOffset = memory.size - patternSize + 1;
+	size_t threadsCnt = m_debugHandler ? 1 : ThreadPool::resolveThreads(threads);
+	size_t chunksCnt = std::max(static_cast<size_t>(1), std::min(threadsCnt, endOffset / SEARCH_MIN_CHUNK_SIZE));
+	size_t chunkSize = (endOffset + chunksCnt - 1) / chunksCnt;
+	std::vector<std::vector<ApproxSearchResult>> chunks(chunksCnt);
+
+	ThreadPool pool(static_cast<int>(chunksCnt));
+	pool.run(chunksCnt, [&](size_t chunkIndex) {
+		auto &results = chunks[chunkIndex];
+		size_t from = chunkIndex * chunkSize;
+		size_t to = std::min(from + chunkSize, endOffset);
+
+		/*
+		 * When maxResults are found with at most N mismatches, the next results with N or more mismatches are ranked lower.
+		 * So the threshold for the next results is lowered to N - 1, and only the found results above N are dropped.
+		 * */
+		int threshold = maxMismatches;
+		int cutoff = maxMismatches;
+		std::vector<size_t> counts(maxMismatches + 1);
+		matcher.scan(memory.data, from, to, [&](size_t offset, int mismatches) {
+			if (mismatches > threshold || (offset % align) != 0)
+				return true;
+
+			auto [isDecoded, result] = decodeResult<NoTrace>(pattern, offset + pattern->inputOffset, memory);
+			if (!isDecoded)
+				return true;
+
+			if (m_debugHandler)
+				debug("FOUND: address=%08X, offset=%08X, value=%08X, mismatches=%d\n", result.address, result.offset, result.value, mismatches);
+
+			results.push_back({ result, mismatches });
+			if (!maxResults)
+				return true;
+
+			counts[mismatches]++;
+			size_t found = 0;
+			for (int i = 0; i <= threshold; i++) {
+				found += counts[i];
+				if (found >= maxResults) {
+					threshold = i - 1;
+					cutoff = i;
+					break;
+				}
+			}
+
+			if (results.size() >= maxResults * 2) {
+				std::erase_if(results, [&](const ApproxSearchResult &r) {
+					return r.mismatches > cutoff;
+				});
+			}
+			return threshold >= 0;
+		});
+	});
+
+	std::vector<ApproxSearchResult> results;
+	for (auto &chunk: chunks)
+		results.insert(results.end(), chunk.begin(), chunk.end());
+
+	// Chunks are in the address order
+	std::stable_sort(results.begin(), results.end(), [](const ApproxSearchResult &a, const ApproxSearchResult &b) {
+		return a.mismatches < b.mismatches;
+	});
+	if (maxResults && results.size() > maxResults)
+		results.resize(maxResults);
+	return results;
+}
+
+}; // namespace Ptr89
@@ -0,0 +1,95 @@
+#include "Pattern.h"
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace Ptr89 {
+
+Pattern::FunctionIndex Pattern::FunctionIndex::build(const Memory &memory, int threads) {
+	FunctionIndex index;
+	if (memory.size < 4)
+		return index;
+
+	// Branch targets of all chunks are resolved through the one veneers map
+	Memory decodeMemory = memory;
+	if (!decodeMemory.thunks)
+		decodeMemory.thunks = ThunkMap::build(memory);
+
+	size_t endOffset = memory.size - 3;
+	size_t chunksCnt = std::max(static_cast<size_t>(1), std::min(static_cast<size_t>(ThreadPool::resolveThreads(threads)), endOffset / SEARCH_MIN_CHUNK_SIZE));
+	size_t chunkSize = (endOffset + chunksCnt - 1) / chunksCnt;
+	chunkSize += (4 - chunkSize % 4) % 4;
+	std::vector<std::vector<uint32_t>> chunks(chunksCnt);
+
+	ThreadPool pool(static_cast<int>(chunksCnt));
+	pool.run(chunksCnt, [&](size_t chunkIndex) {
+		auto &functions = chunks[chunkIndex];
+		size_t from = chunkIndex * chunkSize;
+		size_t to = std::min(from + chunkSize, endOffset);
+		from += (memory.base + from) & 1;
+
+		for (size_t i = from; i < to; i += 2) {
+			uint32_t addr = memory.base + i;
+			const uint8_t *bytes = memory.data + i;
+
+			uint16_t thumbInstr = (bytes[1] << 8) | bytes[0];
+			if ((thumbInstr & 0xFF00) == 0xB500) // PUSH {..., LR}
+				functions.push_back(addr | 1);
+
+			auto [isThumb, thumbAddr, isThumbBLX] = decodeThumbBL<NoTrace>(addr, bytes);
+			if (isThumb && inMemory(memory, thumbAddr, 4))
+				functions.push_back(resolveThunks<NoTrace>(thumbAddr, decodeMemory) | (!isThumbBLX ? 1 : 0));
+
+			if ((addr & 3) != 0)
+				continue;
+
+			uint32_t armInstr = (bytes[3] << 24) | (bytes[2] << 16) | (bytes[1] << 8) | bytes[0];
+			if ((armInstr & 0xFFFF4000) == 0xE92D4000) // STMFD SP!, {..., LR}
+				functions.push_back(addr);
+
+			// Only BL and BLX, B is not a call
+			auto [isArm, armAddr, isArmBLX] = decodeArmBL<NoTrace>(addr, bytes);
+			if (isArm && (isArmBLX || (armInstr & 0x0F000000) == 0x0B000000) && inMemory(memory, armAddr, 4))
+				functions.push_back(resolveThunks<NoTrace>(armAddr, decodeMemory) | (isArmBLX ? 1 : 0));
+		}
+
+		std::sort(functions.begin(), functions.end());
+	});
+
+	for (auto &functions: chunks)
+		index.m_functions.insert(index.m_functions.end(), functions.begin(), functions.end());
+
+	// Address with the THUMB bit is sorted right after the same ARM address
+	std::sort(index.m_functions.begin(), index.m_functions.end());
+	index.m_functions.erase(std::unique(index.m_functions.begin(), index.m_functions.end()), index.m_functions.end());
+
+	return index;
+}
+
+std::pair<bool, uint32_t> Pattern::FunctionIndex::findContaining(uint32_t addr) const {
+	auto it = std::upper_bound(m_functions.begin(), m_functions.end(), addr | 1);
+	if (it == m_functions.begin())
+		return { false, 0 };
+	return { true, *(it - 1) };
+}
+
+std::pair<bool, uint32_t> Pattern::FunctionIndex::findNext(uint32_t addr) const {
+	auto it = std::upper_bound(m_functions.begin(), m_functions.end(), addr | 1);
+	if (it == m_functions.end())
+		return { false, 0 };
+	return { true, *it };
+}
+
+std::pair<bool, uint32_t> Pattern::FunctionIndex::findPrev(uint32_t addr) const {
+	auto it = std::lower_bound(m_functions.begin(), m_functions.end(), addr & ~1);
+	if (it == m_functions.begin())
+		return { false, 0 };
+	return { true, *(it - 1) };
+}
+
+std::span<const uint32_t> Pattern::FunctionIndex::findRange(uint32_t from, uint32_t to) const {
+	auto first = std::lower_bound(m_functions.begin(), m_functions.end(), from & ~1);
+	auto last = std::lower_bound(first, m_functions.end(), to & ~1);
+	return { first, last };
+}
+
+}; // namespace Ptr89
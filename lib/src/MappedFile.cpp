@@ -0,0 +1,110 @@
+#include "MappedFile.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace Ptr89 {
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string &path, MappedFileAccess access) {
+	auto file = std::make_shared<MappedFile>();
+
+	if (path == "-") {
+		#if defined(_WIN32)
+		_setmode(_fileno(stdin), _O_BINARY);
+		#endif
+		file->readStream(stdin, "stdin");
+		return file;
+	}
+
+	#if !defined(_WIN32)
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("open(" + path + ") error: " + strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) {
+			file->m_data = static_cast<const uint8_t *>(addr);
+			file->m_size = st.st_size;
+			file->m_isMapped = true;
+
+			// Only hints, errors are not critical
+			if (access == MAPPED_FILE_ACCESS_SEQUENTIAL) {
+				madvise(addr, st.st_size, MADV_SEQUENTIAL);
+				madvise(addr, st.st_size, MADV_WILLNEED);
+			}
+		}
+	}
+	close(fd);
+
+	if (file->m_isMapped)
+		return file;
+	#endif
+
+	file->readFile(path);
+	return file;
+}
+
+bool MappedFile::isStream(const std::string &path) {
+	if (path == "-")
+		return true;
+	std::error_code ec;
+	auto status = std::filesystem::status(path, ec);
+	return !ec && std::filesystem::exists(status) && !std::filesystem::is_regular_file(status);
+}
+
+void MappedFile::readFile(const std::string &path) {
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp)
+		throw std::runtime_error("fopen(" + path + ") error: " + strerror(errno));
+
+	std::error_code ec;
+	auto fileSize = std::filesystem::file_size(path, ec);
+	if (!ec)
+		m_buffer.reserve(fileSize);
+
+	try {
+		readStream(fp, path);
+	} catch (...) {
+		fclose(fp);
+		throw;
+	}
+	fclose(fp);
+}
+
+void MappedFile::readStream(FILE *fp, const std::string &path) {
+	uint8_t buff[64 * 1024];
+	while (!feof(fp)) {
+		size_t readed = fread(buff, 1, sizeof(buff), fp);
+		if (readed > 0) {
+			m_buffer.insert(m_buffer.end(), buff, buff + readed);
+		} else if (ferror(fp)) {
+			throw std::runtime_error("fread(" + path + ") error: " + strerror(errno));
+		}
+	}
+
+	m_data = m_buffer.data();
+	m_size = m_buffer.size();
+}
+
+MappedFile::~MappedFile() {
+	#if !defined(_WIN32)
+	if (m_isMapped)
+		munmap(const_cast<uint8_t *>(m_data), m_size);
+	#endif
+}
+
+}; // namespace Ptr89
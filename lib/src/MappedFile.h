@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Ptr89 {
+
+enum MappedFileAccess {
+	MAPPED_FILE_ACCESS_RANDOM,
+	MAPPED_FILE_ACCESS_SEQUENTIAL,	// whole file is scanned, read-ahead aggressively
+};
+
+/*
+ * Read-only file mapped into the memory.
+ * Falls back to reading the whole file when mmap() is not available.
+ * Path "-" is the stdin.
+ * */
+class MappedFile {
+	public:
+		MappedFile() = default;
+		MappedFile(const MappedFile &) = delete;
+		MappedFile &operator=(const MappedFile &) = delete;
+		~MappedFile();
+
+		static std::shared_ptr<MappedFile> open(const std::string &path, MappedFileAccess access = MAPPED_FILE_ACCESS_RANDOM);
+
+		// Pipes, sockets and stdin can be read only once and only sequentially
+		static bool isStream(const std::string &path);
+
+		inline const uint8_t *data() const {
+			return m_data;
+		}
+
+		inline size_t size() const {
+			return m_size;
+		}
+
+		inline bool isMapped() const {
+			return m_isMapped;
+		}
+	private:
+		const uint8_t *m_data = nullptr;
+		size_t m_size = 0;
+		bool m_isMapped = false;
+		std::vector<uint8_t> m_buffer;
+
+		void readFile(const std::string &path);
+		void readStream(FILE *fp, const std::string &path);
+};
+
+}; // namespace Ptr89
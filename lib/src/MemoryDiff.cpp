@@ -0,0 +1,104 @@
+#include "Pattern.h"
+#include <algorithm>
+#include <unordered_map>
+
+namespace Ptr89 {
+
+static constexpr uint64_t DIFF_HASH_PRIME = 0x100000001B3ULL;
+
+/*
+ * rsync-like diff: aligned blocks of the previous memory are found at any offset of the memory with the rolling hash.
+ * Found blocks are extended in both directions, so the changed bytes are located exactly.
+ * */
+Pattern::MemoryDiff Pattern::MemoryDiff::build(const Memory &prevMemory, const Memory &memory) {
+	MemoryDiff diff;
+	diff.m_prevMemory = prevMemory;
+	diff.m_memory = memory;
+
+	if (prevMemory.size < BLOCK_SIZE || memory.size < BLOCK_SIZE)
+		return diff;
+
+	auto hashBlock = [](const uint8_t *data) {
+		uint64_t hash = 0;
+		for (size_t i = 0; i < BLOCK_SIZE; i++)
+			hash = hash * DIFF_HASH_PRIME + data[i];
+		return hash;
+	};
+
+	auto filterHash = [](uint64_t hash) {
+		return (hash * 0x9E3779B97F4A7C15ULL) >> (64 - FILTER_BITS);
+	};
+
+	// Previous memory blocks, the first one wins for the repeated blocks (e.g. FF padding)
+	std::unordered_map<uint64_t, size_t> blocks;
+	blocks.reserve(prevMemory.size / BLOCK_SIZE);
+	std::vector<uint64_t> filter((1 << FILTER_BITS) / 64);
+	for (size_t offset = 0; offset + BLOCK_SIZE <= prevMemory.size; offset += BLOCK_SIZE) {
+		uint64_t hash = hashBlock(prevMemory.data + offset);
+		blocks.emplace(hash, offset);
+		uint64_t bit = filterHash(hash);
+		filter[bit / 64] |= 1ULL << (bit % 64);
+	}
+
+	// Multiplier of the byte leaving the window
+	uint64_t outPower = 1;
+	for (size_t i = 1; i < BLOCK_SIZE; i++)
+		outPower *= DIFF_HASH_PRIME;
+
+	size_t i = 0;
+	size_t lastEnd = 0;
+	uint64_t hash = hashBlock(memory.data);
+	while (i + BLOCK_SIZE <= memory.size) {
+		uint64_t bit = filterHash(hash);
+		if ((filter[bit / 64] & (1ULL << (bit % 64)))) {
+			auto it = blocks.find(hash);
+			if (it != blocks.end() && memcmp(memory.data + i, prevMemory.data + it->second, BLOCK_SIZE) == 0) {
+				size_t from = i;
+				size_t prevFrom = it->second;
+				while (from > lastEnd && prevFrom > 0 && memory.data[from - 1] == prevMemory.data[prevFrom - 1]) {
+					from--;
+					prevFrom--;
+				}
+
+				size_t size = getCommonSize(memory.data + from, prevMemory.data + prevFrom, std::min(memory.size - from, prevMemory.size - prevFrom));
+				diff.m_segments.push_back({ from, prevFrom, size });
+
+				i = from + size;
+				lastEnd = i;
+				if (i + BLOCK_SIZE <= memory.size)
+					hash = hashBlock(memory.data + i);
+				continue;
+			}
+		}
+
+		if (i + BLOCK_SIZE < memory.size)
+			hash = (hash - memory.data[i] * outPower) * DIFF_HASH_PRIME + memory.data[i + BLOCK_SIZE];
+		i++;
+	}
+
+	return diff;
+}
+
+size_t Pattern::MemoryDiff::getCommonSize(const uint8_t *a, const uint8_t *b, size_t maxSize) {
+	size_t size = 0;
+	while (size + 8 <= maxSize) {
+		uint64_t valueA, valueB;
+		memcpy(&valueA, a + size, 8);
+		memcpy(&valueB, b + size, 8);
+		if (valueA != valueB)
+			break;
+		size += 8;
+	}
+	while (size < maxSize && a[size] == b[size])
+		size++;
+	return size;
+}
+
+size_t Pattern::MemoryDiff::getIdenticalSize() const {
+	size_t size = 0;
+	for (auto &segment: m_segments)
+		size += segment.size;
+	return size;
+}
+
+}; // namespace Ptr89
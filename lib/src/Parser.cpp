@@ -2,15 +2,31 @@
 #include "Pattern.h"
 #include "Tokenizer.h"
 #include "src/utils.h"
+#include <charconv>
 #include <cstdint>
 #include <stdexcept>
 
 namespace Ptr89 {
 
-std::shared_ptr<PtrExp> Parser::parse(const std::string &input) {
+PtrExp *PtrExpArena::alloc() {
+	if (m_blockUsed == m_blockSize) {
+		m_blockSize = m_blockSize ? std::min(m_blockSize * 2, MAX_BLOCK_NODES) : MIN_BLOCK_NODES;
+		m_blocks.push_back(std::make_unique<PtrExp[]>(m_blockSize));
+		m_blockUsed = 0;
+	}
+	return &m_blocks.back()[m_blockUsed++];
+}
+
+std::shared_ptr<PtrExp> Parser::parse(std::string_view input, const std::shared_ptr<PtrExpArena> &arena) {
 	m_input = input;
-	m_pattern = {};
+	m_arena = arena;
+	m_pattern = m_arena->alloc();
 	m_tok.reset(m_input);
+	PtrExp *root = m_pattern;
+
+	// Rough size hint, most bytes of a pattern take two chars
+	root->bytes.reserve(input.size() / 2);
+	root->masks.reserve(input.size() / 2);
 
 	skipWhitespaces();
 
@@ -44,7 +60,8 @@ std::shared_ptr<PtrExp> Parser::parse(const std::string &input) {
 	if (m_tok.peek().type != Tokenizer::TOK_EOF)
 		throw PatternError(this, "Unexpected tokens after end of pattern");
 
-	return std::make_shared<PtrExp>(m_pattern);
+	m_arena = nullptr;
+	return std::shared_ptr<PtrExp>(arena, root);
 }
 
 void Parser::parseStaticValue() {
@@ -55,8 +72,8 @@ void Parser::parseStaticValue() {
 
 	expectToken(Tokenizer::TOK_HEX);
 
-	m_pattern.type = PATTERN_TYPE_STATIC_VALUE;
-	m_pattern.staticValue = getTokenUInt(m_tok.peek());
+	m_pattern->type = PATTERN_TYPE_STATIC_VALUE;
+	m_pattern->staticValue = getTokenUInt(m_tok.peek());
 
 	m_tok.next();
 
@@ -68,11 +85,11 @@ void Parser::parseStaticValue() {
 
 void Parser::parseReferenceOrPointer() {
 	if (m_tok.peek().type == Tokenizer::TOK_POINTER) {
-		m_pattern.type = PATTERN_TYPE_POINTER;
+		m_pattern->type = PATTERN_TYPE_POINTER;
 	} else if (m_tok.peek().type == Tokenizer::TOK_BRANCH_REFERENCE) {
-		m_pattern.type = PATTERN_TYPE_BRANCH_REFERENCE;
+		m_pattern->type = PATTERN_TYPE_BRANCH_REFERENCE;
 	} else {
-		m_pattern.type = PATTERN_TYPE_REFERENCE;
+		m_pattern->type = PATTERN_TYPE_REFERENCE;
 	}
 
 	m_tok.next();
@@ -85,11 +102,11 @@ void Parser::parseReferenceOrPointer() {
 	expectToken(Tokenizer::TOK_PAREN_CLOSE);
 	m_tok.next();
 
-	m_pattern.outputOffset = parseOffset();
+	m_pattern->outputOffset = parseOffset();
 }
 
 void Parser::parseOffsetPattern() {
-	m_pattern.type = PATTERN_TYPE_OFFSET;
+	m_pattern->type = PATTERN_TYPE_OFFSET;
 	parsePatternBody();
 }
 
@@ -105,10 +122,10 @@ void Parser::parsePatternBody() {
 		expectToken(Tokenizer::TOK_PAREN_CLOSE);
 		m_tok.next();
 
-		m_pattern.inputOffset = parseOffset();
+		m_pattern->inputOffset = parseOffset();
 	} else {
 		while (parsePatternData());
-		m_pattern.inputOffset = parseOffset();
+		m_pattern->inputOffset = parseOffset();
 	}
 }
 
@@ -144,8 +161,8 @@ void Parser::parseHexMask() {
 			byte |= hex2byte(value[i + 1]);
 		}
 
-		m_pattern.bytes.push_back(byte);
-		m_pattern.masks.push_back(mask);
+		m_pattern->bytes.push_back(byte);
+		m_pattern->masks.push_back(mask);
 	}
 
 	m_tok.next();
@@ -164,46 +181,45 @@ void Parser::parseBinMask() {
 			mask |= bit;
 		}
 	}
-	m_pattern.bytes.push_back(byte);
-	m_pattern.masks.push_back(mask);
+	m_pattern->bytes.push_back(byte);
+	m_pattern->masks.push_back(mask);
 	m_tok.next();
 }
 
 void Parser::parseSubPattern(SubPatternType type, Tokenizer::TokenType openTag, Tokenizer::TokenType closeTag) {
-	PtrExp mainPattern = m_pattern;
+	PtrExp *mainPattern = m_pattern;
 
 	expectToken(openTag);
 	m_tok.next();
 
-	m_pattern = {};
+	PtrExp *subPattern = m_arena->alloc();
+	m_pattern = subPattern;
 	while (parsePatternData());
-
-	PtrExp subPattern = m_pattern;
 	m_pattern = mainPattern;
 
-	int offset = m_pattern.bytes.size();
-	m_pattern.subPatterns[offset] = {
+	int offset = m_pattern->bytes.size();
+	m_pattern->subPatterns[offset] = {
 		.type = type,
-		.pattern = std::make_shared<PtrExp>(subPattern),
+		.pattern = std::shared_ptr<PtrExp>(m_arena, subPattern),
 		.offset = offset,
 		.size = 0
 	};
 
 	if (type == SUB_PATTERN_TYPE_BRANCH_2B || type == SUB_PATTERN_TYPE_LDR_2B) {
 		for (int i = 0; i < 2; i++) {
-			m_pattern.bytes.push_back(0);
-			m_pattern.masks.push_back(0);
+			m_pattern->bytes.push_back(0);
+			m_pattern->masks.push_back(0);
 		}
-		m_pattern.subPatterns[offset].size = 2;
+		m_pattern->subPatterns[offset].size = 2;
 	} else if (type == SUB_PATTERN_TYPE_BRANCH_4B || type == SUB_PATTERN_TYPE_LDR_4B) {
 		for (int i = 0; i < 4; i++) {
-			m_pattern.bytes.push_back(0);
-			m_pattern.masks.push_back(0);
+			m_pattern->bytes.push_back(0);
+			m_pattern->masks.push_back(0);
 		}
-		m_pattern.subPatterns[offset].size = 4;
+		m_pattern->subPatterns[offset].size = 4;
 	}
 
-	m_pattern.inputOffset = parseOffset();
+	m_pattern->inputOffset = parseOffset();
 	skipWhitespaces();
 
 	expectToken(closeTag);
@@ -303,24 +319,42 @@ void Parser::skipWhitespaces() {
 		m_tok.next();
 }
 
+/*
+ * Hex numbers with or without 0x, parsed without copying the token.
+ * */
+template<typename T>
+static std::pair<bool, T> parseHexNumber(std::string_view value) {
+	if (value.size() > 2 && value[0] == '0' && (value[1] == 'x' || value[1] == 'X'))
+		value.remove_prefix(2);
+	T number = 0;
+	auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), number, 16);
+	return { ec == std::errc() && end == value.data() + value.size(), number };
+}
+
 int Parser::getTokenInt(const Tokenizer::Token &token) {
-	return stoi(getTokenStr(token), nullptr, 16);
+	auto [isValid, value] = parseHexNumber<int>(getTokenStr(token));
+	if (!isValid)
+		throw PatternError(this, "Invalid number");
+	return value;
 }
 
 uint32_t Parser::getTokenUInt(const Tokenizer::Token &token) {
-	return stoll(getTokenStr(token), nullptr, 16);
+	auto [isValid, value] = parseHexNumber<uint64_t>(getTokenStr(token));
+	if (!isValid)
+		throw PatternError(this, "Invalid number");
+	return value;
 }
 
-std::string Parser::getTokenStr(const Tokenizer::Token &token) {
+std::string_view Parser::getTokenStr(const Tokenizer::Token &token) {
 	return m_input.substr(token.start, token.end - token.start);
 }
 
 std::pair<int, int> Parser::getLocation() const {
-	return getLocByOffset(m_input, m_tok.offset());
+	return getLocByOffset(std::string(m_input), m_tok.offset());
 }
 
 std::string Parser::getCodeFrame(const std::pair<int, int> &loc) const {
-	return codeFrame(m_input, loc.first, loc.second);
+	return codeFrame(std::string(m_input), loc.first, loc.second);
 }
 
 }; // namespace Ptr89
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include "Pattern.h"
 #include "Tokenizer.h"
@@ -10,8 +11,10 @@ namespace Ptr89 {
 
 class Parser {
 	protected:
-		PtrExp m_pattern;
-		std::string m_input;
+		// Node being parsed, sub-patterns are parsed in place without copying the parent
+		PtrExp *m_pattern = nullptr;
+		std::shared_ptr<PtrExpArena> m_arena;
+		std::string_view m_input;
 		Tokenizer m_tok;
 		void parseReferenceOrPointer();
 		void parseOffsetPattern();
@@ -29,7 +32,7 @@ class Parser {
 		Tokenizer::TokenType getClosingToken(Tokenizer::TokenType tokenType);
 		int getTokenInt(const Tokenizer::Token &token);
 		uint32_t getTokenUInt(const Tokenizer::Token &token);
-		std::string getTokenStr(const Tokenizer::Token &token);
+		std::string_view getTokenStr(const Tokenizer::Token &token);
 
 		static inline int hex2byte(char c) {
 			if (c >= '0' && c <= '9')
@@ -41,7 +44,7 @@ class Parser {
 			return -1;
 		}
 	public:
-		std::shared_ptr<PtrExp> parse(const std::string &value);
+		std::shared_ptr<PtrExp> parse(std::string_view value, const std::shared_ptr<PtrExpArena> &arena);
 
 		std::pair<int, int> getLocation() const;
 		std::string getCodeFrame(const std::pair<int, int> &loc) const;
@@ -1,5 +1,6 @@
 #include "Pattern.h"
 #include "Parser.h"
+#include "ThreadPool.h"
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -7,6 +8,10 @@
 #include <cstdarg>
 #include <string>
 #include <inttypes.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <numeric>
 
 #include "utils.h"
 
@@ -16,7 +21,7 @@ static const char *MNEMONICS[] = { "EQ", "NE", "CS", "CC", "MI", "PL", "VS", "VC
 static const char *REGNAMES[] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9", "R10", "R11", "R12", "SP", "LR", "PC" };
 
 Pattern::DebugHandlerFunc Pattern::m_debugHandler = nullptr;
-int Pattern::m_debugLevel = 0;
+thread_local int Pattern::m_debugLevel = 0;
 
 PatternError::PatternError(const Parser *parser, const std::string &msg): std::runtime_error(getErrorMsg(parser, msg)) {
 
@@ -27,9 +32,22 @@ std::string PatternError::getErrorMsg(const Parser *parser, const std::string &m
 	return msg + " at line " + std::to_string(loc.first) + " column " + std::to_string(loc.second) + ".\n" + parser->getCodeFrame(loc);
 }
 
-std::shared_ptr<PtrExp> Pattern::parse(const std::string &pattern) {
+std::shared_ptr<PtrExp> Pattern::parse(std::string_view pattern) {
 	Parser parser;
-	return parser.parse(pattern);
+	return parser.parse(pattern, std::make_shared<PtrExpArena>());
+}
+
+/*
+ * All patterns share one arena, it is freed with the last pattern.
+ * */
+std::vector<std::shared_ptr<PtrExp>> Pattern::parseMany(const std::vector<std::string> &patterns) {
+	Parser parser;
+	auto arena = std::make_shared<PtrExpArena>();
+	std::vector<std::shared_ptr<PtrExp>> parsedPatterns;
+	parsedPatterns.reserve(patterns.size());
+	for (auto &pattern: patterns)
+		parsedPatterns.push_back(parser.parse(pattern, arena));
+	return parsedPatterns;
 }
 
 bool Pattern::fuzzyMatch(const uint8_t *bytes, const uint8_t *masks, int patternSize, const uint8_t *memory) {
@@ -109,7 +127,7 @@ bool Pattern::checkSubpatterns(const std::shared_ptr<PtrExp> &pattern, size_t of
 
 	debugSectionBegin();
 
-	for (auto it: pattern->subPatterns) {
+	for (const auto &it: pattern->subPatterns) {
 		const SubPtrExp &p = it.second;
 
 		switch (p.type) {
@@ -119,9 +137,8 @@ bool Pattern::checkSubpatterns(const std::shared_ptr<PtrExp> &pattern, size_t of
 					debug("Decoding THUMB B at %08" PRIu64 "X\n", memory.base + offset + p.offset);
 
 				auto [isThumb, thumbAddr] = decodeThumbB(memory.base + offset + p.offset, memory.data + offset + p.offset);
-				if (isThumb && inMemory(memory, thumbAddr, 4)) {
-					uint32_t fileOffset = thumbAddr - memory.base - p.pattern->inputOffset;
-					if (checkPattern(p.pattern, fileOffset, memory)) {
+				if (isThumb && isMapped(memory, thumbAddr, 4)) {
+					if (checkSubpatternAt(p.pattern, thumbAddr, memory)) {
 						debugSectionEnd();
 						return true;
 					}
@@ -138,10 +155,9 @@ bool Pattern::checkSubpatterns(const std::shared_ptr<PtrExp> &pattern, size_t of
 					debug("Try decoding THUMB BL/BLX at %08" PRIu64 "X\n", memory.base + offset + p.offset);
 
 				auto [isThumb, thumbAddr, isThumbBLX] = decodeThumbBL(memory.base + offset + p.offset, memory.data + offset + p.offset);
-				if (isThumb && inMemory(memory, thumbAddr, 4)) {
+				if (isThumb && isMapped(memory, thumbAddr, 4)) {
 					thumbAddr = resolveThunks(thumbAddr, memory);
-					uint32_t fileOffset = thumbAddr - memory.base - p.pattern->inputOffset;
-					if (checkPattern(p.pattern, fileOffset, memory)) {
+					if (checkSubpatternAt(p.pattern, thumbAddr, memory)) {
 						debugSectionEnd();
 						return true;
 					}
@@ -154,10 +170,9 @@ bool Pattern::checkSubpatterns(const std::shared_ptr<PtrExp> &pattern, size_t of
 					debug("Try decoding ARM B/BL/BLX at %08" PRIu64 "X\n", memory.base + offset + p.offset);
 
 				auto [isArm, armAddr, isArmBLX] = decodeArmBL(memory.base + offset + p.offset, memory.data + offset + p.offset);
-				if (isArm && inMemory(memory, armAddr, 4)) {
+				if (isArm && isMapped(memory, armAddr, 4)) {
 					armAddr = resolveThunks(armAddr, memory);
-					uint32_t fileOffset = armAddr - memory.base - p.pattern->inputOffset;
-					if (checkPattern(p.pattern, fileOffset, memory)) {
+					if (checkSubpatternAt(p.pattern, armAddr, memory)) {
 						debugSectionEnd();
 						return true;
 					}
@@ -174,8 +189,7 @@ bool Pattern::checkSubpatterns(const std::shared_ptr<PtrExp> &pattern, size_t of
 					auto [success, ptrAddr] = decodePointer(armLDR, memory);
 					if (success) {
 						ptrAddr = resolveThunks(ptrAddr, memory);
-						uint32_t fileOffset = ptrAddr - memory.base - p.pattern->inputOffset;
-						if (checkPattern(p.pattern, fileOffset, memory)) {
+						if (checkSubpatternAt(p.pattern, ptrAddr, memory)) {
 							debugSectionEnd();
 							return true;
 						}
@@ -199,8 +213,7 @@ bool Pattern::checkSubpatterns(const std::shared_ptr<PtrExp> &pattern, size_t of
 				if (isThumbLdr) {
 					auto [success, ptrAddr] = decodePointer(thumbLdrAddr, memory);
 					if (success) {
-						uint32_t fileOffset = ptrAddr - memory.base - p.pattern->inputOffset;
-						if (checkPattern(p.pattern, fileOffset, memory)) {
+						if (checkSubpatternAt(p.pattern, ptrAddr, memory)) {
 							debugSectionEnd();
 							return true;
 						}
@@ -224,8 +237,7 @@ bool Pattern::checkSubpatterns(const std::shared_ptr<PtrExp> &pattern, size_t of
 				if (isArmLdr) {
 					auto [success, ptrAddr] = decodePointer(armLdrAddr, memory);
 					if (success) {
-						uint32_t fileOffset = ptrAddr - memory.base - p.pattern->inputOffset;
-						if (checkPattern(p.pattern, fileOffset, memory)) {
+						if (checkSubpatternAt(p.pattern, ptrAddr, memory)) {
 							debugSectionEnd();
 							return true;
 						}
@@ -247,102 +259,163 @@ bool Pattern::checkSubpatterns(const std::shared_ptr<PtrExp> &pattern, size_t of
 	return false;
 }
 
+/*
+ * Sub-pattern at the address, in the other segment when the address is outside of the memory.
+ * */
+bool Pattern::checkSubpatternAt(const std::shared_ptr<PtrExp> &pattern, uint32_t addr, const Memory &memory) {
+	if (memory.segments && !inMemory(memory, addr)) {
+		auto *segment = findSegment(*memory.segments, addr);
+		if (segment)
+			return checkPattern(pattern, addr - segment->base - pattern->inputOffset, getSegmentMemory(memory, *segment));
+	}
+	return checkPattern(pattern, addr - memory.base - pattern->inputOffset, memory);
+}
+
+template<typename Trace>
 std::pair<bool, uint32_t> Pattern::decodeReference(uint32_t offset, const Memory &memory) {
 	offset &= ~1;
 
-	debug("Try decoding ARM LDR at %08X\n", memory.base + offset);
-	auto [isARM, armLDR, isArmThrunk] = decodeArmLDR(memory.base + offset, memory.data + offset);
+	// Instructions are decoded as 4 bytes, the tail of the memory is never an instruction
+	auto *instr = getMemoryData(memory, memory.base + offset, 4);
+	if (!instr)
+		return { false, 0 };
+
+	if constexpr (Trace::enabled)
+		debug("Try decoding ARM LDR at %08X\n", memory.base + offset);
+	auto [isARM, armLDR, isArmThrunk] = decodeArmLDR<Trace>(memory.base + offset, instr);
 	if (isARM) {
-		auto [success, addr] = decodePointer(armLDR, memory);
+		auto [success, addr] = decodePointer<Trace>(armLDR, memory);
 		if (success)
 			return { true, addr };
 	}
-	debug("FAIL: not instruction!\n");
+	if constexpr (Trace::enabled)
+		debug("FAIL: not instruction!\n");
 
-	debug("Try decoding THUMB LDR at %08X\n", memory.base + offset);
-	auto [isThumb, thumbLDR] = decodeThumbLDR(memory.base + offset, memory.data + offset);
+	if constexpr (Trace::enabled)
+		debug("Try decoding THUMB LDR at %08X\n", memory.base + offset);
+	auto [isThumb, thumbLDR] = decodeThumbLDR<Trace>(memory.base + offset, instr);
 	if (isThumb) {
-		auto [success, addr] = decodePointer(thumbLDR, memory);
+		auto [success, addr] = decodePointer<Trace>(thumbLDR, memory);
 		if (success)
 			return { true, addr };
 	}
-	debug("FAIL: not instruction!\n");
+	if constexpr (Trace::enabled)
+		debug("FAIL: not instruction!\n");
 
 	return { false, 0 };
 }
 
+template<typename Trace>
 std::pair<bool, uint32_t> Pattern::decodeBranchReference(uint32_t offset, const Memory &memory) {
-	if (m_debugHandler)
+	auto *instr = getMemoryData(memory, memory.base + offset, 4);
+	if (!instr)
+		return { false, 0 };
+
+	if constexpr (Trace::enabled)
 		debug("Try decoding THUMB BL/BLX at %08X\n", memory.base + offset);
 
-	auto [isThumb, thumbAddr, isThumbBLX] = decodeThumbBL(memory.base + offset, memory.data + offset);
-	if (isThumb && inMemory(memory, thumbAddr, 4)) {
-		thumbAddr = resolveThunks(thumbAddr, memory);
+	auto [isThumb, thumbAddr, isThumbBLX] = decodeThumbBL<Trace>(memory.base + offset, instr);
+	if (isThumb && isMapped(memory, thumbAddr, 4)) {
+		thumbAddr = resolveThunks<Trace>(thumbAddr, memory);
 		return { true, thumbAddr | (!isThumbBLX ? 1 : 0) };
 	} else {
-		if (m_debugHandler)
+		if constexpr (Trace::enabled)
 			debug("FAIL: not instruction!\n");
 	}
 
-	if (m_debugHandler)
+	if constexpr (Trace::enabled)
 		debug("Try decoding ARM B/BL/BLX at %08X\n", memory.base + offset);
 
-	auto [isArm, armAddr, isArmBLX] = decodeArmBL(memory.base + offset, memory.data + offset);
-	if (isArm && inMemory(memory, armAddr, 4)) {
-		armAddr = resolveThunks(armAddr, memory);
+	auto [isArm, armAddr, isArmBLX] = decodeArmBL<Trace>(memory.base + offset, instr);
+	if (isArm && isMapped(memory, armAddr, 4)) {
+		armAddr = resolveThunks<Trace>(armAddr, memory);
 		return { true, armAddr | (isArmBLX ? 1 : 0) };
 	} else {
-		if (m_debugHandler)
+		if constexpr (Trace::enabled)
 			debug("FAIL: not instruction!\n");
 	}
 
-	if (m_debugHandler)
+	if constexpr (Trace::enabled)
 		debug("Try decoding ARM THRUNK at %08X\n", memory.base + offset);
 
-	auto [isArmLdr, armLDR, isThunk] = decodeArmLDR(memory.base + offset, memory.data + offset);
+	auto [isArmLdr, armLDR, isThunk] = decodeArmLDR<Trace>(memory.base + offset, instr);
 	if (isArmLdr && isThunk) {
-		auto [success, ptrAddr] = decodePointer(armLDR, memory);
+		auto [success, ptrAddr] = decodePointer<Trace>(armLDR, memory);
 		if (success) {
-			ptrAddr = resolveThunks(ptrAddr, memory);
+			ptrAddr = resolveThunks<Trace>(ptrAddr, memory);
 			return { true, ptrAddr };
 		} else {
-			if (m_debugHandler)
+			if constexpr (Trace::enabled)
 				debug("FAIL: invalid pointer!\n");
 		}
 	} else {
-		if (m_debugHandler)
+		if constexpr (Trace::enabled)
 			debug("FAIL: not instruction!\n");
 	}
 
 	return { false, 0 };
 }
 
+template<typename Trace>
 std::pair<bool, uint32_t> Pattern::decodePointer(uint32_t addr, const Memory &memory) {
-	debug("Try decoding pointer at %08X\n", addr);
-	if (inMemory(memory, addr, 4)) {
-		uint32_t value = *reinterpret_cast<const uint32_t *>(memory.data + (addr - memory.base));
-		debug("Pointer address: %08X\n", value);
+	if constexpr (Trace::enabled)
+		debug("Try decoding pointer at %08X\n", addr);
+	auto *data = getMemoryData(memory, addr, 4);
+	if (data) {
+		uint32_t value = *reinterpret_cast<const uint32_t *>(data);
+		if constexpr (Trace::enabled)
+			debug("Pointer address: %08X\n", value);
 		return { true, value };
 	} else {
-		debug("FAIL: address is out of memory range!\n");
+		if constexpr (Trace::enabled)
+			debug("FAIL: address is out of memory range!\n");
 	}
 	return { false, 0 };
 }
 
+template<typename Trace>
 uint32_t Pattern::resolveThunks(uint32_t addr, const Memory &memory) {
-	if (inMemory(memory, addr, 4)) {
-		auto [isArmLdr, ldrAddr, isThunk] = decodeArmLDR(addr, memory.data + (addr - memory.base));
-		if (isThunk && inMemory(memory, ldrAddr)) {
-			uint32_t value = *reinterpret_cast<const uint32_t *>(memory.data + (ldrAddr - memory.base));
-			if (inMemory(memory, value)) {
-				debug("Found thrunk at %08X: PC->%08X\n", addr, value);
-				return resolveThunks(value, memory);
+	// Precomputed map has no debug output, veneers of the other segments are not in it
+	if constexpr (!Trace::enabled) {
+		if (memory.thunks && (!memory.segments || inMemory(memory, addr, 4)))
+			return memory.thunks->resolve(addr);
+	}
+
+	uint32_t chain[MAX_THUNKS_CHAIN];
+	uint32_t current = addr;
+	for (int depth = 0; depth < MAX_THUNKS_CHAIN; depth++) {
+		auto *instr = getMemoryData(memory, current, 4);
+		if (!instr)
+			return current;
+
+		auto [isArmLdr, ldrAddr, isThunk] = decodeArmLDR<Trace>(current, instr);
+		auto *literal = isThunk ? getMemoryData(memory, ldrAddr, 4) : nullptr;
+		if (!literal)
+			return current;
+
+		uint32_t value = *reinterpret_cast<const uint32_t *>(literal);
+		if (!isMapped(memory, value))
+			return current;
+
+		if constexpr (Trace::enabled)
+			debug("Found thrunk at %08X: PC->%08X\n", current, value);
+
+		// Malformed chain, the veneer is left unresolved
+		chain[depth] = current;
+		for (int i = 0; i <= depth; i++) {
+			if (chain[i] == value) {
+				if constexpr (Trace::enabled)
+					debug("FAIL: thrunks cycle at %08X!\n", value);
+				return addr;
 			}
 		}
+
+		current = value;
 	}
-	return addr;
+	return current;
 }
 
+template<typename Trace>
 std::pair<bool, Pattern::SearchResult> Pattern::decodeResult(const std::shared_ptr<PtrExp> &pattern, uint32_t offset, const Memory &memory) {
 	uint32_t address = memory.base + offset;
 
@@ -361,7 +434,7 @@ std::pair<bool, Pattern::SearchResult> Pattern::decodeResult(const std::shared_p
 
 		case PATTERN_TYPE_REFERENCE:
 		{
-			auto [success, value] = decodeReference(offset, memory);
+			auto [success, value] = decodeReference<Trace>(offset, memory);
 			if (success)
 				return { true, { address, offset, value + pattern->outputOffset } };
 		}
@@ -369,7 +442,7 @@ std::pair<bool, Pattern::SearchResult> Pattern::decodeResult(const std::shared_p
 
 		case PATTERN_TYPE_BRANCH_REFERENCE:
 		{
-			auto [success, value] = decodeBranchReference(offset, memory);
+			auto [success, value] = decodeBranchReference<Trace>(offset, memory);
 			if (success)
 				return { true, { address, offset, value + pattern->outputOffset } };
 		}
@@ -377,7 +450,7 @@ std::pair<bool, Pattern::SearchResult> Pattern::decodeResult(const std::shared_p
 
 		case PATTERN_TYPE_POINTER:
 		{
-			auto [success, value] = decodePointer(offset + memory.base, memory);
+			auto [success, value] = decodePointer<Trace>(offset + memory.base, memory);
 			if (success)
 				return { true, { address, offset, value + pattern->outputOffset } };
 		}
@@ -425,12 +498,307 @@ int Pattern::findAlignForPattern(const std::shared_ptr<PtrExp> &pattern, int ali
 	return align;
 }
 
-std::vector<Pattern::SearchResult> Pattern::find(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, size_t maxResults) {
-	int firstNonWildcardByte = 0;
+// Rough estimation of the byte frequency in the ARM/THUMB firmware
+static int getByteWeight(uint8_t byte) {
+	switch (byte) {
+		case 0x00:
+		case 0xFF:
+			return 16;
+		case 0x01:
+		case 0x1C:
+		case 0x20:
+		case 0x47:
+		case 0x60:
+		case 0x68:
+		case 0xB5:
+		case 0xBD:
+		case 0xE1:
+		case 0xE3:
+		case 0xE5:
+		case 0xF0:
+			return 4;
+	}
+	return 1;
+}
+
+static const Pattern::ByteHistogram &getDefaultHistogram() {
+	static const Pattern::ByteHistogram histogram = []() {
+		Pattern::ByteHistogram histogram;
+		for (int i = 0; i < 256; i++) {
+			histogram.counts[i] = getByteWeight(i);
+			histogram.total += histogram.counts[i];
+		}
+		return histogram;
+	}();
+	return histogram;
+}
+
+double Pattern::ByteHistogram::getProbability(uint8_t byte, uint8_t mask) const {
+	if (mask == 0x00)
+		return 1.0;
+
+	uint64_t matched = 0;
+	if (mask == 0xFF) {
+		matched = counts[byte];
+	} else {
+		for (int i = 0; i < 256; i++) {
+			if ((i & mask) == (byte & mask))
+				matched += counts[i];
+		}
+	}
+	return (matched + 1.0) / (total + 256.0);
+}
+
+std::shared_ptr<const Pattern::ByteHistogram> Pattern::createHistogram(const Memory &memory) {
+	// Interleaved counters avoid the store-to-load stalls on the repeated bytes
+	std::vector<uint64_t> counts(256 * 4);
+	size_t i = 0;
+	for (; i + 4 <= memory.size; i += 4) {
+		counts[memory.data[i]]++;
+		counts[256 + memory.data[i + 1]]++;
+		counts[512 + memory.data[i + 2]]++;
+		counts[768 + memory.data[i + 3]]++;
+	}
+	for (; i < memory.size; i++)
+		counts[memory.data[i]]++;
+
+	auto histogram = std::make_shared<ByteHistogram>();
+	for (int j = 0; j < 256; j++)
+		histogram->counts[j] = counts[j] + counts[256 + j] + counts[512 + j] + counts[768 + j];
+	histogram->total = memory.size;
+	return histogram;
+}
+
+uint64_t Pattern::hashMemory(const Memory &memory) {
+	return hash64(memory.data, memory.size);
+}
+
+Pattern::SearchPlan Pattern::createSearchPlan(const std::shared_ptr<PtrExp> &pattern, const Memory &memory) {
+	SearchPlan plan;
+	plan.patternSize = pattern->bytes.size();
+	plan.program = compile(pattern);
+
+	const ByteHistogram &histogram = memory.histogram ? *memory.histogram : getDefaultHistogram();
+
+	// Wildcard optimization
 	bool isTrulyWildcard = true;
-	int patternSize = pattern->bytes.size();
+	for (size_t i = 0; i < plan.patternSize; i++) {
+		if (pattern->masks[i] != 0x00) {
+			plan.matchOffset = i;
+			isTrulyWildcard = false;
+			break;
+		}
+	}
+	plan.matchSize = plan.patternSize - plan.matchOffset;
+	plan.matcher = MaskedMatcher(&pattern->bytes[plan.matchOffset], &pattern->masks[plan.matchOffset], plan.matchSize);
+
+	plan.align = findAlignForPattern(pattern, memory.align);
+	plan.skipSize = (plan.align == 1 ? plan.matchSize : plan.patternSize);
+
+	std::vector<double> probabilities(plan.patternSize);
+	for (size_t i = 0; i < plan.patternSize; i++)
+		probabilities[i] = histogram.getProbability(pattern->bytes[i], pattern->masks[i]);
+
+	// The most selective 4 bytes window for the prefix search
+	plan.isFast = plan.patternSize >= 4 && !isTrulyWildcard;
+	if (plan.isFast) {
+		double bestProbability = 2.0;
+		for (size_t i = 0; i + 4 <= plan.patternSize; i++) {
+			double probability = probabilities[i] * probabilities[i + 1] * probabilities[i + 2] * probabilities[i + 3];
+			if (probability < bestProbability) {
+				bestProbability = probability;
+				plan.anchor = i;
+			}
+		}
+		plan.prefixMask = *reinterpret_cast<const uint32_t *>(&pattern->masks[plan.anchor]);
+		plan.prefixValue = *reinterpret_cast<const uint32_t *>(&pattern->bytes[plan.anchor]) & plan.prefixMask;
+	}
 
-	std::vector<SearchResult> searchResults;
+	// Two least common exact bytes for the candidates prefilter
+	for (size_t i = 0; i < plan.patternSize && Scanner::getKernel() != SCAN_KERNEL_DISABLED; i++) {
+		if (pattern->masks[i] != 0xFF)
+			continue;
+
+		int slot = plan.probes.count;
+		if (slot == 2) {
+			if (probabilities[i] >= probabilities[plan.probes.offsets[1]])
+				continue;
+			slot = 1;
+		} else {
+			plan.probes.count++;
+		}
+
+		while (slot > 0 && probabilities[i] < probabilities[plan.probes.offsets[slot - 1]]) {
+			plan.probes.offsets[slot] = plan.probes.offsets[slot - 1];
+			plan.probes.bytes[slot] = plan.probes.bytes[slot - 1];
+			slot--;
+		}
+
+		plan.probes.offsets[slot] = i;
+		plan.probes.bytes[slot] = pattern->bytes[i];
+	}
+
+	// Without the exact bytes and the prefix window all pattern bytes are matched by one pass over the memory
+	if (plan.probes.count == 0 && !plan.isFast && Scanner::getKernel() != SCAN_KERNEL_DISABLED && ShiftAndMatcher::isSupported(pattern->masks.data(), plan.patternSize)) {
+		plan.isBitParallel = true;
+		plan.shiftAnd = ShiftAndMatcher(pattern->bytes.data(), pattern->masks.data(), plan.patternSize);
+	}
+
+	return plan;
+}
+
+template<typename Stats>
+std::pair<bool, Pattern::SearchResult> Pattern::verifyCandidate(const std::shared_ptr<PtrExp> &pattern, const SearchPlan &plan, size_t foundOffset, const Memory &memory, PtrProgramMemo &memo, Stats *stats) {
+	if (m_debugHandler)
+		debug("Possible result at %08" PRIu64 "X\n", memory.base + foundOffset);
+
+	// The tree is walked only for the debug trace
+	bool isMatched = m_debugHandler ?
+		checkSubpatterns(pattern, foundOffset, memory) :
+		checkProgramFollows(*plan.program, plan.program->nodes[0], foundOffset, memory, &memo, stats);
+
+	if (isMatched) {
+		auto [isDecoded, result] = m_debugHandler ?
+			decodeResult<DebugTrace>(pattern, foundOffset + pattern->inputOffset, memory) :
+			decodeResult<NoTrace>(pattern, foundOffset + pattern->inputOffset, memory);
+		if (isDecoded) {
+			if (m_debugHandler) {
+				debug("FOUND: address=%08X, offset=%08X, value=%08X\n", result.address, result.offset, result.value);
+				debug("\n");
+			}
+			return { true, result };
+		} else {
+			if constexpr (Stats::enabled)
+				stats->decodeFailures++;
+			debug("FAIL: can't decode result!\n");
+			debug("\n");
+		}
+	} else {
+		if constexpr (Stats::enabled)
+			stats->subPatternRejects++;
+		if (m_debugHandler) {
+			debug("FAIL: sub patterns not matched.\n");
+			debug("\n");
+		}
+	}
+	return { false, {} };
+}
+
+/*
+ * Optimized variant of checkPattern().
+ * Scans pattern offsets in [from, to) and calls onResult(offset, result) for every match.
+ * The callback returns the next offset to scan or SEARCH_STOP.
+ * */
+template<typename Stats, typename Callback>
+void Pattern::scanRange(const std::shared_ptr<PtrExp> &pattern, const SearchPlan &plan, const Memory &memory, size_t from, size_t to, PtrProgramMemo &memo, Callback onResult, Stats *stats) {
+	const uint8_t *matchData = memory.data + plan.matchOffset;
+
+	if constexpr (Stats::enabled)
+		stats->scannedBytes += to - from;
+
+	// Candidate passed the prefilter, true when it is matched by the pattern bytes
+	auto matchCandidate = [&](size_t offset) {
+		bool isMatched = plan.matcher.match(matchData + offset);
+		if constexpr (Stats::enabled) {
+			stats->candidates++;
+			stats->fuzzyRejects += !isMatched;
+		}
+		return isMatched;
+	};
+
+	auto checkCandidate = [&](size_t foundOffset) -> size_t {
+		auto [isFound, result] = verifyCandidate(pattern, plan, foundOffset, memory, memo, stats);
+		size_t next = isFound ? onResult(foundOffset, result) : foundOffset + plan.align;
+		if constexpr (Stats::enabled) {
+			stats->matches += isFound;
+			// The rest of the range is not scanned after the stop
+			if (next >= to)
+				stats->scannedBytes -= to - std::min(to, foundOffset + 1);
+		}
+		return next;
+	};
+
+	if (plan.probes.count > 0) {
+		size_t candidates[Scanner::MAX_CANDIDATES];
+		size_t i = from;
+		size_t scanFrom = from;
+		while (scanFrom < to) {
+			size_t scanNext;
+			size_t count = Scanner::scan(memory.data, scanFrom, to, plan.probes, candidates, Scanner::MAX_CANDIDATES, &scanNext);
+			for (size_t j = 0; j < count; j++) {
+				size_t offset = candidates[j];
+				if (offset < i || (offset % plan.align) != 0)
+					continue;
+				if (matchCandidate(offset)) {
+					i = checkCandidate(offset);
+					if (i >= to)
+						return;
+				}
+			}
+			scanFrom = std::max(scanNext, i);
+		}
+	} else if (plan.isBitParallel) {
+		// Offsets are already matched by the pattern bytes
+		size_t i = from;
+		plan.shiftAnd.scan(memory.data, from, to, [&](size_t offset) {
+			if (offset < i || (offset % plan.align) != 0)
+				return true;
+			if constexpr (Stats::enabled)
+				stats->candidates++;
+			i = checkCandidate(offset);
+			return i < to;
+		});
+	} else if (plan.isFast) {
+		for (size_t i = from; i < to; ) {
+			uint32_t memoryValue = *reinterpret_cast<const uint32_t *>(memory.data + i + plan.anchor);
+			if ((memoryValue & plan.prefixMask) == plan.prefixValue) {
+				if (matchCandidate(i)) {
+					i = checkCandidate(i);
+					continue;
+				}
+			}
+			i += plan.align;
+		}
+	} else {
+		for (size_t i = from; i < to; ) {
+			if (matchCandidate(i)) {
+				i = checkCandidate(i);
+				continue;
+			}
+			i += plan.align;
+		}
+	}
+}
+
+SearchStats &SearchStats::operator+=(const SearchStats &other) {
+	scannedBytes += other.scannedBytes;
+	candidates += other.candidates;
+	fuzzyRejects += other.fuzzyRejects;
+	for (size_t i = 0; i < std::size(follows); i++)
+		follows[i] += other.follows[i];
+	subPatternRejects += other.subPatternRejects;
+	decodeFailures += other.decodeFailures;
+	matches += other.matches;
+	elapsedUs += other.elapsedUs;
+	return *this;
+}
+
+std::vector<Pattern::SearchResult> Pattern::find(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, size_t maxResults, int threads, SearchStats *stats) {
+	if (!stats)
+		return findPattern<NoStats>(pattern, memory, maxResults, threads, nullptr);
+
+	auto start = std::chrono::steady_clock::now();
+	auto searchResults = findPattern(pattern, memory, maxResults, threads, stats);
+	stats->elapsedUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	return searchResults;
+}
+
+/*
+ * Checks and debug output common for all search variants.
+ * Returns false when the memory is not scanned: static value, empty or too large pattern.
+ * */
+std::pair<bool, Pattern::SearchPlan> Pattern::prepareSearch(const std::shared_ptr<PtrExp> &pattern, const Memory &memory) {
+	size_t patternSize = pattern->bytes.size();
 
 	if (m_debugHandler) {
 		debug("Searching pattern: %s\n", stringify(pattern).c_str());
@@ -441,172 +809,723 @@ std::vector<Pattern::SearchResult> Pattern::find(const std::shared_ptr<PtrExp> &
 	if (pattern->type == PATTERN_TYPE_STATIC_VALUE) {
 		debug("Static value: %08X\n", pattern->staticValue);
 		debug("\n");
-		searchResults.push_back({ 0, 0, pattern->staticValue });
-		return searchResults;
+		return { false, {} };
 	}
 
 	if (!patternSize) {
 		debug("FAIL: empty pattern!\n");
+		return { false, {} };
+	}
+
+	if (memory.size < patternSize) {
+		debug("FAIL: pattern is larger than memory!\n");
+		return { false, {} };
+	}
+
+	SearchPlan plan = createSearchPlan(pattern, memory);
+
+	debug("Search align: %d\n", plan.align);
+
+	if (plan.probes.count > 0) {
+		debug("Using %s candidates pattern matching algorithm.\n", Scanner::getKernelName(Scanner::getKernel()));
+		for (int i = 0; i < plan.probes.count; i++)
+			debug("Search probe: offset=%d, byte=%02X\n", plan.probes.offsets[i], plan.probes.bytes[i]);
+		debug("\n");
+	} else if (plan.isBitParallel) {
+		debug("Using bit-parallel pattern matching algorithm.\n");
+		debug("\n");
+	} else if (plan.isFast) {
+		debug("Using fast pattern matching algorithm.\n");
+		debug("Search prefix: offset=%d, mask=%08X, searchValue=%08X\n", plan.anchor, plan.prefixMask, plan.prefixValue);
+		debug("\n");
+	} else {
+		debug("Using slow pattern matching algorithm.\n");
+		debug("\n");
+	}
+
+	return { true, plan };
+}
+
+template<typename Stats>
+std::vector<Pattern::SearchResult> Pattern::findPattern(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, size_t maxResults, int threads, Stats *stats) {
+	std::vector<SearchResult> searchResults;
+
+	auto [isScan, plan] = prepareSearch(pattern, memory);
+	if (!isScan) {
+		if (pattern->type == PATTERN_TYPE_STATIC_VALUE)
+			searchResults.push_back({ 0, 0, pattern->staticValue });
 		return searchResults;
 	}
 
-	// Wildcard optimization
-	for (int i = 0; i < patternSize; i++) {
-		if (pattern->masks[i] != 0x00) {
-			firstNonWildcardByte = i;
-			isTrulyWildcard = false;
-			break;
+	size_t endOffset = memory.size - plan.patternSize + 1;
+
+	// Debug output must stay sequential
+	size_t threadsCnt = m_debugHandler ? 1 : ThreadPool::resolveThreads(threads);
+	size_t chunksCnt = std::min(threadsCnt, endOffset / SEARCH_MIN_CHUNK_SIZE);
+	if (chunksCnt > 1)
+		return findParallel(pattern, plan, memory, maxResults, chunksCnt, stats);
+
+	PtrProgramMemo memo;
+	scanRange(pattern, plan, memory, 0, endOffset, memo, [&](size_t offset, const SearchResult &result) {
+		searchResults.push_back(result);
+
+		if (maxResults && searchResults.size() >= maxResults) {
+			debug("Maximum search results are reached.\n");
+			return SEARCH_STOP;
 		}
+
+		return plan.nextOffset(offset);
+	}, stats);
+
+	return searchResults;
+}
+
+/*
+ * Results are passed to the callback in the address order as soon as they are found.
+ * Blocks of one batch are scanned by the different threads and merged like in findParallel(),
+ * so the memory usage is bounded by the matches of one batch.
+ * */
+void Pattern::find(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, const SearchCallback &onResult, int threads) {
+	auto [isScan, plan] = prepareSearch(pattern, memory);
+	if (!isScan) {
+		if (pattern->type == PATTERN_TYPE_STATIC_VALUE)
+			onResult({ 0, 0, pattern->staticValue });
+		return;
 	}
 
-	// Align optimization
-	int align = findAlignForPattern(pattern, memory.align);
-	if (align != 1)
-		firstNonWildcardByte = 0;
+	size_t endOffset = memory.size - plan.patternSize + 1;
+	ThreadPool pool(m_debugHandler ? 1 : threads);
 
-	debug("Search align: %d\n", align);
+	// Debug output must stay sequential
+	if (pool.threads() == 1 || endOffset / SEARCH_MIN_CHUNK_SIZE < 2) {
+		PtrProgramMemo memo;
+		scanRange(pattern, plan, memory, 0, endOffset, memo, [&](size_t offset, const SearchResult &result) {
+			return onResult(result) ? plan.nextOffset(offset) : SEARCH_STOP;
+		});
+		return;
+	}
 
-	/*
-	 * Optimized variant of checkPattern().
-	 */
-	auto *masks = &pattern->masks[firstNonWildcardByte];
-	auto *bytes = &pattern->bytes[firstNonWildcardByte];
-	int size = patternSize - firstNonWildcardByte;
+	size_t blockSize = SEARCH_BLOCK_SIZE - (SEARCH_BLOCK_SIZE % plan.align);
+	size_t batchSize = blockSize * pool.threads();
+	size_t nextOffset = 0;
+	std::vector<std::vector<std::pair<size_t, SearchResult>>> blocks(pool.threads());
+
+	for (size_t batchFrom = 0; batchFrom < endOffset; batchFrom += batchSize) {
+		size_t blocksCnt = std::min(static_cast<size_t>(pool.threads()), (endOffset - batchFrom + blockSize - 1) / blockSize);
+		pool.run(blocksCnt, [&](size_t index) {
+			auto &matches = blocks[index];
+			size_t from = batchFrom + index * blockSize;
+			PtrProgramMemo memo;
+			matches.clear();
+			scanRange(pattern, plan, memory, from, std::min(from + blockSize, endOffset), memo, [&](size_t offset, const SearchResult &result) {
+				matches.push_back({ offset, result });
+				return offset + plan.align;
+			});
+		});
+
+		for (size_t i = 0; i < blocksCnt; i++) {
+			for (auto &[offset, result]: blocks[i]) {
+				if (offset < nextOffset)
+					continue;
+				if (!onResult(result))
+					return;
+				nextOffset = plan.nextOffset(offset);
+			}
+		}
+	}
+}
 
-	if (size >= 4 && !isTrulyWildcard) { // faster
-		debug("Using fast pattern matching algorithm.\n");
+/*
+ * Each chunk collects all matches in its own range without skipping.
+ * The skip-after-match logic is applied when the chunks are merged in address order, so
+ * the results are exactly the same as in the single-threaded search.
+ * */
+template<typename Stats>
+std::vector<Pattern::SearchResult> Pattern::findParallel(const std::shared_ptr<PtrExp> &pattern, const SearchPlan &plan, const Memory &memory, size_t maxResults, size_t chunksCnt, Stats *stats) {
+	struct Chunk {
+		size_t from;
+		size_t to;
+		std::vector<std::pair<size_t, SearchResult>> matches;
+		Stats stats;
+	};
+
+	size_t endOffset = memory.size - plan.patternSize + 1;
+	size_t chunkSize = (endOffset + chunksCnt - 1) / chunksCnt;
+	chunkSize += (plan.align - (chunkSize % plan.align)) % plan.align;
+	size_t blockSize = SEARCH_BLOCK_SIZE - (SEARCH_BLOCK_SIZE % plan.align);
+
+	std::vector<Chunk> chunks;
+	for (size_t from = 0; from < endOffset; from += chunkSize)
+		chunks.push_back({ from, std::min(from + chunkSize, endOffset), {}, {} });
+
+	// Chunks after this one are not needed for the final result
+	std::atomic<size_t> lastNeededChunk = SIZE_MAX;
+
+	auto worker = [&](size_t index) {
+		auto &chunk = chunks[index];
+
+		/*
+		 * Greedy skip-after-match selection starting from the chunk beginning.
+		 * The real selection starts at most one pattern size later and loses at most one of these results.
+		 * So, when more than maxResults are selected, this chunk alone completes the search.
+		 * */
+		size_t selected = 0;
+		size_t nextSelected = chunk.from;
+		bool isCompleted = false;
+		PtrProgramMemo memo;
+
+		for (size_t blockFrom = chunk.from; blockFrom < chunk.to && !isCompleted; blockFrom += blockSize) {
+			if (index > lastNeededChunk.load(std::memory_order_relaxed))
+				return;
+
+			scanRange(pattern, plan, memory, blockFrom, std::min(blockFrom + blockSize, chunk.to), memo, [&](size_t offset, const SearchResult &result) {
+				chunk.matches.push_back({ offset, result });
+
+				if (offset >= nextSelected) {
+					selected++;
+					nextSelected = plan.nextOffset(offset);
+				}
 
-		uint32_t mask = *reinterpret_cast<uint32_t *>(masks);
-		uint32_t searchValue = *reinterpret_cast<uint32_t *>(bytes) & mask;
+				if (maxResults && selected > maxResults) {
+					isCompleted = true;
+					return SEARCH_STOP;
+				}
 
-		debug("Search prefix: mask=%08X, searchValue=%08X\n", mask, searchValue);
-		debug("\n");
+				return offset + plan.align;
+			}, &chunk.stats);
+		}
+
+		if (isCompleted) {
+			size_t current = lastNeededChunk.load();
+			while (index < current && !lastNeededChunk.compare_exchange_weak(current, index));
+		}
+	};
+
+	// One chunk per thread, every chunk is a task
+	ThreadPool pool(static_cast<int>(chunks.size()));
+	pool.run(chunks.size(), worker);
+
+	if constexpr (Stats::enabled) {
+		for (auto &chunk: chunks)
+			*stats += chunk.stats;
+	}
+
+	std::vector<SearchResult> searchResults;
+	size_t nextOffset = 0;
+	for (auto &chunk: chunks) {
+		for (auto &[offset, result]: chunk.matches) {
+			if (offset < nextOffset)
+				continue;
+
+			searchResults.push_back(result);
+
+			if (maxResults && searchResults.size() >= maxResults)
+				return searchResults;
+
+			nextOffset = plan.nextOffset(offset);
+		}
+	}
 
-		for (size_t i = firstNonWildcardByte; i < memory.size - patternSize + 1; i += align) {
+	return searchResults;
+}
+
+int Pattern::findExactWindow(const std::shared_ptr<PtrExp> &pattern, const Memory &memory) {
+	const ByteHistogram &histogram = memory.histogram ? *memory.histogram : getDefaultHistogram();
+	int patternSize = pattern->bytes.size();
+	int bestWindow = -1;
+	double bestProbability = 2.0;
+	for (int i = 0; i + 4 <= patternSize; i++) {
+		double probability = 1.0;
+		for (int j = i; j < i + 4 && probability > 0; j++) {
+			if (pattern->masks[j] != 0xFF) {
+				probability = -1;
+			} else {
+				probability *= histogram.getProbability(pattern->bytes[j], 0xFF);
+			}
+		}
+		if (probability > 0 && probability < bestProbability) {
+			bestProbability = probability;
+			bestWindow = i;
+		}
+	}
+	return bestWindow;
+}
+
+/*
+ * Searching many patterns with one pass over the memory.
+ * Every pattern is anchored by the 4 exact bytes, all anchors are stored in the one hash table.
+ * Patterns without exact 4 bytes are searched separately.
+ *
+ * Separate patterns and chunks of the pass are the tasks of the work-stealing pool.
+ * Chunks are merged like in findParallel(), so the results don't depend on the threads count.
+ * */
+std::vector<std::vector<Pattern::SearchResult>> Pattern::findMany(const std::vector<std::shared_ptr<PtrExp>> &patterns, const Memory &memory, size_t maxResultsPerPattern, int threads) {
+	struct Anchor {
+		uint32_t value;
+		uint32_t patternIndex;
+		int offset;
+	};
+
+	struct Match {
+		uint32_t patternIndex;
+		size_t offset;
+		SearchResult result;
+	};
+
+	struct Chunk {
+		size_t from;
+		size_t to;
+		std::vector<Match> matches;
+	};
+
+	// Debug output must stay sequential
+	if (m_debugHandler)
+		threads = 1;
+
+	std::vector<std::vector<SearchResult>> searchResults(patterns.size());
+	std::vector<SearchPlan> plans(patterns.size());
+	std::vector<Anchor> anchors;
+	std::vector<size_t> separatePatterns;
+
+	for (size_t i = 0; i < patterns.size(); i++) {
+		auto &pattern = patterns[i];
+		int window = -1;
+
+		// Debug output must stay the same as for the single pattern
+		if (!m_debugHandler && pattern->type != PATTERN_TYPE_STATIC_VALUE && pattern->bytes.size() <= memory.size)
+			window = findExactWindow(pattern, memory);
+
+		if (window < 0) {
+			separatePatterns.push_back(i);
+			continue;
+		}
+
+		plans[i] = createSearchPlan(pattern, memory);
+		anchors.push_back({ *reinterpret_cast<const uint32_t *>(&pattern->bytes[window]), static_cast<uint32_t>(i), window });
+	}
+
+	ThreadPool pool(threads);
+
+	std::vector<Chunk> chunks;
+	if (anchors.size() && memory.size >= 4) {
+		size_t endOffset = memory.size - 3;
+		size_t chunksCnt = 1;
+		if (pool.threads() > 1)
+			chunksCnt = std::max(static_cast<size_t>(1), std::min(static_cast<size_t>(pool.threads()) * 4, endOffset / SEARCH_MIN_CHUNK_SIZE));
+		size_t chunkSize = (endOffset + chunksCnt - 1) / chunksCnt;
+		for (size_t from = 0; from < endOffset; from += chunkSize)
+			chunks.push_back({ from, std::min(from + chunkSize, endOffset), {} });
+	}
+
+	std::sort(anchors.begin(), anchors.end(), [](const Anchor &a, const Anchor &b) {
+		return a.value < b.value || (a.value == b.value && a.patternIndex < b.patternIndex);
+	});
+
+	// Bloom-like prefilter, most of the memory words are rejected by one bit test
+	auto filterHash = [](uint32_t value) {
+		return (value * 0x9E3779B1U) >> (32 - MULTI_SEARCH_FILTER_BITS);
+	};
+	std::vector<uint64_t> filter((1 << MULTI_SEARCH_FILTER_BITS) / 64);
+	for (auto &anchor: anchors) {
+		uint32_t hash = filterHash(anchor.value);
+		filter[hash / 64] |= 1ULL << (hash % 64);
+	}
+
+	// Chunks after this one are not needed for the pattern results
+	std::vector<std::atomic<size_t>> lastNeededChunks(patterns.size());
+	for (auto &lastNeededChunk: lastNeededChunks)
+		lastNeededChunk.store(SIZE_MAX, std::memory_order_relaxed);
+
+	auto scanChunk = [&](size_t index) {
+		struct State {
+			size_t nextOffset = 0;
+			size_t selected = 0;
+			bool isDone = false;
+		};
+
+		/*
+		 * The first chunk selects the matches exactly as the sequential search.
+		 * Other chunks collect all matches and count the greedy selection, see findParallel().
+		 * */
+		auto &chunk = chunks[index];
+		bool isFirst = (index == 0);
+		size_t neededResults = isFirst ? maxResultsPerPattern : maxResultsPerPattern + 1;
+		std::vector<State> states(patterns.size());
+		size_t activeAnchors = anchors.size();
+		PtrProgramMemo memo;
+
+		for (size_t i = chunk.from; i < chunk.to && activeAnchors > 0; i++) {
 			uint32_t memoryValue = *reinterpret_cast<const uint32_t *>(memory.data + i);
-			if ((memoryValue & mask) == searchValue) {
-				if (size == 4 || fuzzyMatch(bytes + 4, masks + 4, size -  4, memory.data + i + 4)) {
-					size_t foundOffset = i - firstNonWildcardByte;
+			uint32_t hash = filterHash(memoryValue);
+			if (!(filter[hash / 64] & (1ULL << (hash % 64))))
+				continue;
+
+			auto it = std::lower_bound(anchors.begin(), anchors.end(), memoryValue, [](const Anchor &anchor, uint32_t value) {
+				return anchor.value < value;
+			});
+
+			for (; it != anchors.end() && it->value == memoryValue; it++) {
+				auto &pattern = patterns[it->patternIndex];
+				auto &plan = plans[it->patternIndex];
+				auto &state = states[it->patternIndex];
+
+				if (state.isDone || i < static_cast<size_t>(it->offset))
+					continue;
+
+				if (index > lastNeededChunks[it->patternIndex].load(std::memory_order_relaxed)) {
+					state.isDone = true;
+					activeAnchors--;
+					continue;
+				}
 
-					if (m_debugHandler)
-						debug("Possible result at %08" PRIu64 "X\n", memory.base + foundOffset);
-
-					if (checkSubpatterns(pattern, foundOffset, memory)) {
-						auto [isDecoded, result] = decodeResult(pattern, foundOffset + pattern->inputOffset, memory);
-						if (isDecoded) {
-							searchResults.push_back(result);
-
-							if (m_debugHandler) {
-								debug("FOUND: address=%08X, offset=%08X, value=%08X\n", result.address, result.offset, result.value);
-								debug("\n");
-							}
-
-							if (maxResults && searchResults.size() >= maxResults) {
-								debug("Maximum search results are reached.\n");
-								break;
-							}
-
-							if (align == 1) {
-								i += size - 1;
-							} else {
-								i += size;
-								if ((i % align) != 0)
-									i += align - (i % align);
-								i -= align;
-							}
-						} else {
-							debug("FAIL: can't decode result!\n");
-							debug("\n");
-						}
-					} else {
-						if (m_debugHandler) {
-							debug("FAIL: sub patterns not matched.\n");
-							debug("\n");
-						}
-					}
+				size_t foundOffset = i - it->offset;
+				if ((foundOffset % plan.align) != 0 || (isFirst && foundOffset < state.nextOffset))
+					continue;
+				if (foundOffset + plan.patternSize > memory.size)
+					continue;
+				if (!plan.matcher.match(memory.data + foundOffset + plan.matchOffset))
+					continue;
+
+				memo.setProgram(it->patternIndex);
+				auto [isFound, result] = verifyCandidate(pattern, plan, foundOffset, memory, memo);
+				if (!isFound)
+					continue;
+
+				chunk.matches.push_back({ it->patternIndex, foundOffset, result });
+
+				if (foundOffset >= state.nextOffset) {
+					state.selected++;
+					state.nextOffset = plan.nextOffset(foundOffset);
+				}
+
+				if (maxResultsPerPattern && state.selected >= neededResults) {
+					state.isDone = true;
+					activeAnchors--;
+
+					auto &lastNeededChunk = lastNeededChunks[it->patternIndex];
+					size_t current = lastNeededChunk.load();
+					while (index < current && !lastNeededChunk.compare_exchange_weak(current, index));
 				}
 			}
 		}
-	} else {
-		debug("Using slow pattern matching algorithm.\n");
-		debug("\n");
+	};
 
-		for (size_t i = firstNonWildcardByte; i < memory.size - patternSize + 1; i += align) {
-			if (fuzzyMatch(bytes, masks, size, memory.data + i)) {
-				size_t foundOffset = i - firstNonWildcardByte;
-				if (m_debugHandler)
-					debug("Possible result at %08" PRIu64 "X\n", memory.base + foundOffset);
-				if (checkSubpatterns(pattern, foundOffset, memory)) {
-					auto [isDecoded, result] = decodeResult(pattern, foundOffset + pattern->inputOffset, memory);
-					if (isDecoded) {
-						searchResults.push_back(result);
-
-						if (m_debugHandler) {
-							debug("FOUND: address=%08X, offset=%08X, value=%08X\n", result.address, result.offset, result.value);
-							debug("\n");
-						}
+	// Only the single task can use all threads by itself
+	size_t tasksCnt = separatePatterns.size() + chunks.size();
+	int separateThreads = tasksCnt > 1 ? 1 : threads;
 
-						if (maxResults && searchResults.size() >= maxResults) {
-							debug("Maximum search results are reached.\n");
-							break;
-						}
+	pool.run(tasksCnt, [&](size_t taskIndex) {
+		if (taskIndex < separatePatterns.size()) {
+			size_t patternIndex = separatePatterns[taskIndex];
+			searchResults[patternIndex] = find(patterns[patternIndex], memory, maxResultsPerPattern, separateThreads);
+		} else {
+			scanChunk(taskIndex - separatePatterns.size());
+		}
+	});
+
+	std::vector<size_t> nextOffsets(patterns.size());
+	for (auto &chunk: chunks) {
+		for (auto &match: chunk.matches) {
+			auto &results = searchResults[match.patternIndex];
+			if (match.offset < nextOffsets[match.patternIndex])
+				continue;
+			if (maxResultsPerPattern && results.size() >= maxResultsPerPattern)
+				continue;
+
+			results.push_back(match.result);
+			nextOffsets[match.patternIndex] = plans[match.patternIndex].nextOffset(match.offset);
+		}
+	}
 
-						if (align == 1) {
-							i += size - 1;
-						} else {
-							i += size;
-							if ((i % align) != 0)
-								i += align - (i % align);
-							i -= align;
-						}
-					} else {
-						debug("FAIL: can't decode result!\n");
-						debug("\n");
-					}
-				} else {
-					if (m_debugHandler) {
-						debug("FAIL: sub patterns not matched.\n");
-						debug("\n");
-					}
-				}
+	return searchResults;
+}
+
+Pattern::StreamSearch::StreamSearch(const std::vector<std::shared_ptr<PtrExp>> &patterns, uint32_t base, int align, size_t maxResultsPerPattern, size_t windowSize) :
+	m_patterns(patterns), m_states(patterns.size()), m_results(patterns.size()), m_maxResults(maxResultsPerPattern), m_base(base)
+{
+	Memory memory = { base, nullptr, 0, align };
+
+	// Window offsets must keep the align of the whole memory
+	size_t alignUnit = 1;
+	size_t lookAhead = 1;
+
+	for (size_t i = 0; i < patterns.size(); i++) {
+		auto &pattern = patterns[i];
+		auto &state = m_states[i];
+
+		if (!isStreamable(pattern))
+			throw std::runtime_error("Pattern requires random access to the memory: " + stringify(pattern));
+
+		if (pattern->type == PATTERN_TYPE_STATIC_VALUE) {
+			m_results[i].push_back({ 0, 0, pattern->staticValue });
+			state.isDone = true;
+			continue;
+		}
+
+		if (pattern->bytes.empty()) {
+			state.isDone = true;
+			continue;
+		}
+
+		state.plan = createSearchPlan(pattern, memory);
+		alignUnit = std::lcm(alignUnit, static_cast<size_t>(state.plan.align));
+
+		// Result is decoded from the 4 bytes at the input offset
+		int patternSize = pattern->bytes.size();
+		m_history = std::max(m_history, static_cast<size_t>(std::max(0, -pattern->inputOffset)));
+		lookAhead = std::max(lookAhead, static_cast<size_t>(std::max(patternSize, pattern->inputOffset + 4)));
+		m_activePatterns++;
+	}
+
+	m_history = (m_history + alignUnit - 1) / alignUnit * alignUnit;
+	m_tail = lookAhead - 1;
+	m_windowSize = std::max({ windowSize, m_history, static_cast<size_t>(1) });
+	m_windowSize = (m_windowSize + alignUnit - 1) / alignUnit * alignUnit;
+	m_buffer.reserve(m_history + m_windowSize + m_tail);
+}
+
+bool Pattern::StreamSearch::isStreamable(const std::shared_ptr<PtrExp> &pattern) {
+	return isSelfContained(pattern);
+}
+
+void Pattern::StreamSearch::feed(const uint8_t *data, size_t size) {
+	while (size > 0 && !isDone()) {
+		size_t windowEnd = m_windowOffset + m_windowSize + m_tail;
+		size_t chunkSize = std::min(size, windowEnd - (m_bufferOffset + m_buffer.size()));
+		m_buffer.insert(m_buffer.end(), data, data + chunkSize);
+		data += chunkSize;
+		size -= chunkSize;
+
+		if (m_bufferOffset + m_buffer.size() < windowEnd)
+			break;
+
+		searchWindow(m_windowOffset, m_windowOffset + m_windowSize);
+		m_windowOffset += m_windowSize;
+
+		// Only the overlap with the next window is kept
+		size_t keepOffset = m_windowOffset - m_history;
+		m_buffer.erase(m_buffer.begin(), m_buffer.begin() + (keepOffset - m_bufferOffset));
+		m_bufferOffset = keepOffset;
+	}
+}
+
+std::vector<std::vector<Pattern::SearchResult>> Pattern::StreamSearch::finish() {
+	if (!isDone())
+		searchWindow(m_windowOffset, m_bufferOffset + m_buffer.size());
+	m_activePatterns = 0;
+	return std::move(m_results);
+}
+
+/*
+ * Scans pattern offsets in [from, to) of the stream.
+ * The buffer has the history before and the tail after, so every match is decoded as in the whole memory.
+ * */
+void Pattern::StreamSearch::searchWindow(size_t from, size_t to) {
+	Memory memory = { m_base + static_cast<uint32_t>(m_bufferOffset), m_buffer.data(), m_buffer.size(), 1 };
+
+	for (size_t i = 0; i < m_patterns.size(); i++) {
+		auto &state = m_states[i];
+		auto &plan = state.plan;
+		if (state.isDone || m_buffer.size() < plan.patternSize)
+			continue;
+
+		size_t scanFrom = std::max(from, state.nextOffset) - m_bufferOffset;
+		if ((scanFrom % plan.align) != 0)
+			scanFrom += plan.align - (scanFrom % plan.align);
+		size_t scanTo = std::min(to - m_bufferOffset, m_buffer.size() - plan.patternSize + 1);
+		if (scanFrom >= scanTo)
+			continue;
+
+		auto &results = m_results[i];
+		scanRange(m_patterns[i], plan, memory, scanFrom, scanTo, m_memo, [&](size_t offset, const SearchResult &result) {
+			results.push_back({ result.address, static_cast<uint32_t>(m_bufferOffset + result.offset), result.value });
+			state.nextOffset = plan.nextOffset(m_bufferOffset + offset);
+
+			if (m_maxResults && results.size() >= m_maxResults) {
+				state.isDone = true;
+				m_activePatterns--;
+				return SEARCH_STOP;
 			}
+
+			return state.nextOffset - m_bufferOffset;
+		});
+	}
+}
+
+/*
+ * Match of these patterns depends only on the bytes near the match, not on the branches and references targets.
+ * */
+bool Pattern::isSelfContained(const std::shared_ptr<PtrExp> &pattern) {
+	if (pattern->type == PATTERN_TYPE_STATIC_VALUE)
+		return true;
+	return (pattern->type == PATTERN_TYPE_OFFSET || pattern->type == PATTERN_TYPE_POINTER) && pattern->subPatterns.empty();
+}
+
+/*
+ * Same results as find() in the diff memory, prevResults are find() results with prevMaxResults in the previous memory.
+ * Offsets scanned by the previous search without a match are skipped when the bytes around them are not changed.
+ * Only the changed ranges, the ranges near them and the skipped bytes after the previous matches are scanned again.
+ * */
+std::vector<Pattern::SearchResult> Pattern::findIncremental(const std::shared_ptr<PtrExp> &pattern, const MemoryDiff &diff, const std::vector<SearchResult> &prevResults, size_t prevMaxResults, size_t maxResults) {
+	const Memory &memory = diff.getMemory();
+	const Memory &prevMemory = diff.getPrevMemory();
+	size_t patternSize = pattern->bytes.size();
+
+	// Debug output must stay the same as for the full search
+	if (m_debugHandler || !isSelfContained(pattern) || pattern->type == PATTERN_TYPE_STATIC_VALUE)
+		return find(pattern, memory, maxResults);
+	if (!patternSize || memory.size < patternSize || prevMemory.size < patternSize || (prevMaxResults && prevResults.size() > prevMaxResults))
+		return find(pattern, memory, maxResults);
+
+	// Offsets skipped by the other align or decoded with the other base are unknown
+	if (prevMemory.base != memory.base || prevMemory.align != memory.align)
+		return find(pattern, memory, maxResults);
+
+	SearchPlan plan = createSearchPlan(pattern, memory);
+	PtrProgramMemo memo;
+
+	// Previous results must be matched in the previous memory, otherwise they are from the other dump
+	std::vector<size_t> prevMatches;
+	for (auto &result: prevResults) {
+		int64_t offset = static_cast<int64_t>(result.offset) - pattern->inputOffset;
+		if (offset < 0 || offset + patternSize > prevMemory.size || (offset % plan.align) != 0)
+			return find(pattern, memory, maxResults);
+		if (prevMatches.size() > 0 && static_cast<size_t>(offset) < plan.nextOffset(prevMatches.back()))
+			return find(pattern, memory, maxResults);
+		if (!plan.matcher.match(prevMemory.data + offset + plan.matchOffset))
+			return find(pattern, memory, maxResults);
+		if (!verifyCandidate(pattern, plan, offset, prevMemory, memo).first)
+			return find(pattern, memory, maxResults);
+		prevMatches.push_back(offset);
+	}
+
+	// The previous search stopped after the last result
+	size_t prevScannedEnd = (prevMaxResults && prevMatches.size() >= prevMaxResults) ? prevMatches.back() + 1 : prevMemory.size;
+
+	// Result is decoded from the 4 bytes at the input offset
+	size_t lookBehind = std::max(0, -pattern->inputOffset);
+	size_t lookAhead = std::max(static_cast<int>(patternSize), pattern->inputOffset + 4);
+
+	// Offsets known to be not matched
+	std::vector<std::pair<size_t, size_t>> knownRanges;
+	for (auto &segment: diff.getSegments()) {
+		int64_t shift = static_cast<int64_t>(segment.offset) - static_cast<int64_t>(segment.prevOffset);
+		if ((shift % plan.align) != 0 || segment.size < lookBehind + lookAhead)
+			continue;
+
+		size_t prevFrom = segment.prevOffset + lookBehind;
+		size_t prevTo = std::min(segment.prevOffset + segment.size - lookAhead + 1, prevScannedEnd);
+
+		// Bytes after the previous matches were skipped and never checked
+		for (size_t i = 0; i <= prevMatches.size() && prevFrom < prevTo; i++) {
+			size_t to = (i < prevMatches.size() ? std::min(prevTo, prevMatches[i]) : prevTo);
+			if (prevFrom < to)
+				knownRanges.push_back({ prevFrom - segment.prevOffset + segment.offset, to - segment.prevOffset + segment.offset });
+			if (i < prevMatches.size())
+				prevFrom = std::max(prevFrom, plan.nextOffset(prevMatches[i]));
 		}
 	}
+	std::sort(knownRanges.begin(), knownRanges.end());
+
+	std::vector<SearchResult> searchResults;
+	size_t endOffset = memory.size - patternSize + 1;
+	size_t nextOffset = 0;
+	bool isCompleted = false;
+
+	auto scanUnknown = [&](size_t from, size_t to) {
+		from = std::max(from, nextOffset);
+		if ((from % plan.align) != 0)
+			from += plan.align - (from % plan.align);
+		if (from >= to)
+			return;
+
+		scanRange(pattern, plan, memory, from, to, memo, [&](size_t offset, const SearchResult &result) {
+			searchResults.push_back(result);
+			nextOffset = plan.nextOffset(offset);
+
+			if (maxResults && searchResults.size() >= maxResults) {
+				isCompleted = true;
+				return SEARCH_STOP;
+			}
+
+			return nextOffset;
+		});
+	};
+
+	size_t unknownFrom = 0;
+	for (auto &[from, to]: knownRanges) {
+		if (isCompleted)
+			break;
+		if (from > unknownFrom)
+			scanUnknown(unknownFrom, std::min(from, endOffset));
+		unknownFrom = std::max(unknownFrom, to);
+	}
+	if (!isCompleted && unknownFrom < endOffset)
+		scanUnknown(unknownFrom, endOffset);
 
 	return searchResults;
 }
 
 std::vector<Pattern::XRefSearchResult> Pattern::finXRefs(uint32_t addr, const Memory &memory, size_t maxResults) {
-	debug("Searching XRef's for %08X\n", addr);
 	std::vector<XRefSearchResult> searchResults;
-	for (size_t i = 0; i < memory.size; i += 2) {
-		auto [isReference, refAddr] = decodeReference(i, memory);
-		auto [isBranchReference, branchAddr] = decodeBranchReference(i, memory);
-		auto [isPointer, ptrAddr] = decodePointer(i + memory.base, memory);
+	finXRefs(addr, memory, [&](const XRefSearchResult &result) {
+		searchResults.push_back(result);
+		if (maxResults && searchResults.size() >= maxResults) {
+			debug("Maximum search results are reached.\n");
+			return false;
+		}
+		return true;
+	});
+	return searchResults;
+}
+
+void Pattern::finXRefs(uint32_t addr, const Memory &memory, const XRefSearchCallback &onResult) {
+	if (m_debugHandler) {
+		scanXRefs<DebugTrace>(addr, memory, onResult);
+	} else {
+		scanXRefs<NoTrace>(addr, memory, onResult);
+	}
+}
+
+template<typename Trace>
+void Pattern::scanXRefs(uint32_t addr, const Memory &memory, const XRefSearchCallback &onResult) {
+	if constexpr (Trace::enabled)
+		debug("Searching XRef's for %08X\n", addr);
+	// Instructions are decoded as 4 bytes, the tail must not be read past the end of the memory
+	for (size_t i = 0; i + 4 <= memory.size; i += 2) {
+		auto [isReference, refAddr] = decodeReference<Trace>(i, memory);
+		auto [isBranchReference, branchAddr] = decodeBranchReference<Trace>(i, memory);
+		auto [isPointer, ptrAddr] = decodePointer<Trace>(i + memory.base, memory);
+		bool isContinue = true;
 		if (isBranchReference && (branchAddr & ~1) == (addr & ~1)) {
-			debug("FOUND: branch call at %08" PRIu64 "X\n", i + memory.base);
-			searchResults.push_back({ XREF_TYPE_BRANCH_CALL, static_cast<uint32_t>(memory.base + i), static_cast<uint32_t>(i) });
+			if constexpr (Trace::enabled)
+				debug("FOUND: branch call at %08" PRIu64 "X\n", i + memory.base);
+			isContinue = onResult({ XREF_TYPE_BRANCH_CALL, static_cast<uint32_t>(memory.base + i), static_cast<uint32_t>(i) });
 		} else if (isReference && (refAddr & ~1) == (addr & ~1)) {
-			debug("FOUND: reference at %08" PRIu64 "X\n", i + memory.base);
-			searchResults.push_back({ XREF_TYPE_REFERENCE, static_cast<uint32_t>(memory.base + i), static_cast<uint32_t>(i) });
+			if constexpr (Trace::enabled)
+				debug("FOUND: reference at %08" PRIu64 "X\n", i + memory.base);
+			isContinue = onResult({ XREF_TYPE_REFERENCE, static_cast<uint32_t>(memory.base + i), static_cast<uint32_t>(i) });
 		} else if (isPointer && (ptrAddr & ~1) == (addr & ~1)) {
-			debug("FOUND: pointer at %08" PRIu64 "X\n", i + memory.base);
-			searchResults.push_back({ XREF_TYPE_POINTER, static_cast<uint32_t>(memory.base + i), static_cast<uint32_t>(i) });
+			if constexpr (Trace::enabled)
+				debug("FOUND: pointer at %08" PRIu64 "X\n", i + memory.base);
+			isContinue = onResult({ XREF_TYPE_POINTER, static_cast<uint32_t>(memory.base + i), static_cast<uint32_t>(i) });
 		}
 
-		if (maxResults && searchResults.size() >= maxResults) {
-			debug("Maximum search results are reached.\n");
+		if (!isContinue)
 			break;
-		}
 	}
-	return searchResults;
 }
 
 std::string Pattern::stringify(const std::shared_ptr<PtrExp> &pattern) {
 	std::string patternText;
 
+	if (pattern->type == PATTERN_TYPE_STATIC_VALUE)
+		return strprintf("<%08X>", pattern->staticValue);
+
 	if (pattern->type == PATTERN_TYPE_REFERENCE) {
 		patternText += "&(";
+	} else if (pattern->type == PATTERN_TYPE_BRANCH_REFERENCE) {
+		patternText += "&BL(";
 	} else if (pattern->type == PATTERN_TYPE_POINTER) {
 		patternText += "*(";
 	}
@@ -629,7 +1548,7 @@ std::string Pattern::stringify(const std::shared_ptr<PtrExp> &pattern) {
 			} else if (p.type == SUB_PATTERN_TYPE_LDR_4B) {
 				tmp.push_back("LDR{ " + stringify(p.pattern) + " }");
 			}
-			i += p.size;
+			i += p.size - 1;
 		} else {
 			if (mask == 0x00) {
 				tmp.push_back("??");
@@ -661,16 +1580,17 @@ std::string Pattern::stringify(const std::shared_ptr<PtrExp> &pattern) {
 
 	patternText += strJoin(" ", tmp);
 
-	if (pattern->type == PATTERN_TYPE_REFERENCE || pattern->type == PATTERN_TYPE_POINTER) {
+	if (pattern->type == PATTERN_TYPE_REFERENCE || pattern->type == PATTERN_TYPE_BRANCH_REFERENCE || pattern->type == PATTERN_TYPE_POINTER) {
 		patternText += ")";
 	}
 
 	if (pattern->outputOffset != 0)
-		patternText += strprintf(" %c 0x%X", pattern->inputOffset < 0 ? '-' : '+', abs(pattern->outputOffset));
+		patternText += strprintf(" %c 0x%X", pattern->outputOffset < 0 ? '-' : '+', abs(pattern->outputOffset));
 
 	return patternText;
 }
 
+template<typename Trace>
 std::tuple<bool, uint32_t, bool> Pattern::decodeThumbBL(uint32_t offset, const uint8_t *bytes) {
 	uint16_t thumb_instr1 = (bytes[1] << 8) | bytes[0];
 	uint16_t thumb_instr2 = (bytes[3] << 8) | bytes[2];
@@ -682,19 +1602,22 @@ std::tuple<bool, uint32_t, bool> Pattern::decodeThumbBL(uint32_t offset, const u
 		int32_t offset11_a = (int32_t) (signExtend(thumb_instr1 & 0x7FF, 11, 32) << 12);
 		uint32_t offset11_b = (thumb_instr2 & 0x7FF) << 1;
 		uint32_t addr = (offset + 4 + offset11_a + offset11_b) & 0xFFFFFFFC;
-		debug("%08X: %02X %02X %02X %02X  BLX #0x%08X\n", offset, bytes[0], bytes[1], bytes[2], bytes[3], addr);
+		if constexpr (Trace::enabled)
+			debug("%08X: %02X %02X %02X %02X  BLX #0x%08X\n", offset, bytes[0], bytes[1], bytes[2], bytes[3], addr);
 		return { true, addr, true };
 	} else if ((thumb_instr1 & 0xF800) == 0xF000 && (thumb_instr2 & 0xF800) == 0xF800) {
 		int32_t offset11_a = (int32_t) (signExtend(thumb_instr1 & 0x7FF, 11, 32) << 12);
 		uint32_t offset11_b = (thumb_instr2 & 0x7FF) << 1;
 		uint32_t addr = (offset + 4 + offset11_a + offset11_b);
-		debug("%08X: %02X %02X %02X %02X  BL #0x%08X\n", offset, bytes[0], bytes[1], bytes[2], bytes[3], addr);
+		if constexpr (Trace::enabled)
+			debug("%08X: %02X %02X %02X %02X  BL #0x%08X\n", offset, bytes[0], bytes[1], bytes[2], bytes[3], addr);
 		return { true, addr, false };
 	}
 
 	return { false, 0, false };
 }
 
+template<typename Trace>
 std::tuple<bool, uint32_t, bool> Pattern::decodeArmBL(uint32_t offset, const uint8_t *bytes) {
 	uint32_t instr = (bytes[3] << 24) | (bytes[2] << 16) | (bytes[1] << 8) | bytes[0];
 
@@ -705,12 +1628,13 @@ std::tuple<bool, uint32_t, bool> Pattern::decodeArmBL(uint32_t offset, const uin
 		int32_t offset24 = (int32_t) (signExtend(instr & 0xFFFFFF, 24, 30) << 2U);
 		uint32_t H = (instr & 0x01000000) != 0 ? 1 : 0;
 		uint32_t addr = (offset + 8 + offset24) + (H << 1);
-		debug("%08X: %02X %02X %02X %02X  BLX #0x%08X\n", offset, bytes[0], bytes[1], bytes[2], bytes[3], addr);
+		if constexpr (Trace::enabled)
+			debug("%08X: %02X %02X %02X %02X  BLX #0x%08X\n", offset, bytes[0], bytes[1], bytes[2], bytes[3], addr);
 		return { true, addr, true };
 	} else if (((instr & 0x0F000000) == 0x0B000000) || ((instr & 0x0F000000) == 0x0A000000)) {
 		int32_t offset24 = (int32_t) (signExtend(instr & 0xFFFFFF, 24, 30) << 2U);
 		uint32_t addr = (offset + 8 + offset24);
-		if (m_debugHandler) {
+		if constexpr (Trace::enabled) {
 			uint32_t cond = (instr & 0xF0000000) >> 28;
 			uint32_t L = (instr & 0x0F000000) == 0x0B000000;
 			debug("%08X: %02X %02X %02X %02X  B%s%s #0x%08X\n", offset, bytes[0], bytes[1], bytes[2], bytes[3], L ? "L" : "", MNEMONICS[cond], addr);
@@ -721,6 +1645,7 @@ std::tuple<bool, uint32_t, bool> Pattern::decodeArmBL(uint32_t offset, const uin
 	return { false, 0, false };
 }
 
+template<typename Trace>
 std::pair<bool, uint32_t> Pattern::decodeThumbB(uint32_t offset, const uint8_t *bytes) {
 	uint16_t instr = (bytes[1] << 8) | bytes[0];
 
@@ -730,12 +1655,13 @@ std::pair<bool, uint32_t> Pattern::decodeThumbB(uint32_t offset, const uint8_t *
 	if ((instr & 0xF800) == 0xE000) {
 		int32_t offset11 = (int32_t) (signExtend(instr & 0x7FF, 11, 32) << 1);
 		uint32_t addr = offset + 4 + offset11;
-		debug("%08X: %02X %02X        B #0x%08X\n", offset, bytes[0], bytes[1], addr);
+		if constexpr (Trace::enabled)
+			debug("%08X: %02X %02X        B #0x%08X\n", offset, bytes[0], bytes[1], addr);
 		return { true, addr };
 	} else if ((instr & 0xF000) == 0xD000) {
 		int32_t offset8 = (int32_t) (signExtend(instr & 0xFF, 8, 32) << 1);
 		uint32_t addr = offset + 4 + offset8;
-		if (m_debugHandler) {
+		if constexpr (Trace::enabled) {
 			uint32_t cond = (instr & 0x0F00) >> 8;
 			debug("%08X: %02X %02X        B%s #0x%08X\n", offset, bytes[0], bytes[1], MNEMONICS[cond], addr);
 		}
@@ -745,6 +1671,7 @@ std::pair<bool, uint32_t> Pattern::decodeThumbB(uint32_t offset, const uint8_t *
 	return { false, 0 };
 }
 
+template<typename Trace>
 std::pair<bool, uint32_t> Pattern::decodeThumbLDR(uint32_t offset, const uint8_t *bytes) {
 	uint16_t instr1 = (bytes[1] << 8) | bytes[0];
 
@@ -755,13 +1682,15 @@ std::pair<bool, uint32_t> Pattern::decodeThumbLDR(uint32_t offset, const uint8_t
 		uint32_t instr1_offset8 = (instr1 & 0xFF) << 2;
 		uint32_t instr1_Rd = (instr1 & 0x700) >> 8;
 		uint32_t addr = offset + (offset % 4 == 0 ? 4 : 2) + instr1_offset8;
-		debug("%08X: %02X %02X        LDR %s, [PC, #0x%X] ; 0x%08X\n", offset, bytes[0], bytes[1], REGNAMES[instr1_Rd], instr1_offset8, addr);
+		if constexpr (Trace::enabled)
+			debug("%08X: %02X %02X        LDR %s, [PC, #0x%X] ; 0x%08X\n", offset, bytes[0], bytes[1], REGNAMES[instr1_Rd], instr1_offset8, addr);
 		return { true, addr };
 	}
 
 	return { false, 0 };
 }
 
+template<typename Trace>
 std::tuple<bool, uint32_t, bool> Pattern::decodeArmLDR(uint32_t offset, const uint8_t *bytes) {
 	uint32_t instr = (bytes[3] << 24) | (bytes[2] << 16) | (bytes[1] << 8) | bytes[0];
 
@@ -774,7 +1703,7 @@ std::tuple<bool, uint32_t, bool> Pattern::decodeArmLDR(uint32_t offset, const ui
 		uint32_t addr = offset + 8 + offset_12;
 		uint32_t Rd = (instr & 0xF000) >> 12;
 
-		if (m_debugHandler) {
+		if constexpr (Trace::enabled) {
 			uint32_t cond = (instr & 0xF0000000) >> 28;
 			debug("%08X: %02X %02X %02X %02X  LDR%s %s, [PC, #%c0x%X] ; 0x%08X\n", offset, bytes[0], bytes[1], bytes[2], bytes[3],
 					MNEMONICS[cond], REGNAMES[Rd], U ? '+' : '-', abs(offset_12), addr);
@@ -786,6 +1715,22 @@ std::tuple<bool, uint32_t, bool> Pattern::decodeArmLDR(uint32_t offset, const ui
 	return { false, 0, false };
 }
 
+// Decoders are also used by XRefIndex, PtrProgram, the approximate search and the library users
+#define PTR89_INSTANTIATE_DECODERS(Trace) \
+	template std::tuple<bool, uint32_t, bool> Pattern::decodeThumbBL<Trace>(uint32_t offset, const uint8_t *bytes); \
+	template std::tuple<bool, uint32_t, bool> Pattern::decodeArmBL<Trace>(uint32_t offset, const uint8_t *bytes); \
+	template std::pair<bool, uint32_t> Pattern::decodeThumbB<Trace>(uint32_t offset, const uint8_t *bytes); \
+	template std::pair<bool, uint32_t> Pattern::decodeThumbLDR<Trace>(uint32_t offset, const uint8_t *bytes); \
+	template std::tuple<bool, uint32_t, bool> Pattern::decodeArmLDR<Trace>(uint32_t offset, const uint8_t *bytes); \
+	template std::pair<bool, uint32_t> Pattern::decodeReference<Trace>(uint32_t offset, const Memory &memory); \
+	template std::pair<bool, uint32_t> Pattern::decodeBranchReference<Trace>(uint32_t offset, const Memory &memory); \
+	template std::pair<bool, uint32_t> Pattern::decodePointer<Trace>(uint32_t addr, const Memory &memory); \
+	template uint32_t Pattern::resolveThunks<Trace>(uint32_t addr, const Memory &memory); \
+	template std::pair<bool, Pattern::SearchResult> Pattern::decodeResult<Trace>(const std::shared_ptr<PtrExp> &pattern, uint32_t offset, const Memory &memory);
+
+PTR89_INSTANTIATE_DECODERS(NoTrace)
+PTR89_INSTANTIATE_DECODERS(DebugTrace)
+
 void Pattern::debug(const char *format, ...) {
 	if (!m_debugHandler)
 		return;
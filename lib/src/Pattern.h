@@ -1,14 +1,19 @@
 #pragma once
 
 #include <cstddef>
+#include <functional>
 #include <memory>
 #include <map>
 #include <tuple>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <cstdio>
 #include <vector>
 #include <cstring>
+#include <span>
+#include <unordered_map>
+#include "Scanner.h"
 
 namespace Ptr89 {
 
@@ -58,6 +63,132 @@ struct PtrExp {
 	uint32_t staticValue = 0; // for PATTERN_TYPE_STATIC_VALUE
 };
 
+/*
+ * Storage for the parsed PtrExp nodes, freed all at once.
+ * Patterns hold the arena with the shared_ptr aliasing constructor, so a parsed tree costs
+ * a few block allocations instead of one make_shared per node.
+ * */
+class PtrExpArena {
+	public:
+		static constexpr size_t MIN_BLOCK_NODES = 4;
+		static constexpr size_t MAX_BLOCK_NODES = 256;
+
+		PtrExp *alloc();
+	private:
+		std::vector<std::unique_ptr<PtrExp[]>> m_blocks;
+		size_t m_blockSize = 0;
+		size_t m_blockUsed = 0;
+};
+
+/*
+ * PtrExp tree lowered into flat arrays, nodes[0] is the root pattern.
+ * Sub-patterns are referenced by index, so checking a candidate touches no maps and no shared_ptr's.
+ * */
+struct PtrProgram {
+	struct Node {
+		uint32_t bytesOffset;	// in bytes and masks
+		uint32_t size;
+		int inputOffset;
+		uint32_t followsOffset;	// in follows
+		uint32_t followsCount;
+		bool isStaticValue;
+		MaskedMatcher matcher;	// bytes and masks of the node
+	};
+
+	struct Follow {
+		SubPatternType type;
+		int offset;				// instruction offset from the start of the node
+		uint32_t node;			// sub-pattern at the instruction target
+	};
+
+	std::vector<Node> nodes;
+	std::vector<Follow> follows;
+	std::vector<uint8_t> bytes;
+	std::vector<uint8_t> masks;
+};
+
+/*
+ * Results of the sub-pattern checks during one search, keyed by the program node and the target offset.
+ * Popular callees are verified once instead of once per call site.
+ * Direct-mapped: a collision only evicts the older result.
+ * One memo can be shared by the different programs, each one selected by setProgram() before the check.
+ * */
+class PtrProgramMemo {
+	public:
+		static constexpr int SIZE_BITS = 14;
+
+		inline void setProgram(uint32_t programId) {
+			m_program = programId;
+		}
+
+		// -1 when the result is unknown
+		inline int get(uint32_t node, uint32_t offset) const {
+			if (m_entries.empty())
+				return -1;
+			uint64_t key = getKey(node, offset);
+			const auto &entry = m_entries[getSlot(key)];
+			return entry.key == key && entry.program == m_program ? entry.result : -1;
+		}
+
+		inline void set(uint32_t node, uint32_t offset, bool result) {
+			if (m_entries.empty())
+				m_entries.resize(1 << SIZE_BITS);
+			uint64_t key = getKey(node, offset);
+			m_entries[getSlot(key)] = { key, m_program, result };
+		}
+	private:
+		struct Entry {
+			uint64_t key;
+			uint32_t program;
+			bool result;
+		};
+		std::vector<Entry> m_entries;
+		uint32_t m_program = 0;
+
+		static inline uint64_t getKey(uint32_t node, uint32_t offset) {
+			return (static_cast<uint64_t>(node + 1) << 32) | offset;
+		}
+
+		inline size_t getSlot(uint64_t key) const {
+			return ((key ^ (static_cast<uint64_t>(m_program) << 48)) * 0x9E3779B97F4A7C15ULL) >> (64 - SIZE_BITS);
+		}
+};
+
+/*
+ * Tracing policies of the decoders and matchers.
+ * NoTrace removes all debug output at compile time, DebugTrace prints it when the debug handler is set.
+ * */
+struct NoTrace {
+	static constexpr bool enabled = false;
+};
+
+struct DebugTrace {
+	static constexpr bool enabled = true;
+};
+
+/*
+ * Matcher counters policies, the same way as the tracing policies.
+ * NoStats removes all counters at compile time, SearchStats collects them for the one search.
+ * */
+struct NoStats {
+	static constexpr bool enabled = false;
+};
+
+struct SearchStats {
+	static constexpr bool enabled = true;
+
+	uint64_t scannedBytes = 0;
+	uint64_t candidates = 0;			// offsets passed the prefix or probes filter
+	uint64_t fuzzyRejects = 0;			// candidates not matched by the pattern bytes
+	uint64_t follows[4] = {};			// sub-pattern instructions checked, by SubPatternType
+	uint64_t subPatternRejects = 0;		// candidates not matched by the sub-patterns
+	uint64_t decodeFailures = 0;		// sub-pattern instructions and results which can't be decoded
+	uint64_t matches = 0;				// candidates matched by the whole pattern
+	uint64_t elapsedUs = 0;
+
+	SearchStats &operator+=(const SearchStats &other);
+};
+
 class Parser;
 
 class PatternError: public std::runtime_error {
@@ -71,11 +202,33 @@ class Pattern {
 	public:
 		typedef typeof(vprintf) * DebugHandlerFunc;
 
+		struct ByteHistogram {
+			uint64_t total = 0;
+			uint64_t counts[256] = {};
+
+			// Probability that the random memory byte is matched by the masked byte
+			double getProbability(uint8_t byte, uint8_t mask) const;
+		};
+
+		class ThunkMap;
+
+		// Part of the address space: fullflash part, RAM dump, etc.
+		struct Segment {
+			uint32_t base;
+			const uint8_t *data;
+			size_t size;
+		};
+
+		typedef std::vector<Segment> SegmentList;
+
 		struct Memory {
 			uint32_t base;
 			const uint8_t *data;
 			size_t size;
 			int align = 1;
+			std::shared_ptr<const ByteHistogram> histogram = nullptr; // optional, improves the search planning
+			std::shared_ptr<const ThunkMap> thunks = nullptr; // optional, O(1) veneers resolving without the debug output
+			std::shared_ptr<const SegmentList> segments = nullptr; // optional, sorted by base, pointers and branches outside the memory are resolved in them
 		};
 
 		struct SearchResult {
@@ -84,33 +237,241 @@ class Pattern {
 			uint32_t value;
 		};
 
+		struct ApproxSearchResult {
+			SearchResult result;
+			int mismatches;
+		};
+
 		struct XRefSearchResult {
 			XRefType type;
 			uint32_t address;
 			uint32_t offset;
 		};
 
-		static std::shared_ptr<PtrExp> parse(const std::string &pattern);
+		// Results visitors, false stops the search
+		typedef std::function<bool(const SearchResult &result)> SearchCallback;
+		typedef std::function<bool(const XRefSearchResult &result)> XRefSearchCallback;
+
+		/*
+		 * All branches, references and pointers of the memory decoded once.
+		 * Returns the same results as finXRefs(), but each query is a binary search.
+		 * */
+		class XRefIndex {
+			public:
+				struct Entry {
+					uint32_t target;
+					uint32_t offset;
+				};
+
+				XRefIndex() = default;
+				static XRefIndex build(const Memory &memory, int threads = 1);
+				static std::pair<bool, XRefIndex> load(const std::string &path, const Memory &memory, uint64_t memoryHash);
+				void save(const std::string &path, uint64_t memoryHash) const;
+				std::vector<XRefSearchResult> find(uint32_t addr, size_t maxResults = 0) const;
+
+				inline size_t size() const {
+					return m_branches.size() + m_references.size() + m_pointers.size();
+				}
+			private:
+				Memory m_memory = {};
+				std::shared_ptr<const void> m_storage;	// owner of the entries: built vectors or the mapped cache file
+				std::span<const Entry> m_branches;		// sorted by target and offset
+				std::span<const Entry> m_references;	// sorted by target and offset
+				std::span<const uint32_t> m_pointers;	// offsets of all pointers, sorted by value and offset
+
+				inline uint32_t getPointerValue(uint32_t offset) const {
+					return *reinterpret_cast<const uint32_t *>(m_memory.data + offset) & ~1;
+				}
+
+				static size_t getPointersCount(const Memory &memory) {
+					return memory.size >= 4 ? (memory.size - 4) / 2 + 1 : 0;
+				}
+		};
+
+		/*
+		 * Final targets of all ARM "LDR PC, [PC, #x]" veneers of the memory.
+		 * Chains are resolved once by resolveThunks() rules, so cycles are resolved to the veneer itself.
+		 * */
+		class ThunkMap {
+			public:
+				static std::shared_ptr<const ThunkMap> build(const Memory &memory);
+
+				inline uint32_t resolve(uint32_t addr) const {
+					uint32_t index = (addr - m_base) >> 2;
+					if ((addr & 3) != 0 || addr < m_base || index >= m_veneersCnt)
+						return addr;
+					if (!(m_veneers[index >> 6] & (1ULL << (index & 63))))
+						return addr;
+					auto it = m_targets.find(addr);
+					return it != m_targets.end() ? it->second : addr;
+				}
+
+				inline size_t size() const {
+					return m_targets.size();
+				}
+			private:
+				uint32_t m_base = 0;						// 4-aligned base of the memory
+				size_t m_veneersCnt = 0;
+				std::vector<uint64_t> m_veneers;			// bitmap of the veneers, one bit per 4-aligned word
+				std::unordered_map<uint32_t, uint32_t> m_targets;
+		};
+
+		/*
+		 * Function starts of the memory: THUMB PUSH {..., LR} and ARM STMFD SP!, {..., LR} prologues and all BL/BLX targets.
+		 * Starts are sorted by address, the THUMB bit is set for the THUMB functions, so every query is a binary search.
+		 * */
+		class FunctionIndex {
+			public:
+				FunctionIndex() = default;
+				static FunctionIndex build(const Memory &memory, int threads = 1);
+
+				// Nearest function start at or before the address
+				std::pair<bool, uint32_t> findContaining(uint32_t addr) const;
+				std::pair<bool, uint32_t> findNext(uint32_t addr) const;
+				std::pair<bool, uint32_t> findPrev(uint32_t addr) const;
+				// Function starts in [from, to)
+				std::span<const uint32_t> findRange(uint32_t from, uint32_t to) const;
+
+				inline size_t size() const {
+					return m_functions.size();
+				}
+			private:
+				std::vector<uint32_t> m_functions;
+		};
+
+		/*
+		 * Byte-identical ranges of the two memories, e.g. two revisions of the same firmware.
+		 * Ranges can be shifted and reordered, every range is as long as possible.
+		 * */
+		class MemoryDiff {
+			public:
+				struct Segment {
+					size_t offset;			// in the memory
+					size_t prevOffset;		// in the previous memory
+					size_t size;
+				};
+
+				MemoryDiff() = default;
+				static MemoryDiff build(const Memory &prevMemory, const Memory &memory);
+				size_t getIdenticalSize() const;
+
+				inline const Memory &getMemory() const {
+					return m_memory;
+				}
+
+				inline const Memory &getPrevMemory() const {
+					return m_prevMemory;
+				}
+
+				inline const std::vector<Segment> &getSegments() const {
+					return m_segments;
+				}
+			private:
+				static constexpr size_t BLOCK_SIZE = 64;
+				static constexpr int FILTER_BITS = 22;
+
+				Memory m_prevMemory = {};
+				Memory m_memory = {};
+				std::vector<Segment> m_segments;		// sorted by offset
+
+				static size_t getCommonSize(const uint8_t *a, const uint8_t *b, size_t maxSize);
+		};
+
+		/*
+		 * Search results in the one memory with the one align, keyed by the canonical pattern text.
+		 * Results are reused for the same or smaller limit, or for any limit when the search was not limited.
+		 * */
+		class ResultCache {
+			public:
+				ResultCache() = default;
+				static ResultCache load(const std::string &path, const Memory &memory, uint64_t memoryHash);
+				void save(const std::string &path) const;
+				std::pair<bool, std::vector<SearchResult>> find(const std::string &key, size_t maxResults = 0) const;
+				void add(const std::string &key, size_t maxResults, const std::vector<SearchResult> &results);
+
+				inline size_t size() const {
+					return m_entries.size();
+				}
+
+				inline bool isChanged() const {
+					return m_isChanged;
+				}
+			private:
+				struct Entry {
+					uint32_t maxResults;	// 0 - unlimited
+					std::vector<SearchResult> results;
+				};
+
+				Memory m_memory = {};
+				uint64_t m_memoryHash = 0;
+				bool m_isChanged = false;
+				std::unordered_map<std::string, Entry> m_entries;
+
+				static bool isComplete(const Entry &entry, size_t maxResults);
+		};
+
+		class StreamSearch;
+
+		static std::shared_ptr<PtrExp> parse(std::string_view pattern);
+		static std::vector<std::shared_ptr<PtrExp>> parseMany(const std::vector<std::string> &patterns);
 		static std::string stringify(const std::shared_ptr<PtrExp> &pattern);
+		static std::shared_ptr<const ByteHistogram> createHistogram(const Memory &memory);
+		static uint64_t hashMemory(const Memory &memory);
 		static int findAlignForPattern(const std::shared_ptr<PtrExp> &pattern, int align);
-		static std::vector<SearchResult> find(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, size_t maxResults = 0);
+		static std::vector<SearchResult> find(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, size_t maxResults = 0, int threads = 1, SearchStats *stats = nullptr);
+		static void find(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, const SearchCallback &onResult, int threads = 1);
+		static std::vector<std::vector<SearchResult>> findMany(const std::vector<std::shared_ptr<PtrExp>> &patterns, const Memory &memory, size_t maxResultsPerPattern = 0, int threads = 1);
 		static std::vector<XRefSearchResult> finXRefs(uint32_t addr, const Memory &memory, size_t maxResults = 0);
+		static void finXRefs(uint32_t addr, const Memory &memory, const XRefSearchCallback &onResult);
+		static std::vector<ApproxSearchResult> findApprox(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, int maxMismatches, size_t maxResults = 0, int threads = 1);
+		static std::vector<SearchResult> findIncremental(const std::shared_ptr<PtrExp> &pattern, const MemoryDiff &diff, const std::vector<SearchResult> &prevResults, size_t prevMaxResults, size_t maxResults = 0);
+		static bool isSelfContained(const std::shared_ptr<PtrExp> &pattern);
 		static bool checkPattern(const std::shared_ptr<PtrExp> &pattern, size_t offset, const Memory &memory);
+		static bool checkPattern(const PtrProgram &program, size_t offset, const Memory &memory, PtrProgramMemo *memo = nullptr);
+		static std::shared_ptr<const PtrProgram> compile(const std::shared_ptr<PtrExp> &pattern);
+		template<typename Trace = DebugTrace>
 		static std::tuple<bool, uint32_t, bool> decodeThumbBL(uint32_t offset, const uint8_t *bytes);
+		template<typename Trace = DebugTrace>
 		static std::tuple<bool, uint32_t, bool> decodeArmBL(uint32_t offset, const uint8_t *bytes);
+		template<typename Trace = DebugTrace>
 		static std::pair<bool, uint32_t> decodeThumbB(uint32_t offset, const uint8_t *bytes);
+		template<typename Trace = DebugTrace>
 		static std::pair<bool, uint32_t> decodeThumbLDR(uint32_t offset, const uint8_t *bytes);
+		template<typename Trace = DebugTrace>
 		static std::tuple<bool, uint32_t, bool> decodeArmLDR(uint32_t offset, const uint8_t *bytes);
 		static std::pair<bool, uint32_t> decodeArmThrunk(uint32_t offset, const uint8_t *bytes);
+		template<typename Trace = DebugTrace>
 		static std::pair<bool, uint32_t> decodeReference(uint32_t offset, const Memory &memory);
+		template<typename Trace = DebugTrace>
 		static std::pair<bool, uint32_t> decodeBranchReference(uint32_t offset, const Memory &memory);
+		template<typename Trace = DebugTrace>
 		static std::pair<bool, uint32_t> decodePointer(uint32_t addr, const Memory &memory);
+		template<typename Trace = DebugTrace>
 		static uint32_t resolveThunks(uint32_t addr, const Memory &memory);
 
 		static inline bool inMemory(const Memory &memory, uint64_t addr, uint64_t size = 1) {
 			return addr >= memory.base && addr + size <= memory.base + memory.size;
 		}
 
+		// Bytes at the address in the memory or in the other segments, nullptr when the address is not mapped
+		static inline const uint8_t *getMemoryData(const Memory &memory, uint64_t addr, uint64_t size = 1) {
+			if (inMemory(memory, addr, size))
+				return memory.data + (addr - memory.base);
+			if (!memory.segments)
+				return nullptr;
+			auto *segment = findSegment(*memory.segments, addr, size);
+			return segment ? segment->data + (addr - segment->base) : nullptr;
+		}
+
+		static inline bool isMapped(const Memory &memory, uint64_t addr, uint64_t size = 1) {
+			return getMemoryData(memory, addr, size) != nullptr;
+		}
+
+		static std::shared_ptr<const SegmentList> createSegments(SegmentList segments);
+		static const Segment *findSegment(const SegmentList &segments, uint64_t addr, uint64_t size = 1);
+		static Memory getSegmentMemory(const Memory &memory, const Segment &segment);
+		static std::vector<Memory> getSegmentsMemory(const Memory &memory);
+
 		static void setDebugHandler(DebugHandlerFunc debugHandler) {
 			m_debugHandler = debugHandler;
 		}
@@ -131,11 +492,64 @@ class Pattern {
 		static void _debug(const char *format, ...)  __attribute__((format(printf, 1, 2)));
 		#endif
 	private:
+		static constexpr size_t SEARCH_STOP = SIZE_MAX;
+		static constexpr size_t SEARCH_BLOCK_SIZE = 1024 * 1024;
+		static constexpr size_t SEARCH_MIN_CHUNK_SIZE = 64 * 1024;
+		static constexpr int MULTI_SEARCH_FILTER_BITS = 18;
+		static constexpr int MAX_THUNKS_CHAIN = 16;
+
+		struct SearchPlan {
+			size_t patternSize = 0;
+			int matchOffset = 0;	// first non-wildcard byte
+			int matchSize = 0;		// bytes from the first non-wildcard byte to the end of the pattern
+			int skipSize = 0;		// bytes skipped after the match
+			int anchor = 0;			// offset of the 4 bytes window for the prefix search
+			int align = 1;
+			bool isFast = false;
+			uint32_t prefixMask = 0;
+			uint32_t prefixValue = 0;
+			ScanProbes probes;		// exact bytes for the vectorized candidates search
+			MaskedMatcher matcher;	// bytes from matchOffset to the end of the pattern
+			bool isBitParallel = false;
+			ShiftAndMatcher shiftAnd;	// patterns without the probes, see createSearchPlan()
+			std::shared_ptr<const PtrProgram> program;
+
+			// Next offset after the match, the matched bytes are skipped
+			inline size_t nextOffset(size_t offset) const {
+				size_t next = offset + skipSize;
+				if ((next % align) != 0)
+					next += align - (next % align);
+				return next;
+			}
+		};
+
 		static DebugHandlerFunc m_debugHandler;
-		static int m_debugLevel;
+		static thread_local int m_debugLevel;
 		static bool checkSubpatterns(const std::shared_ptr<PtrExp> &pattern, size_t offset, const Memory &memory);
+		static bool checkSubpatternAt(const std::shared_ptr<PtrExp> &pattern, uint32_t addr, const Memory &memory);
+		template<typename Stats = NoStats>
+		static bool checkProgramNode(const PtrProgram &program, uint32_t nodeIndex, size_t offset, const Memory &memory, PtrProgramMemo *memo, Stats *stats = nullptr);
+		template<typename Stats = NoStats>
+		static bool matchProgramNode(const PtrProgram &program, const PtrProgram::Node &node, size_t offset, const Memory &memory, PtrProgramMemo *memo, Stats *stats = nullptr);
+		template<typename Stats = NoStats>
+		static bool checkProgramFollows(const PtrProgram &program, const PtrProgram::Node &node, size_t offset, const Memory &memory, PtrProgramMemo *memo, Stats *stats = nullptr);
 		static bool fuzzyMatch(const uint8_t *bytes, const uint8_t *masks, int patternSize, const uint8_t *memory);
+		template<typename Trace>
+		static void scanXRefs(uint32_t addr, const Memory &memory, const XRefSearchCallback &onResult);
+		template<typename Trace>
 		static std::pair<bool, Pattern::SearchResult> decodeResult(const std::shared_ptr<PtrExp> &pattern, uint32_t offset, const Memory &memory);
+		template<typename Stats = NoStats>
+		static std::pair<bool, SearchResult> verifyCandidate(const std::shared_ptr<PtrExp> &pattern, const SearchPlan &plan, size_t foundOffset, const Memory &memory, PtrProgramMemo &memo, Stats *stats = nullptr);
+		static int findExactWindow(const std::shared_ptr<PtrExp> &pattern, const Memory &memory);
+		static SearchPlan createSearchPlan(const std::shared_ptr<PtrExp> &pattern, const Memory &memory);
+		static std::pair<bool, SearchPlan> prepareSearch(const std::shared_ptr<PtrExp> &pattern, const Memory &memory);
+		template<typename Stats>
+		static std::vector<SearchResult> findPattern(const std::shared_ptr<PtrExp> &pattern, const Memory &memory, size_t maxResults, int threads, Stats *stats);
+		template<typename Stats>
+		static std::vector<SearchResult> findParallel(const std::shared_ptr<PtrExp> &pattern, const SearchPlan &plan, const Memory &memory, size_t maxResults, size_t chunksCnt, Stats *stats);
+
+		template<typename Stats = NoStats, typename Callback>
+		static void scanRange(const std::shared_ptr<PtrExp> &pattern, const SearchPlan &plan, const Memory &memory, size_t from, size_t to, PtrProgramMemo &memo, Callback onResult, Stats *stats = nullptr);
 
 		static inline uint32_t signExtend(uint32_t value, int from, int to) {
 			if ((value & (1 << (from - 1))) != 0) {
@@ -149,4 +563,49 @@ class Pattern {
 		}
 };
 
+/*
+ * Search of the plain byte patterns in the memory received by parts, e.g. from a pipe.
+ * Only the current window with the overlap tails is kept in the memory.
+ * Windows are scanned in order, so the results are the same as find() over the whole memory.
+ * */
+class Pattern::StreamSearch {
+	public:
+		static constexpr size_t STREAM_WINDOW_SIZE = 4 * 1024 * 1024;
+
+		StreamSearch(const std::vector<std::shared_ptr<PtrExp>> &patterns, uint32_t base, int align = 1, size_t maxResultsPerPattern = 0, size_t windowSize = STREAM_WINDOW_SIZE);
+
+		// Patterns without branches and references to the other parts of the memory
+		static bool isStreamable(const std::shared_ptr<PtrExp> &pattern);
+
+		void feed(const uint8_t *data, size_t size);
+		std::vector<std::vector<SearchResult>> finish();
+
+		// All patterns reached the results limit, the rest of the stream is not needed
+		inline bool isDone() const {
+			return m_activePatterns == 0;
+		}
+	private:
+		struct State {
+			SearchPlan plan;
+			size_t nextOffset = 0;
+			bool isDone = false;
+		};
+
+		std::vector<std::shared_ptr<PtrExp>> m_patterns;
+		std::vector<State> m_states;
+		std::vector<std::vector<SearchResult>> m_results;
+		size_t m_activePatterns = 0;
+		size_t m_maxResults;
+		uint32_t m_base;
+		size_t m_windowSize;
+		size_t m_history = 0;			// bytes before the window, for the negative input offsets
+		size_t m_tail = 0;				// bytes after the window, for the matches starting at the window end
+		std::vector<uint8_t> m_buffer;
+		size_t m_bufferOffset = 0;		// stream offset of the first buffered byte
+		size_t m_windowOffset = 0;		// stream offset of the current window
+		PtrProgramMemo m_memo;
+
+		void searchWindow(size_t from, size_t to);
+};
+
 }; // namespace Ptr89
@@ -0,0 +1,176 @@
+#include "Pattern.h"
+
+namespace Ptr89 {
+
+static uint32_t compileNode(PtrProgram &program, const std::shared_ptr<PtrExp> &pattern) {
+	uint32_t nodeIndex = program.nodes.size();
+	program.nodes.push_back({});
+
+	PtrProgram::Node node = {};
+	node.bytesOffset = program.bytes.size();
+	node.size = pattern->bytes.size();
+	node.inputOffset = pattern->inputOffset;
+	node.isStaticValue = (pattern->type == PATTERN_TYPE_STATIC_VALUE);
+	program.bytes.insert(program.bytes.end(), pattern->bytes.begin(), pattern->bytes.end());
+	program.masks.insert(program.masks.end(), pattern->masks.begin(), pattern->masks.end());
+	node.matcher = MaskedMatcher(pattern->bytes.data(), pattern->masks.data(), pattern->bytes.size());
+
+	// Follows of the one node must be contiguous, so sub-patterns are compiled after them
+	node.followsOffset = program.follows.size();
+	node.followsCount = pattern->subPatterns.size();
+	for (auto &it: pattern->subPatterns)
+		program.follows.push_back({ it.second.type, it.second.offset, 0 });
+
+	uint32_t followIndex = node.followsOffset;
+	for (auto &it: pattern->subPatterns) {
+		uint32_t subNodeIndex = compileNode(program, it.second.pattern);
+		program.follows[followIndex++].node = subNodeIndex;
+	}
+
+	program.nodes[nodeIndex] = node;
+	return nodeIndex;
+}
+
+std::shared_ptr<const PtrProgram> Pattern::compile(const std::shared_ptr<PtrExp> &pattern) {
+	auto program = std::make_shared<PtrProgram>();
+	compileNode(*program, pattern);
+	return program;
+}
+
+bool Pattern::checkPattern(const PtrProgram &program, size_t offset, const Memory &memory, PtrProgramMemo *memo) {
+	return checkProgramNode(program, 0, offset, memory, memo);
+}
+
+template<typename Stats>
+bool Pattern::checkProgramNode(const PtrProgram &program, uint32_t nodeIndex, size_t offset, const Memory &memory, PtrProgramMemo *memo, Stats *stats) {
+	const auto &node = program.nodes[nodeIndex];
+
+	// Root is checked once per candidate anyway, only sub-patterns targets are repeated
+	if (!memo || nodeIndex == 0 || offset > UINT32_MAX)
+		return matchProgramNode(program, node, offset, memory, memo, stats);
+
+	int cached = memo->get(nodeIndex, offset);
+	if (cached >= 0)
+		return cached;
+
+	bool isMatched = matchProgramNode(program, node, offset, memory, memo, stats);
+	memo->set(nodeIndex, offset, isMatched);
+	return isMatched;
+}
+
+/*
+ * Same as checkPattern() and checkSubpatterns(), but without the debug output.
+ * */
+template<typename Stats>
+bool Pattern::matchProgramNode(const PtrProgram &program, const PtrProgram::Node &node, size_t offset, const Memory &memory, PtrProgramMemo *memo, Stats *stats) {
+	if (node.isStaticValue)
+		return true;
+	if (!node.size || offset + node.size >= memory.size)
+		return false;
+	if (!node.matcher.match(memory.data + offset))
+		return false;
+	return checkProgramFollows(program, node, offset, memory, memo, stats);
+}
+
+template<typename Stats>
+bool Pattern::checkProgramFollows(const PtrProgram &program, const PtrProgram::Node &node, size_t offset, const Memory &memory, PtrProgramMemo *memo, Stats *stats) {
+	if (!node.followsCount)
+		return true;
+
+	for (uint32_t i = node.followsOffset; i < node.followsOffset + node.followsCount; i++) {
+		const auto &follow = program.follows[i];
+		uint32_t instrAddr = memory.base + offset + follow.offset;
+		const uint8_t *instr = memory.data + offset + follow.offset;
+
+		// Targets in the other segments are checked without the memo, it is keyed by the offset
+		auto checkTarget = [&](uint32_t addr) {
+			int inputOffset = program.nodes[follow.node].inputOffset;
+			if (memory.segments && !inMemory(memory, addr)) {
+				auto *segment = findSegment(*memory.segments, addr);
+				if (segment)
+					return checkProgramNode(program, follow.node, addr - segment->base - inputOffset, getSegmentMemory(memory, *segment), nullptr, stats);
+			}
+			return checkProgramNode(program, follow.node, addr - memory.base - inputOffset, memory, memo, stats);
+		};
+
+		if constexpr (Stats::enabled)
+			stats->follows[follow.type]++;
+
+		switch (follow.type) {
+			case SUB_PATTERN_TYPE_BRANCH_2B:
+			{
+				auto [isThumb, thumbAddr] = decodeThumbB<NoTrace>(instrAddr, instr);
+				if (isThumb && isMapped(memory, thumbAddr, 4) && checkTarget(thumbAddr))
+					return true;
+
+				if constexpr (Stats::enabled)
+					stats->decodeFailures += !isThumb || !isMapped(memory, thumbAddr, 4);
+			}
+			break;
+
+			case SUB_PATTERN_TYPE_BRANCH_4B:
+			{
+				auto [isThumb, thumbAddr, isThumbBLX] = decodeThumbBL<NoTrace>(instrAddr, instr);
+				if (isThumb && isMapped(memory, thumbAddr, 4) && checkTarget(resolveThunks<NoTrace>(thumbAddr, memory)))
+					return true;
+
+				auto [isArm, armAddr, isArmBLX] = decodeArmBL<NoTrace>(instrAddr, instr);
+				if (isArm && isMapped(memory, armAddr, 4) && checkTarget(resolveThunks<NoTrace>(armAddr, memory)))
+					return true;
+
+				auto [isArmLdr, armLDR, isThunk] = decodeArmLDR<NoTrace>(instrAddr, instr);
+				if (isArmLdr && isThunk) {
+					auto [success, ptrAddr] = decodePointer<NoTrace>(armLDR, memory);
+					if (success && checkTarget(resolveThunks<NoTrace>(ptrAddr, memory)))
+						return true;
+				}
+
+				if constexpr (Stats::enabled)
+					stats->decodeFailures += !isThumb && !isArm && !(isArmLdr && isThunk);
+			}
+			break;
+
+			case SUB_PATTERN_TYPE_LDR_2B:
+			{
+				auto [isThumbLdr, thumbLdrAddr] = decodeThumbLDR<NoTrace>(instrAddr, instr);
+				if (isThumbLdr) {
+					auto [success, ptrAddr] = decodePointer<NoTrace>(thumbLdrAddr, memory);
+					if (success && checkTarget(ptrAddr))
+						return true;
+					if constexpr (Stats::enabled)
+						stats->decodeFailures += !success;
+				} else if constexpr (Stats::enabled) {
+					stats->decodeFailures++;
+				}
+			}
+			break;
+
+			case SUB_PATTERN_TYPE_LDR_4B:
+			{
+				auto [isArmLdr, armLdrAddr, isArmThrunk] = decodeArmLDR<NoTrace>(instrAddr, instr);
+				if (isArmLdr) {
+					auto [success, ptrAddr] = decodePointer<NoTrace>(armLdrAddr, memory);
+					if (success && checkTarget(ptrAddr))
+						return true;
+					if constexpr (Stats::enabled)
+						stats->decodeFailures += !success;
+				} else if constexpr (Stats::enabled) {
+					stats->decodeFailures++;
+				}
+			}
+			break;
+		}
+	}
+
+	return false;
+}
+
+#define PTR89_INSTANTIATE_PROGRAM(Stats) \
+	template bool Pattern::checkProgramNode<Stats>(const PtrProgram &program, uint32_t nodeIndex, size_t offset, const Memory &memory, PtrProgramMemo *memo, Stats *stats); \
+	template bool Pattern::matchProgramNode<Stats>(const PtrProgram &program, const PtrProgram::Node &node, size_t offset, const Memory &memory, PtrProgramMemo *memo, Stats *stats); \
+	template bool Pattern::checkProgramFollows<Stats>(const PtrProgram &program, const PtrProgram::Node &node, size_t offset, const Memory &memory, PtrProgramMemo *memo, Stats *stats);
+
+PTR89_INSTANTIATE_PROGRAM(NoStats)
+PTR89_INSTANTIATE_PROGRAM(SearchStats)
+
+}; // namespace Ptr89
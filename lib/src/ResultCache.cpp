@@ -0,0 +1,158 @@
+#include "Pattern.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <stdexcept>
+
+namespace Ptr89 {
+
+static const char RESULT_CACHE_MAGIC[8] = { 'P', 'T', 'R', '8', '9', 'R', 'S', 'C' };
+static const uint32_t RESULT_CACHE_VERSION = 1;
+
+/*
+ * Cache file layout: header, then entries.
+ * Entry: ResultCacheEntryHeader, key text, SearchResult[resultsCnt].
+ * */
+struct ResultCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t base;
+	uint64_t memoryHash;
+	uint64_t memorySize;
+	uint32_t align;
+	uint32_t entriesCnt;
+};
+
+struct ResultCacheEntryHeader {
+	uint32_t keySize;
+	uint32_t maxResults;
+	uint32_t resultsCnt;
+};
+
+Pattern::ResultCache Pattern::ResultCache::load(const std::string &path, const Memory &memory, uint64_t memoryHash) {
+	ResultCache cache;
+	cache.m_memory = memory;
+	cache.m_memoryHash = memoryHash;
+
+	std::error_code ec;
+	if (!std::filesystem::exists(path, ec))
+		return cache;
+
+	auto file = MappedFile::open(path);
+	if (file->size() < sizeof(ResultCacheHeader))
+		return cache;
+
+	ResultCacheHeader header;
+	memcpy(&header, file->data(), sizeof(header));
+	if (memcmp(header.magic, RESULT_CACHE_MAGIC, sizeof(RESULT_CACHE_MAGIC)) != 0 || header.version != RESULT_CACHE_VERSION)
+		return cache;
+
+	// The dump, base or align was changed
+	if (header.base != memory.base || header.memorySize != memory.size || header.memoryHash != memoryHash || header.align != static_cast<uint32_t>(memory.align))
+		return cache;
+
+	// Truncated or broken file is ignored as a whole
+	std::unordered_map<std::string, Entry> entries;
+	size_t offset = sizeof(header);
+	for (uint32_t i = 0; i < header.entriesCnt; i++) {
+		ResultCacheEntryHeader entryHeader;
+		if (file->size() - offset < sizeof(entryHeader))
+			return cache;
+		memcpy(&entryHeader, file->data() + offset, sizeof(entryHeader));
+		offset += sizeof(entryHeader);
+
+		size_t resultsSize = static_cast<size_t>(entryHeader.resultsCnt) * sizeof(SearchResult);
+		if (file->size() - offset < entryHeader.keySize + resultsSize)
+			return cache;
+
+		std::string key(reinterpret_cast<const char *>(file->data() + offset), entryHeader.keySize);
+		offset += entryHeader.keySize;
+
+		auto &entry = entries[key];
+		entry.maxResults = entryHeader.maxResults;
+		entry.results.resize(entryHeader.resultsCnt);
+		if (resultsSize)
+			memcpy(entry.results.data(), file->data() + offset, resultsSize);
+		offset += resultsSize;
+	}
+
+	if (offset != file->size())
+		return cache;
+
+	cache.m_entries = std::move(entries);
+	return cache;
+}
+
+void Pattern::ResultCache::save(const std::string &path) const {
+	ResultCacheHeader header = {};
+	memcpy(header.magic, RESULT_CACHE_MAGIC, sizeof(RESULT_CACHE_MAGIC));
+	header.version = RESULT_CACHE_VERSION;
+	header.base = m_memory.base;
+	header.memoryHash = m_memoryHash;
+	header.memorySize = m_memory.size;
+	header.align = m_memory.align;
+	header.entriesCnt = m_entries.size();
+
+	// Other processes can read the same cache, so the file is replaced atomically
+	std::string tmpPath = path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+	FILE *fp = fopen(tmpPath.c_str(), "wb");
+	if (!fp)
+		throw std::runtime_error("fopen(" + tmpPath + ") error: " + strerror(errno));
+
+	bool success = fwrite(&header, sizeof(header), 1, fp) == 1;
+	for (auto it = m_entries.begin(); success && it != m_entries.end(); it++) {
+		auto &[key, entry] = *it;
+		ResultCacheEntryHeader entryHeader = {
+			static_cast<uint32_t>(key.size()),
+			entry.maxResults,
+			static_cast<uint32_t>(entry.results.size())
+		};
+		success = fwrite(&entryHeader, sizeof(entryHeader), 1, fp) == 1;
+		if (success && key.size())
+			success = fwrite(key.data(), 1, key.size(), fp) == key.size();
+		if (success && entry.results.size())
+			success = fwrite(entry.results.data(), sizeof(SearchResult), entry.results.size(), fp) == entry.results.size();
+	}
+	success = (fclose(fp) == 0) && success;
+
+	if (!success) {
+		std::string error = strerror(errno);
+		std::filesystem::remove(tmpPath);
+		throw std::runtime_error("fwrite(" + tmpPath + ") error: " + error);
+	}
+
+	std::filesystem::rename(tmpPath, path);
+}
+
+/*
+ * Results of the limited search are the first results of the search with a larger limit.
+ * Less results than the limit means the whole memory was searched.
+ * */
+bool Pattern::ResultCache::isComplete(const Entry &entry, size_t maxResults) {
+	if (!entry.maxResults || entry.results.size() < entry.maxResults)
+		return true;
+	return maxResults && maxResults <= entry.maxResults;
+}
+
+std::pair<bool, std::vector<Pattern::SearchResult>> Pattern::ResultCache::find(const std::string &key, size_t maxResults) const {
+	auto it = m_entries.find(key);
+	if (it == m_entries.end() || !isComplete(it->second, maxResults))
+		return { false, {} };
+
+	auto &results = it->second.results;
+	size_t resultsCnt = maxResults ? std::min(maxResults, results.size()) : results.size();
+	return { true, { results.begin(), results.begin() + resultsCnt } };
+}
+
+void Pattern::ResultCache::add(const std::string &key, size_t maxResults, const std::vector<SearchResult> &results) {
+	auto it = m_entries.find(key);
+	if (it != m_entries.end() && isComplete(it->second, maxResults))
+		return;
+	m_entries[key] = { static_cast<uint32_t>(maxResults), results };
+	m_isChanged = true;
+}
+
+}; // namespace Ptr89
@@ -0,0 +1,257 @@
+#include "Scanner.h"
+#include <algorithm>
+#include <cstring>
+
+#if PTR89_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace Ptr89 {
+
+ScanKernel Scanner::m_kernel = Scanner::detectKernel();
+Scanner::ScanFunc Scanner::m_scanFunc = Scanner::getKernelFunc(Scanner::m_kernel);
+
+ScanKernel Scanner::detectKernel() {
+	#if PTR89_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SCAN_KERNEL_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return SCAN_KERNEL_SSE2;
+	#endif
+	return SCAN_KERNEL_SCALAR;
+}
+
+bool Scanner::isKernelSupported(ScanKernel kernel) {
+	switch (kernel) {
+		case SCAN_KERNEL_DISABLED:
+		case SCAN_KERNEL_AUTO:
+		case SCAN_KERNEL_SCALAR:
+			return true;
+		#if PTR89_X86_SIMD
+		case SCAN_KERNEL_SSE2:
+			return __builtin_cpu_supports("sse2");
+		case SCAN_KERNEL_AVX2:
+			return __builtin_cpu_supports("avx2");
+		#endif
+		default:
+			return false;
+	}
+}
+
+bool Scanner::setKernel(ScanKernel kernel) {
+	if (!isKernelSupported(kernel))
+		return false;
+	m_kernel = (kernel == SCAN_KERNEL_AUTO ? detectKernel() : kernel);
+	m_scanFunc = getKernelFunc(m_kernel);
+	return true;
+}
+
+const char *Scanner::getKernelName(ScanKernel kernel) {
+	switch (kernel) {
+		case SCAN_KERNEL_DISABLED:	return "disabled";
+		case SCAN_KERNEL_AUTO:		return "auto";
+		case SCAN_KERNEL_SCALAR:	return "scalar";
+		case SCAN_KERNEL_SSE2:		return "sse2";
+		case SCAN_KERNEL_AVX2:		return "avx2";
+	}
+	return "unknown";
+}
+
+Scanner::ScanFunc Scanner::getKernelFunc(ScanKernel kernel) {
+	switch (kernel) {
+		#if PTR89_X86_SIMD
+		case SCAN_KERNEL_SSE2:		return scanSSE2;
+		case SCAN_KERNEL_AVX2:		return scanAVX2;
+		#endif
+		default:					return scanScalar;
+	}
+}
+
+size_t Scanner::scanScalar(const uint8_t *data, size_t from, size_t to, const ScanProbes &probes, size_t *candidates, size_t maxCandidates, size_t *next) {
+	const uint8_t *first = data + probes.offsets[0];
+	const uint8_t *second = data + probes.offsets[probes.count - 1];
+	uint8_t firstByte = probes.bytes[0];
+	uint8_t secondByte = probes.bytes[probes.count - 1];
+
+	size_t count = 0;
+	size_t i = from;
+	while (i < to && count < maxCandidates) {
+		// memchr() is vectorized by libc on the most platforms
+		auto *found = static_cast<const uint8_t *>(memchr(first + i, firstByte, to - i));
+		if (!found) {
+			i = to;
+			break;
+		}
+		i = found - first;
+		if (second[i] == secondByte)
+			candidates[count++] = i;
+		i++;
+	}
+	*next = i;
+	return count;
+}
+
+#if PTR89_X86_SIMD
+__attribute__((target("sse2")))
+size_t Scanner::scanSSE2(const uint8_t *data, size_t from, size_t to, const ScanProbes &probes, size_t *candidates, size_t maxCandidates, size_t *next) {
+	const uint8_t *first = data + probes.offsets[0];
+	const uint8_t *second = data + probes.offsets[probes.count - 1];
+	const __m128i firstBytes = _mm_set1_epi8(probes.bytes[0]);
+	const __m128i secondBytes = _mm_set1_epi8(probes.bytes[probes.count - 1]);
+
+	size_t count = 0;
+	size_t i = from;
+	while (i + 16 <= to && count + 16 <= maxCandidates) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(second + i));
+		uint32_t bits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, firstBytes), _mm_cmpeq_epi8(b, secondBytes)));
+		while (bits) {
+			candidates[count++] = i + __builtin_ctz(bits);
+			bits &= bits - 1;
+		}
+		i += 16;
+	}
+
+	if (i + 16 > to && count + 16 <= maxCandidates) {
+		size_t tailCount = scanScalar(data, i, to, probes, candidates + count, maxCandidates - count, next);
+		return count + tailCount;
+	}
+
+	*next = i;
+	return count;
+}
+
+__attribute__((target("avx2")))
+size_t Scanner::scanAVX2(const uint8_t *data, size_t from, size_t to, const ScanProbes &probes, size_t *candidates, size_t maxCandidates, size_t *next) {
+	const uint8_t *first = data + probes.offsets[0];
+	const uint8_t *second = data + probes.offsets[probes.count - 1];
+	const __m256i firstBytes = _mm256_set1_epi8(probes.bytes[0]);
+	const __m256i secondBytes = _mm256_set1_epi8(probes.bytes[probes.count - 1]);
+
+	size_t count = 0;
+	size_t i = from;
+	while (i + 32 <= to && count + 32 <= maxCandidates) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(second + i));
+		uint32_t bits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, firstBytes), _mm256_cmpeq_epi8(b, secondBytes)));
+		while (bits) {
+			candidates[count++] = i + __builtin_ctz(bits);
+			bits &= bits - 1;
+		}
+		i += 32;
+	}
+
+	if (i + 32 > to && count + 32 <= maxCandidates) {
+		size_t tailCount = scanScalar(data, i, to, probes, candidates + count, maxCandidates - count, next);
+		return count + tailCount;
+	}
+
+	*next = i;
+	return count;
+}
+#endif
+
+MaskedMatcher::MaskedMatcher(const uint8_t *bytes, const uint8_t *masks, size_t size) {
+	if (size >= 16) {
+		m_width = 16;
+	} else if (size >= 8) {
+		m_width = 8;
+	} else if (size >= 4) {
+		m_width = 4;
+	} else {
+		m_width = 1;
+	}
+
+	if (size >= 8) {
+		uint8_t firstBytes[8];
+		for (int i = 0; i < 8; i++)
+			firstBytes[i] = bytes[i] & masks[i];
+		memcpy(&m_firstMask, masks, sizeof(m_firstMask));
+		memcpy(&m_firstBytes, firstBytes, sizeof(m_firstBytes));
+		m_isFirstWord = m_firstMask != 0;
+	}
+
+	for (size_t offset = 0; offset < size; offset += m_width) {
+		Block block = {};
+		block.offset = std::min(offset, size - m_width);
+		for (int i = 0; i < m_width; i++) {
+			block.masks[i] = masks[block.offset + i];
+			block.bytes[i] = bytes[block.offset + i] & block.masks[i];
+		}
+
+		bool isWildcard = true;
+		for (int i = 0; i < m_width; i++)
+			isWildcard = isWildcard && !block.masks[i];
+		if (!isWildcard)
+			m_blocks.push_back(block);
+	}
+}
+
+ShiftAndMatcher::ShiftAndMatcher(const uint8_t *bytes, const uint8_t *masks, size_t size) {
+	while (m_start < size && !masks[m_start])
+		m_start++;
+	size_t end = size;
+	while (end > m_start && !masks[end - 1])
+		end--;
+	m_size = end - m_start;
+
+	m_table.resize(256);
+	for (int value = 0; value < 256; value++) {
+		for (size_t i = 0; i < m_size; i++) {
+			uint8_t mask = masks[m_start + i];
+			if ((value & mask) == (bytes[m_start + i] & mask))
+				m_table[value] |= 1ULL << i;
+		}
+	}
+}
+
+bool ShiftAndMatcher::isSupported(const uint8_t *masks, size_t size) {
+	size_t start = 0;
+	while (start < size && !masks[start])
+		start++;
+	size_t end = size;
+	while (end > start && !masks[end - 1])
+		end--;
+	return end - start <= MAX_SIZE;
+}
+
+ShiftAddMatcher::ShiftAddMatcher(const uint8_t *bytes, const uint8_t *masks, size_t size, int maxMismatches) {
+	while (m_start < size && !masks[m_start])
+		m_start++;
+	size_t end = size;
+	while (end > m_start && !masks[end - 1])
+		end--;
+	m_size = end - m_start;
+
+	// More mismatches than the fixed bytes match everything
+	m_maxMismatches = std::clamp(maxMismatches, 0, static_cast<int>(m_size));
+	if (!m_size)
+		return;
+
+	// Counter must hold maxMismatches + 1 without the overflow bit
+	m_bits = 1;
+	while ((1 << (m_bits - 1)) <= m_maxMismatches)
+		m_bits++;
+
+	int fieldsPerWord = 64 / m_bits;
+	m_topShift = (fieldsPerWord - 1) * m_bits;
+	m_fieldsMask = fieldsPerWord * m_bits == 64 ? ~0ULL : (1ULL << (fieldsPerWord * m_bits)) - 1;
+	for (int i = 0; i < fieldsPerWord; i++)
+		m_highMask |= 1ULL << (i * m_bits + m_bits - 1);
+
+	m_words = (m_size + fieldsPerWord - 1) / fieldsPerWord;
+	m_lastWord = (m_size - 1) / fieldsPerWord;
+	m_lastShift = ((m_size - 1) % fieldsPerWord) * m_bits;
+
+	m_table.resize(256 * m_words);
+	for (int value = 0; value < 256; value++) {
+		for (size_t i = 0; i < m_size; i++) {
+			uint8_t mask = masks[m_start + i];
+			if ((value & mask) != (bytes[m_start + i] & mask))
+				m_table[value * m_words + i / fieldsPerWord] |= 1ULL << ((i % fieldsPerWord) * m_bits);
+		}
+	}
+}
+
+}; // namespace Ptr89
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PTR89_X86_SIMD 1
+#else
+#define PTR89_X86_SIMD 0
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Ptr89 {
+
+enum ScanKernel {
+	SCAN_KERNEL_DISABLED,		// no candidates prefilter, only for the benchmarks
+	SCAN_KERNEL_AUTO,
+	SCAN_KERNEL_SCALAR,
+	SCAN_KERNEL_SSE2,
+	SCAN_KERNEL_AVX2,
+};
+
+/*
+ * Exact bytes of the pattern used for the candidates prefilter.
+ * Offsets are relative to the pattern start.
+ * */
+struct ScanProbes {
+	int count = 0;
+	int offsets[2] = {};
+	uint8_t bytes[2] = {};
+};
+
+class Scanner {
+	public:
+		/*
+		 * Finds pattern offsets in [from, to) where all probe bytes are matched.
+		 * Returns number of the found candidates, stores the next offset to scan in *next.
+		 * */
+		typedef size_t (*ScanFunc)(const uint8_t *data, size_t from, size_t to, const ScanProbes &probes, size_t *candidates, size_t maxCandidates, size_t *next);
+
+		static constexpr size_t MAX_CANDIDATES = 256;
+
+		static bool setKernel(ScanKernel kernel);
+		static bool isKernelSupported(ScanKernel kernel);
+		static const char *getKernelName(ScanKernel kernel);
+
+		static ScanKernel getKernel() {
+			return m_kernel;
+		}
+
+		static inline size_t scan(const uint8_t *data, size_t from, size_t to, const ScanProbes &probes, size_t *candidates, size_t maxCandidates, size_t *next) {
+			return m_scanFunc(data, from, to, probes, candidates, maxCandidates, next);
+		}
+	private:
+		static ScanKernel m_kernel;
+		static ScanFunc m_scanFunc;
+
+		static ScanKernel detectKernel();
+		static ScanFunc getKernelFunc(ScanKernel kernel);
+		static size_t scanScalar(const uint8_t *data, size_t from, size_t to, const ScanProbes &probes, size_t *candidates, size_t maxCandidates, size_t *next);
+		#if PTR89_X86_SIMD
+		static size_t scanSSE2(const uint8_t *data, size_t from, size_t to, const ScanProbes &probes, size_t *candidates, size_t maxCandidates, size_t *next);
+		static size_t scanAVX2(const uint8_t *data, size_t from, size_t to, const ScanProbes &probes, size_t *candidates, size_t maxCandidates, size_t *next);
+		#endif
+};
+
+/*
+ * Pattern bytes and masks precompiled into 16 bytes blocks, checked with (memory & mask) == bytes.
+ * Exact, half-byte and bit-mask bytes cost the same, blocks without fixed bits are dropped.
+ * The last block overlaps the previous one instead of the padding, so no bytes past the pattern are read.
+ * Patterns shorter than a block use 8 or 4 bytes words in the same way.
+ * */
+class MaskedMatcher {
+	public:
+		static constexpr int BLOCK_SIZE = 16;
+
+		MaskedMatcher() = default;
+		MaskedMatcher(const uint8_t *bytes, const uint8_t *masks, size_t size);
+
+		inline bool match(const uint8_t *memory) const {
+			// Most candidates are rejected by the first word, it is checked without loading the blocks
+			if (m_isFirstWord) {
+				uint64_t value;
+				memcpy(&value, memory, sizeof(value));
+				if ((value & m_firstMask) != m_firstBytes)
+					return false;
+			}
+
+			const Block *block = m_blocks.data();
+			const Block *end = block + m_blocks.size();
+			switch (m_width) {
+				case 16:
+					for (; block != end; block++) {
+						#if defined(__SSE2__)
+						__m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(memory + block->offset));
+						__m128i masked = _mm_and_si128(value, _mm_load_si128(reinterpret_cast<const __m128i *>(block->masks)));
+						if (_mm_movemask_epi8(_mm_cmpeq_epi8(masked, _mm_load_si128(reinterpret_cast<const __m128i *>(block->bytes)))) != 0xFFFF)
+							return false;
+						#else
+						if (!matchWord<uint64_t>(memory, *block, 0) || !matchWord<uint64_t>(memory, *block, 8))
+							return false;
+						#endif
+					}
+				break;
+				case 8:
+					for (; block != end; block++) {
+						if (!matchWord<uint64_t>(memory, *block, 0))
+							return false;
+					}
+				break;
+				case 4:
+					for (; block != end; block++) {
+						if (!matchWord<uint32_t>(memory, *block, 0))
+							return false;
+					}
+				break;
+				default:
+					for (; block != end; block++) {
+						if ((memory[block->offset] & block->masks[0]) != block->bytes[0])
+							return false;
+					}
+				break;
+			}
+			return true;
+		}
+
+	private:
+		struct alignas(16) Block {
+			uint8_t bytes[BLOCK_SIZE];	// masked bits are zero
+			uint8_t masks[BLOCK_SIZE];
+			uint32_t offset;
+		};
+
+		std::vector<Block> m_blocks;
+		int m_width = 0;
+		bool m_isFirstWord = false;
+		uint64_t m_firstMask = 0;
+		uint64_t m_firstBytes = 0;
+
+		template<typename T>
+		static inline bool matchWord(const uint8_t *memory, const Block &block, int offset) {
+			T value, mask, bytes;
+			memcpy(&value, memory + block.offset + offset, sizeof(T));
+			memcpy(&mask, block.masks + offset, sizeof(T));
+			memcpy(&bytes, block.bytes + offset, sizeof(T));
+			return (value & mask) == bytes;
+		}
+};
+
+/*
+ * Shift-And search of the short patterns without the exact bytes for the prefilter.
+ * Bit i of the table row is set when the memory byte value is matched by the pattern byte i,
+ * so wildcards, half-bytes and bit-masks cost the same: one table lookup, shift and and per memory byte.
+ * Leading and trailing wildcards are not scanned.
+ * */
+class ShiftAndMatcher {
+	public:
+		static constexpr size_t MAX_SIZE = 64;
+
+		ShiftAndMatcher() = default;
+		ShiftAndMatcher(const uint8_t *bytes, const uint8_t *masks, size_t size);
+
+		// Fixed bytes fit into the one state word
+		static bool isSupported(const uint8_t *masks, size_t size);
+
+		/*
+		 * Calls onMatch(offset) for every pattern offset in [from, to) matched by all pattern bytes.
+		 * All pattern bytes of these offsets must be in the data. The callback returns false to stop.
+		 * */
+		template<typename Callback>
+		inline void scan(const uint8_t *data, size_t from, size_t to, Callback onMatch) const {
+			if (!m_size) {
+				for (size_t offset = from; offset < to; offset++) {
+					if (!onMatch(offset))
+						return;
+				}
+				return;
+			}
+
+			const uint8_t *memory = data + m_start;
+			const uint64_t *table = m_table.data();
+			uint64_t matchBit = 1ULL << (m_size - 1);
+			uint64_t state = 0;
+			for (size_t i = from, end = to + m_size - 1; i < end; i++) {
+				state = ((state << 1) | 1) & table[memory[i]];
+				if ((state & matchBit) && !onMatch(i + 1 - m_size))
+					return;
+			}
+		}
+	private:
+		size_t m_start = 0;				// first fixed byte of the pattern
+		size_t m_size = 0;				// from the first to the last fixed byte
+		std::vector<uint64_t> m_table;	// matched pattern bytes of the memory byte value
+};
+
+/*
+ * Shift-Add (Baeza-Yates and Gonnet) search of the pattern with at most maxMismatches mismatched bytes.
+ * Every pattern byte has a mismatches counter, counters of all alignments are updated with one shift and one add per memory byte.
+ * Counters are packed into 64 bit words, the high bit of each counter is moved to the separate overflow flags.
+ * Wildcards and the masked bits never mismatch, leading and trailing wildcards are not scanned.
+ * */
+class ShiftAddMatcher {
+	public:
+		ShiftAddMatcher() = default;
+		ShiftAddMatcher(const uint8_t *bytes, const uint8_t *masks, size_t size, int maxMismatches);
+
+		/*
+		 * Calls onMatch(offset, mismatches) for every pattern offset in [from, to) with at most maxMismatches mismatches.
+		 * All pattern bytes of these offsets must be in the data. The callback returns false to stop.
+		 * */
+		template<typename Callback>
+		void scan(const uint8_t *data, size_t from, size_t to, Callback onMatch) const {
+			if (from >= to)
+				return;
+
+			if (!m_size) {
+				for (size_t offset = from; offset < to; offset++) {
+					if (!onMatch(offset, 0))
+						return;
+				}
+				return;
+			}
+
+			switch (m_words) {
+				case 1:		scanWords<1>(data, from, to, onMatch); break;
+				case 2:		scanWords<2>(data, from, to, onMatch); break;
+				case 3:		scanWords<3>(data, from, to, onMatch); break;
+				case 4:		scanWords<4>(data, from, to, onMatch); break;
+				default:	scanWords<0>(data, from, to, onMatch); break;
+			}
+		}
+
+		inline int getMaxMismatches() const {
+			return m_maxMismatches;
+		}
+	private:
+		int m_maxMismatches = 0;
+		size_t m_start = 0;				// first fixed byte of the pattern
+		size_t m_size = 0;				// from the first to the last fixed byte
+		int m_bits = 1;					// counter size with the overflow bit
+		int m_topShift = 0;				// last counter of the word
+		size_t m_words = 0;
+		size_t m_lastWord = 0;			// counter of the last pattern byte
+		int m_lastShift = 0;
+		uint64_t m_fieldsMask = 0;		// all counters of the word
+		uint64_t m_highMask = 0;		// high bits of all counters
+		std::vector<uint64_t> m_table;	// mismatch bits of the memory byte value, m_words per value
+
+		// Words is 0 for the patterns longer than the unrolled variants
+		template<size_t Words, typename Callback>
+		inline void scanWords(const uint8_t *data, size_t from, size_t to, Callback &onMatch) const {
+			size_t words = Words ? Words : m_words;
+			uint64_t fixedState[Words ? Words * 2 : 1] = {};
+			std::vector<uint64_t> dynamicState(Words ? 0 : words * 2);
+			uint64_t *state = Words ? fixedState : dynamicState.data();
+			uint64_t *overflow = state + words;
+
+			uint64_t counterMask = (1ULL << (m_bits - 1)) - 1;
+			uint64_t overflowBit = 1ULL << (m_bits - 1);
+			const uint8_t *memory = data + m_start;
+			size_t end = to + m_size - 1;
+			for (size_t i = from; i < end; i++) {
+				const uint64_t *row = &m_table[memory[i] * words];
+				uint64_t carry = 0;
+				uint64_t overflowCarry = 0;
+				for (size_t w = 0; w < words; w++) {
+					uint64_t value = ((state[w] << m_bits) | carry) & m_fieldsMask;
+					uint64_t flags = ((overflow[w] << m_bits) | overflowCarry) & m_fieldsMask;
+					carry = state[w] >> m_topShift;
+					overflowCarry = overflow[w] >> m_topShift;
+					value += row[w];
+					overflow[w] = flags | (value & m_highMask);
+					state[w] = value & ~m_highMask;
+				}
+
+				// The first pattern offset is complete after m_size bytes
+				if (i + 1 < from + m_size)
+					continue;
+
+				if (!((overflow[m_lastWord] >> m_lastShift) & overflowBit)) {
+					int mismatches = (state[m_lastWord] >> m_lastShift) & counterMask;
+					if (mismatches <= m_maxMismatches && !onMatch(i + 1 - m_size, mismatches))
+						return;
+				}
+			}
+		}
+};
+
+}; // namespace Ptr89
@@ -0,0 +1,54 @@
+#include "Pattern.h"
+#include "utils.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace Ptr89 {
+
+std::shared_ptr<const Pattern::SegmentList> Pattern::createSegments(SegmentList segments) {
+	std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) {
+		return a.base < b.base;
+	});
+
+	for (size_t i = 0; i < segments.size(); i++) {
+		auto &segment = segments[i];
+		if (static_cast<uint64_t>(segment.base) + segment.size > 0x100000000ULL)
+			throw std::runtime_error(strprintf("Segment %08X is larger than the address space.", segment.base));
+		if (i > 0 && static_cast<uint64_t>(segments[i - 1].base) + segments[i - 1].size > segment.base)
+			throw std::runtime_error(strprintf("Segments %08X and %08X are overlapped.", segments[i - 1].base, segment.base));
+	}
+
+	return std::make_shared<const SegmentList>(std::move(segments));
+}
+
+const Pattern::Segment *Pattern::findSegment(const SegmentList &segments, uint64_t addr, uint64_t size) {
+	auto it = std::upper_bound(segments.begin(), segments.end(), addr, [](uint64_t addr, const Segment &segment) {
+		return addr < segment.base;
+	});
+	if (it == segments.begin())
+		return nullptr;
+	it--;
+	return addr + size <= it->base + it->size ? &*it : nullptr;
+}
+
+/*
+ * The segment as the memory to search, the other segments are still used for resolving.
+ * Veneers map and histogram of the memory are not valid for the other segment data.
+ * */
+Pattern::Memory Pattern::getSegmentMemory(const Memory &memory, const Segment &segment) {
+	if (segment.base == memory.base && segment.data == memory.data)
+		return memory;
+	return { segment.base, segment.data, segment.size, memory.align, nullptr, nullptr, memory.segments };
+}
+
+std::vector<Pattern::Memory> Pattern::getSegmentsMemory(const Memory &memory) {
+	if (!memory.segments)
+		return { memory };
+
+	std::vector<Memory> segmentsMemory;
+	for (auto &segment: *memory.segments)
+		segmentsMemory.push_back(getSegmentMemory(memory, segment));
+	return segmentsMemory;
+}
+
+}; // namespace Ptr89
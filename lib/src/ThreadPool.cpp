@@ -0,0 +1,136 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace Ptr89 {
+
+ThreadPool::ThreadPool(int threads) {
+	m_threads = resolveThreads(threads);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isStopped = true;
+	}
+	m_wakeup.notify_all();
+	for (auto &t: m_workers)
+		t.join();
+}
+
+int ThreadPool::resolveThreads(int threads) {
+	if (threads <= 0)
+		return std::max(1U, std::thread::hardware_concurrency());
+	return threads;
+}
+
+bool ThreadPool::popTask(Queue &queue, size_t &taskIndex) {
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.tasks.empty())
+		return false;
+	taskIndex = queue.tasks.front();
+	queue.tasks.pop_front();
+	return true;
+}
+
+bool ThreadPool::stealTask(Queue &queue, size_t &taskIndex) {
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.tasks.empty())
+		return false;
+	taskIndex = queue.tasks.back();
+	queue.tasks.pop_back();
+	return true;
+}
+
+/*
+ * Tasks are never added during the run, so empty queues everywhere mean the end of the work.
+ * */
+void ThreadPool::work(size_t workerIndex) {
+	auto &queues = *m_queues;
+	size_t taskIndex;
+	while (!m_isFailed.load(std::memory_order_relaxed)) {
+		bool isFound = popTask(queues[workerIndex], taskIndex);
+		for (size_t i = 1; i < m_workersCnt && !isFound; i++)
+			isFound = stealTask(queues[(workerIndex + i) % m_workersCnt], taskIndex);
+		if (!isFound)
+			break;
+
+		try {
+			(*m_task)(taskIndex);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_error)
+				m_error = std::current_exception();
+			m_isFailed = true;
+		}
+	}
+}
+
+void ThreadPool::workerLoop(size_t workerIndex, uint64_t generation) {
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wakeup.wait(lock, [&]() {
+				return m_isStopped || m_generation != generation;
+			});
+			if (m_isStopped)
+				return;
+			generation = m_generation;
+
+			// Run with fewer tasks than threads
+			if (workerIndex >= m_workersCnt)
+				continue;
+		}
+
+		work(workerIndex);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--m_activeWorkers == 0)
+			m_done.notify_one();
+	}
+}
+
+void ThreadPool::run(size_t tasksCnt, const Task &task) {
+	size_t workersCnt = std::min(static_cast<size_t>(m_threads), tasksCnt);
+	if (workersCnt <= 1) {
+		for (size_t i = 0; i < tasksCnt; i++)
+			task(i);
+		return;
+	}
+
+	std::vector<Queue> queues(workersCnt);
+	for (size_t i = 0; i < tasksCnt; i++)
+		queues[i * workersCnt / tasksCnt].tasks.push_back(i);
+
+	// New workers wait for the next generation, the previous runs are already done
+	while (m_workers.size() < workersCnt - 1)
+		m_workers.emplace_back(&ThreadPool::workerLoop, this, m_workers.size() + 1, m_generation);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_task = &task;
+		m_queues = &queues;
+		m_workersCnt = workersCnt;
+		m_activeWorkers = workersCnt - 1;
+		m_isFailed = false;
+		m_error = nullptr;
+		m_generation++;
+	}
+	m_wakeup.notify_all();
+
+	work(0);
+
+	std::exception_ptr error;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [&]() {
+			return m_activeWorkers == 0;
+		});
+		std::swap(error, m_error);
+		m_task = nullptr;
+		m_queues = nullptr;
+	}
+	if (error)
+		std::rethrow_exception(error);
+}
+
+}; // namespace Ptr89
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Ptr89 {
+
+/*
+ * Runs the indexed tasks on a fixed number of threads.
+ * Every worker owns a contiguous range of the tasks and steals from the tail of others when its own range is done,
+ * so a few expensive tasks don't leave the other cores idle.
+ * Tasks are executed in the index order when there is only one thread.
+ *
+ * Worker threads are started by the first parallel run and wait for the next runs until the pool is destroyed.
+ * The calling thread works as one of the workers, run() must not be called concurrently.
+ * The first exception of a task stops the run and is rethrown from run().
+ * */
+class ThreadPool {
+	public:
+		typedef std::function<void(size_t)> Task;
+
+		explicit ThreadPool(int threads);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool &) = delete;
+		ThreadPool &operator=(const ThreadPool &) = delete;
+
+		void run(size_t tasksCnt, const Task &task);
+
+		inline int threads() const {
+			return m_threads;
+		}
+
+		// Threads count for the option value, 0 or less means all cores
+		static int resolveThreads(int threads);
+	private:
+		struct Queue {
+			std::mutex mutex;
+			std::deque<size_t> tasks;
+		};
+
+		int m_threads;
+		std::vector<std::thread> m_workers;
+
+		std::mutex m_mutex;
+		std::condition_variable m_wakeup;
+		std::condition_variable m_done;
+		uint64_t m_generation = 0;
+		bool m_isStopped = false;
+
+		// State of the current run
+		const Task *m_task = nullptr;
+		std::vector<Queue> *m_queues = nullptr;
+		size_t m_workersCnt = 0;
+		size_t m_activeWorkers = 0;
+		std::atomic<bool> m_isFailed { false };
+		std::exception_ptr m_error;
+
+		void workerLoop(size_t workerIndex, uint64_t generation);
+		void work(size_t workerIndex);
+
+		static bool popTask(Queue &queue, size_t &taskIndex);
+		static bool stealTask(Queue &queue, size_t &taskIndex);
+};
+
+}; // namespace Ptr89
@@ -0,0 +1,34 @@
+#include "Pattern.h"
+
+namespace Ptr89 {
+
+std::shared_ptr<const Pattern::ThunkMap> Pattern::ThunkMap::build(const Memory &memory) {
+	auto thunks = std::make_shared<ThunkMap>();
+	thunks->m_base = memory.base & ~3;
+	thunks->m_veneersCnt = (memory.base - thunks->m_base + memory.size + 3) / 4;
+	thunks->m_veneers.resize((thunks->m_veneersCnt + 63) / 64);
+
+	// Chains are followed without the map itself
+	Memory plainMemory = memory;
+	plainMemory.thunks = nullptr;
+
+	uint32_t firstOffset = (4 - (memory.base & 3)) & 3;
+	for (size_t i = firstOffset; i + 4 <= memory.size; i += 4) {
+		uint32_t addr = memory.base + i;
+		auto [isArmLdr, ldrAddr, isThunk] = decodeArmLDR<NoTrace>(addr, memory.data + i);
+		if (!isThunk)
+			continue;
+
+		uint32_t target = resolveThunks<NoTrace>(addr, plainMemory);
+		if (target == addr)
+			continue;
+
+		uint32_t index = (addr - thunks->m_base) >> 2;
+		thunks->m_veneers[index >> 6] |= 1ULL << (index & 63);
+		thunks->m_targets[addr] = target;
+	}
+
+	return thunks;
+}
+
+}; // namespace Ptr89
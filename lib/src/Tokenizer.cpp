@@ -61,17 +61,17 @@ Tokenizer::Token Tokenizer::parseToken() {
 		}
 	}
 
-	if (m_input[m_offset] == '_' && strcasecmp(m_input.substr(m_offset, 4).c_str(), "_blf") == 0) {
+	if (m_input[m_offset] == '_' && avail() >= 4 && strncasecmp(&m_input[m_offset], "_blf", 4) == 0) {
 		m_offset += 4;
 		return { TOK_BLF, start, m_offset };
 	}
 
-	if (tolower(m_input[m_offset]) == 'l' && strcasecmp(m_input.substr(m_offset, 3).c_str(), "ldr") == 0) {
+	if (tolower(m_input[m_offset]) == 'l' && avail() >= 3 && strncasecmp(&m_input[m_offset], "ldr", 3) == 0) {
 		m_offset += 3;
 		return { TOK_LDR, start, m_offset };
 	}
 
-	if (tolower(m_input[m_offset]) == '&' && strcasecmp(m_input.substr(m_offset, 3).c_str(), "&bl") == 0) {
+	if (m_input[m_offset] == '&' && avail() >= 3 && strncasecmp(&m_input[m_offset], "&bl", 3) == 0) {
 		m_offset += 3;
 		return { TOK_BRANCH_REFERENCE, start, m_offset };
 	}
@@ -141,10 +141,9 @@ Tokenizer::Token Tokenizer::parseToken() {
 
 	if (isHexPattern(m_input[m_offset])) {
 		bool isMask = false;
-		m_offset++;
-
 		if (m_input[m_offset] == '?')
 			isMask = true;
+		m_offset++;
 
 		while (avail() > 0 && isHexPattern(m_input[m_offset])) {
 			if (m_input[m_offset] == '?')
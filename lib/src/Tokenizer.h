@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
 namespace Ptr89 {
 
@@ -44,7 +45,7 @@ class Tokenizer {
 		Token m_currentToken = { TOK_NULL };
 		int m_offset = 0;
 		int m_savedOffset = 0;
-		std::string m_input;
+		std::string_view m_input;
 		Token parseToken();
 		static bool isHex(char c);
 		static bool isHexPattern(char c);
@@ -56,7 +57,8 @@ class Tokenizer {
 	public:
 		const Token &next();
 		const Token &peek();
-		inline void reset(const std::string &value) {
+		// Input is not copied, it must outlive the tokenizer
+		inline void reset(std::string_view value) {
 			m_input = value;
 			m_offset = 0;
 			m_savedOffset = 0;
@@ -0,0 +1,258 @@
+#include "Pattern.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <stdexcept>
+
+namespace Ptr89 {
+
+static const char XREF_INDEX_MAGIC[8] = { 'P', 'T', 'R', '8', '9', 'X', 'R', 'I' };
+static const uint32_t XREF_INDEX_VERSION = 1;
+
+/*
+ * Cache file layout: header, branches, references, pointers.
+ * All arrays are 8-byte aligned, so the mapped file is used as is.
+ * */
+struct XRefIndexHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t base;
+	uint64_t memoryHash;
+	uint64_t memorySize;
+	uint64_t branchesCnt;
+	uint64_t referencesCnt;
+	uint64_t pointersCnt;
+	uint64_t reserved;
+};
+
+struct XRefIndexStorage {
+	std::vector<Pattern::XRefIndex::Entry> branches;
+	std::vector<Pattern::XRefIndex::Entry> references;
+	std::vector<uint32_t> pointers;
+};
+
+Pattern::XRefIndex Pattern::XRefIndex::build(const Memory &memory, int threads) {
+	XRefIndex index;
+	index.m_memory = memory;
+
+	auto storage = std::make_shared<XRefIndexStorage>();
+	index.m_storage = storage;
+
+	// Same offsets as in finXRefs(), but only fully readable instructions
+	size_t offsetsCnt = getPointersCount(memory);
+	if (!offsetsCnt)
+		return index;
+
+	size_t chunksCnt = std::max(static_cast<size_t>(1), std::min(static_cast<size_t>(ThreadPool::resolveThreads(threads)), offsetsCnt / SEARCH_MIN_CHUNK_SIZE));
+	size_t chunkSize = (offsetsCnt + chunksCnt - 1) / chunksCnt;
+
+	struct Chunk {
+		std::vector<Entry> branches;
+		std::vector<Entry> references;
+	};
+	std::vector<Chunk> chunks(chunksCnt);
+
+	// Branch targets of all workers are resolved through the one veneers map
+	Memory decodeMemory = memory;
+	if (!decodeMemory.thunks)
+		decodeMemory.thunks = ThunkMap::build(memory);
+
+	auto worker = [&](size_t chunkIndex) {
+		auto &chunk = chunks[chunkIndex];
+		size_t from = chunkIndex * chunkSize;
+		size_t to = std::min(from + chunkSize, offsetsCnt);
+		for (size_t i = from * 2; i < to * 2; i += 2) {
+			auto [isBranchReference, branchAddr] = decodeBranchReference<NoTrace>(i, decodeMemory);
+			if (isBranchReference)
+				chunk.branches.push_back({ branchAddr & ~1, static_cast<uint32_t>(i) });
+
+			auto [isReference, refAddr] = decodeReference<NoTrace>(i, decodeMemory);
+			if (isReference)
+				chunk.references.push_back({ refAddr & ~1, static_cast<uint32_t>(i) });
+		}
+	};
+
+	ThreadPool pool(static_cast<int>(chunksCnt));
+	pool.run(chunksCnt, worker);
+
+	for (auto &chunk: chunks) {
+		storage->branches.insert(storage->branches.end(), chunk.branches.begin(), chunk.branches.end());
+		storage->references.insert(storage->references.end(), chunk.references.begin(), chunk.references.end());
+	}
+
+	// Offsets are already sorted, so stable sort keeps them sorted within the same target
+	auto compareEntries = [](const Entry &a, const Entry &b) {
+		return a.target < b.target;
+	};
+	std::stable_sort(storage->branches.begin(), storage->branches.end(), compareEntries);
+	std::stable_sort(storage->references.begin(), storage->references.end(), compareEntries);
+
+	/*
+	 * Every offset is a pointer, so only offsets are stored.
+	 * LSD radix sort by the 31-bit pointer value (the THUMB bit is ignored), two passes of 16 bits.
+	 * */
+	std::vector<uint32_t> pointers(offsetsCnt);
+	std::vector<uint32_t> tmp(offsetsCnt);
+	for (size_t i = 0; i < offsetsCnt; i++)
+		tmp[i] = i * 2;
+
+	for (int shift: { 1, 17 }) {
+		std::vector<size_t> counts(65536 + 1);
+		for (auto offset: tmp)
+			counts[((index.getPointerValue(offset) >> shift) & 0xFFFF) + 1]++;
+		for (size_t i = 1; i < counts.size(); i++)
+			counts[i] += counts[i - 1];
+		for (auto offset: tmp)
+			pointers[counts[(index.getPointerValue(offset) >> shift) & 0xFFFF]++] = offset;
+		std::swap(pointers, tmp);
+	}
+	storage->pointers = std::move(tmp);
+
+	index.m_branches = storage->branches;
+	index.m_references = storage->references;
+	index.m_pointers = storage->pointers;
+
+	return index;
+}
+
+std::pair<bool, Pattern::XRefIndex> Pattern::XRefIndex::load(const std::string &path, const Memory &memory, uint64_t memoryHash) {
+	std::error_code ec;
+	if (!std::filesystem::exists(path, ec))
+		return { false, {} };
+
+	auto file = MappedFile::open(path);
+	if (file->size() < sizeof(XRefIndexHeader))
+		return { false, {} };
+
+	auto *header = reinterpret_cast<const XRefIndexHeader *>(file->data());
+	if (memcmp(header->magic, XREF_INDEX_MAGIC, sizeof(XREF_INDEX_MAGIC)) != 0 || header->version != XREF_INDEX_VERSION)
+		return { false, {} };
+
+	// The dump or base was changed
+	if (header->base != memory.base || header->memorySize != memory.size || header->memoryHash != memoryHash)
+		return { false, {} };
+
+	// Counts are limited by the file size first, so the expected size can't overflow
+	size_t bodySize = file->size() - sizeof(XRefIndexHeader);
+	if (header->branchesCnt > bodySize / sizeof(Entry) || header->referencesCnt > bodySize / sizeof(Entry) || header->pointersCnt > bodySize / sizeof(uint32_t))
+		return { false, {} };
+
+	size_t expectedSize = (header->branchesCnt + header->referencesCnt) * sizeof(Entry) + header->pointersCnt * sizeof(uint32_t);
+	if (bodySize != expectedSize || header->pointersCnt != getPointersCount(memory))
+		return { false, {} };
+
+	XRefIndex index;
+	index.m_memory = memory;
+	index.m_storage = file;
+
+	auto *entries = reinterpret_cast<const Entry *>(file->data() + sizeof(XRefIndexHeader));
+	index.m_branches = { entries, header->branchesCnt };
+	index.m_references = { entries + header->branchesCnt, header->referencesCnt };
+	index.m_pointers = { reinterpret_cast<const uint32_t *>(entries + header->branchesCnt + header->referencesCnt), header->pointersCnt };
+
+	// Broken file must not point outside of the memory, pointer values are read by the offsets
+	auto isValidEntry = [&memory](const Entry &entry) {
+		return entry.offset < memory.size;
+	};
+	auto isValidPointer = [&memory](uint32_t offset) {
+		return static_cast<uint64_t>(offset) + 4 <= memory.size;
+	};
+	if (!std::all_of(index.m_branches.begin(), index.m_branches.end(), isValidEntry) ||
+			!std::all_of(index.m_references.begin(), index.m_references.end(), isValidEntry) ||
+			!std::all_of(index.m_pointers.begin(), index.m_pointers.end(), isValidPointer))
+		return { false, {} };
+
+	return { true, index };
+}
+
+void Pattern::XRefIndex::save(const std::string &path, uint64_t memoryHash) const {
+	XRefIndexHeader header = {};
+	memcpy(header.magic, XREF_INDEX_MAGIC, sizeof(XREF_INDEX_MAGIC));
+	header.version = XREF_INDEX_VERSION;
+	header.base = m_memory.base;
+	header.memoryHash = memoryHash;
+	header.memorySize = m_memory.size;
+	header.branchesCnt = m_branches.size();
+	header.referencesCnt = m_references.size();
+	header.pointersCnt = m_pointers.size();
+
+	// Other processes can read the same cache, so the file is replaced atomically
+	std::string tmpPath = path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+	FILE *fp = fopen(tmpPath.c_str(), "wb");
+	if (!fp)
+		throw std::runtime_error("fopen(" + tmpPath + ") error: " + strerror(errno));
+
+	bool success = fwrite(&header, sizeof(header), 1, fp) == 1;
+	if (success && m_branches.size())
+		success = fwrite(m_branches.data(), sizeof(Entry), m_branches.size(), fp) == m_branches.size();
+	if (success && m_references.size())
+		success = fwrite(m_references.data(), sizeof(Entry), m_references.size(), fp) == m_references.size();
+	if (success && m_pointers.size())
+		success = fwrite(m_pointers.data(), sizeof(uint32_t), m_pointers.size(), fp) == m_pointers.size();
+	success = (fclose(fp) == 0) && success;
+
+	if (!success) {
+		std::string error = strerror(errno);
+		std::filesystem::remove(tmpPath);
+		throw std::runtime_error("fwrite(" + tmpPath + ") error: " + error);
+	}
+
+	std::filesystem::rename(tmpPath, path);
+}
+
+std::vector<Pattern::XRefSearchResult> Pattern::XRefIndex::find(uint32_t addr, size_t maxResults) const {
+	uint32_t target = addr & ~1;
+
+	auto findEntries = [target](std::span<const Entry> entries) {
+		return std::equal_range(entries.begin(), entries.end(), Entry { target, 0 }, [](const Entry &a, const Entry &b) {
+			return a.target < b.target;
+		});
+	};
+
+	auto [branchIt, branchEnd] = findEntries(m_branches);
+	auto [referenceIt, referenceEnd] = findEntries(m_references);
+
+	auto pointerIt = std::lower_bound(m_pointers.begin(), m_pointers.end(), target, [this](uint32_t offset, uint32_t value) {
+		return getPointerValue(offset) < value;
+	});
+	auto pointerEnd = std::upper_bound(pointerIt, m_pointers.end(), target, [this](uint32_t value, uint32_t offset) {
+		return value < getPointerValue(offset);
+	});
+
+	// Merge by offset, the priority is the same as in finXRefs(): branch, reference, pointer
+	std::vector<XRefSearchResult> searchResults;
+	while (branchIt != branchEnd || referenceIt != referenceEnd || pointerIt != pointerEnd) {
+		uint32_t offset = UINT32_MAX;
+		if (branchIt != branchEnd)
+			offset = std::min(offset, branchIt->offset);
+		if (referenceIt != referenceEnd)
+			offset = std::min(offset, referenceIt->offset);
+		if (pointerIt != pointerEnd)
+			offset = std::min(offset, *pointerIt);
+
+		bool isBranch = (branchIt != branchEnd && branchIt->offset == offset);
+		bool isReference = (referenceIt != referenceEnd && referenceIt->offset == offset);
+		bool isPointer = (pointerIt != pointerEnd && *pointerIt == offset);
+
+		XRefType type = isBranch ? XREF_TYPE_BRANCH_CALL : (isReference ? XREF_TYPE_REFERENCE : XREF_TYPE_POINTER);
+		searchResults.push_back({ type, m_memory.base + offset, offset });
+
+		if (isBranch)
+			branchIt++;
+		if (isReference)
+			referenceIt++;
+		if (isPointer)
+			pointerIt++;
+
+		if (maxResults && searchResults.size() >= maxResults)
+			break;
+	}
+
+	return searchResults;
+}
+
+}; // namespace Ptr89
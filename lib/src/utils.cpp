@@ -78,6 +78,47 @@ std::string tab2spaces(const std::string &line) {
 	return newStr;
 }
 
+static inline uint64_t rotl64(uint64_t value, int shift) {
+	return (value << shift) | (value >> (64 - shift));
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t value) {
+	acc += value * 0xC2B2AE3D27D4EB4FULL;
+	acc = rotl64(acc, 31);
+	return acc * 0x9E3779B185EBCA87ULL;
+}
+
+/*
+ * Fast non-cryptographic hash for the cache keys.
+ * Four independent lanes of 64-bit words, then the splitmix64 finalizer.
+ * */
+uint64_t hash64(const uint8_t *data, size_t size, uint64_t seed) {
+	uint64_t lanes[4] = {
+		seed + 0x9E3779B185EBCA87ULL,
+		seed + 0xC2B2AE3D27D4EB4FULL,
+		seed,
+		seed - 0x9E3779B185EBCA87ULL
+	};
+
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		for (int j = 0; j < 4; j++) {
+			uint64_t value;
+			memcpy(&value, data + i + j * 8, 8);
+			lanes[j] = hashRound(lanes[j], value);
+		}
+	}
+
+	uint64_t hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+	for (; i < size; i++)
+		hash = hashRound(hash, data[i]);
+	hash ^= size;
+
+	hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+	return hash ^ (hash >> 31);
+}
+
 std::string strJoin(const std::string &sep, const std::vector<std::string> &lines) {
 	std::string out;
 	size_t length = lines.size() > 1 ? sep.size() * (lines.size() - 1) : 0;
@@ -13,6 +13,8 @@ std::string padStart(const std::string &line, int maxLength, char c);
 std::string str2spaces(const std::string &line);
 std::string tab2spaces(const std::string &line);
 
+uint64_t hash64(const uint8_t *data, size_t size, uint64_t seed = 0);
+
 std::string strJoin(const std::string &sep, const std::vector<std::string> &lines);
 std::vector<std::string> strSplit(const std::string &sep, const std::string &str);
 
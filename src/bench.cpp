@@ -0,0 +1,321 @@
+#include "main.h"
+#include <cstdint>
+#include <ptr89.h>
+#include <src/utils.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+using namespace Ptr89;
+
+static const char *BENCH_PATTERNS[] = {
+	"F0B5061C0C1C151C85B068461122??49??????????E0207869466A460009085C307021780134",
+	"??2800D0F5E6704780B508F0??E980BD80B5+1",
+	"??B589B006A901A80522??????????49051C",
+	"??,B5,??,B0,??,1C,??,20,??,43,??,99,??,4D,??,90,??,94,??,1C,??,92,??,91,??,68,??,26,??,23,??,21,??,A2,??,48,??,47",
+	"B801C4E10200A0E30000C1E5B601D4E11040BDE8??????EA",
+	"&( ??,48,??,47,??,B5,??,B0,??,1C,??,D1,??,20 ) + 0x4",
+	"10 40 2D E9 ?? ?? ?? EB 00 00 50 E3",
+};
+
+// No 4 exact bytes in a row, only the slow path can be used
+static const char *BENCH_SLOW_PATTERNS[] = {
+	"?? B5 ?? 1C ?? 68 ?? 47 ?? BD",
+	"1? ?? 2? ?? 4? ?? 6? ?? [1.0.....]",
+};
+
+static const char *BENCH_SUBPATTERN = "?? B5 { ?? ?? [ ?? 1C ] } ?? 1C";
+
+struct BenchResult {
+	std::string name;
+	double elapsed;		// best time, ms
+	size_t bytes;		// processed input bytes
+	size_t items;		// processed patterns, 0 for the memory scans
+};
+
+/*
+ * Pseudo-random firmware-like data: THUMB-like halfwords and 00/FF filled gaps.
+ * */
+static std::vector<uint8_t> createFirmware(size_t size) {
+	static const uint8_t commonBytes[] = { 0x00, 0x1C, 0x20, 0x47, 0x60, 0x68, 0xB5, 0xBD, 0x48, 0xD0, 0xD1, 0xE0, 0xF0, 0xF7, 0x28, 0x21 };
+	std::vector<uint8_t> firmware(size);
+	uint64_t seed = 0x89;
+	auto rand = [&seed]() {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		return static_cast<uint32_t>(seed >> 33);
+	};
+
+	size_t i = 0;
+	while (i < size) {
+		uint32_t blockType = rand() % 8;
+		size_t blockSize = std::min(static_cast<size_t>(64 + rand() % 4096), size - i);
+		if (blockType == 0) {
+			memset(&firmware[i], (rand() & 1) ? 0xFF : 0x00, blockSize);
+		} else {
+			for (size_t j = 0; j < blockSize; j++)
+				firmware[i + j] = (j % 2) ? commonBytes[rand() % 16] : ((rand() & 1) ? commonBytes[rand() % 16] : rand() & 0xFF);
+		}
+		i += blockSize;
+	}
+	return firmware;
+}
+
+/*
+ * functions.ini with patterns cut from the firmware, every 4th pattern is not found.
+ * */
+static std::string createPatternsIni(const std::vector<uint8_t> &firmware, int count) {
+	uint64_t seed = 0x1234;
+	auto rand = [&seed]() {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		return static_cast<uint32_t>(seed >> 33);
+	};
+
+	std::string iniText;
+	for (int id = 0; id < count; id++) {
+		size_t size = 16 + rand() % 16;
+		size_t offset = rand() % (firmware.size() - size);
+		std::string patternStr;
+		for (size_t i = 0; i < size; i++) {
+			if ((rand() % 5) == 0) {
+				patternStr += "??";
+			} else {
+				patternStr += strprintf("%02X", (id % 4) == 3 ? rand() & 0xFF : firmware[offset + i]);
+			}
+		}
+		iniText += strprintf("%03X: func_%d = %s\n", id, id, patternStr.c_str());
+	}
+	return iniText;
+}
+
+/*
+ * Best time of one call in ms.
+ * Short callbacks are repeated, so the each sample is at least MIN_SAMPLE_TIME long and the timer noise is negligible.
+ * */
+static double measure(int iterations, const std::function<void()> &callback) {
+	static const double MIN_SAMPLE_TIME = 20.0;
+
+	auto sample = [&callback](int repeats) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < repeats; i++)
+			callback();
+		auto end = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::milli>(end - start).count() / repeats;
+	};
+
+	double best = sample(1);
+	int repeats = best < MIN_SAMPLE_TIME ? static_cast<int>(MIN_SAMPLE_TIME / std::max(best, 0.001)) + 1 : 1;
+	for (int i = 0; i < iterations; i++)
+		best = std::min(best, sample(repeats));
+	return best;
+}
+
+static std::vector<std::shared_ptr<PtrExp>> parsePatterns(const std::vector<std::string> &patternsStr) {
+	std::vector<std::shared_ptr<PtrExp>> patterns;
+	for (auto &patternStr: patternsStr)
+		patterns.push_back(Pattern::parse(patternStr));
+	return patterns;
+}
+
+static std::vector<BenchResult> runBenchmarks(const Pattern::Memory &memory, int iterations) {
+	std::vector<BenchResult> results;
+	auto run = [&](const std::string &name, size_t bytes, const std::function<void()> &callback, size_t items = 0) {
+		results.push_back({ name, measure(iterations, callback), bytes, items });
+		auto &result = results.back();
+		fprintf(stderr, "%-32s %10.2f ms %10.3f ns/byte", name.c_str(), result.elapsed, result.elapsed * 1000000.0 / result.bytes);
+		if (items)
+			fprintf(stderr, " %10.0f patterns/s", items / (result.elapsed / 1000.0));
+		fprintf(stderr, "\n");
+	};
+
+	auto patterns = parsePatterns({ std::begin(BENCH_PATTERNS), std::end(BENCH_PATTERNS) });
+	auto slowPatterns = parsePatterns({ std::begin(BENCH_SLOW_PATTERNS), std::end(BENCH_SLOW_PATTERNS) });
+
+	// Micro: one candidate check at every offset of the first 4 MB
+	size_t checkSize = std::min(memory.size - 64, static_cast<size_t>(4 * 1024 * 1024));
+	auto plainPattern = Pattern::parse(BENCH_SLOW_PATTERNS[0]);
+	auto subPattern = Pattern::parse(BENCH_SUBPATTERN);
+	auto subProgram = Pattern::compile(subPattern);
+	size_t matches = 0;
+	run("micro/checkPattern/bytes", checkSize, [&]() {
+		for (size_t i = 0; i < checkSize; i++)
+			matches += Pattern::checkPattern(plainPattern, i, memory);
+	});
+	run("micro/checkPattern/subpatterns", checkSize, [&]() {
+		for (size_t i = 0; i < checkSize; i++)
+			matches += Pattern::checkPattern(subPattern, i, memory);
+	});
+	run("micro/checkPattern/program", checkSize, [&]() {
+		for (size_t i = 0; i < checkSize; i++)
+			matches += Pattern::checkPattern(*subProgram, i, memory);
+	});
+
+	// Micro: Pattern::find paths
+	for (auto kernel: { SCAN_KERNEL_DISABLED, SCAN_KERNEL_SCALAR, SCAN_KERNEL_SSE2, SCAN_KERNEL_AVX2 }) {
+		if (!Scanner::setKernel(kernel))
+			continue;
+		std::string name = kernel == SCAN_KERNEL_DISABLED ? "micro/find/fast" : std::string("micro/find/") + Scanner::getKernelName(kernel);
+		run(name, memory.size * patterns.size(), [&]() {
+			for (auto &pattern: patterns)
+				Pattern::find(pattern, memory, 0);
+		});
+	}
+	Scanner::setKernel(SCAN_KERNEL_AUTO);
+
+	run("micro/find/slow", memory.size * slowPatterns.size(), [&]() {
+		for (auto &pattern: slowPatterns)
+			Pattern::find(pattern, memory, 1000);
+	});
+	run("micro/find/threads", memory.size * patterns.size(), [&]() {
+		for (auto &pattern: patterns)
+			Pattern::find(pattern, memory, 0, 0);
+	});
+
+	// Micro: parsers
+	auto iniText = createPatternsIni(std::vector<uint8_t>(memory.data, memory.data + memory.size), 1000);
+	auto patternsLib = parsePatternsIniText(iniText);
+	run("micro/parsePatternsIni", iniText.size(), [&]() {
+		parsePatternsIniText(iniText);
+	});
+
+	size_t patternsTextSize = 0;
+	std::vector<std::string> patternsStr;
+	for (auto &entry: patternsLib) {
+		patternsTextSize += entry.pattern.size();
+		patternsStr.push_back(entry.pattern);
+	}
+	run("micro/parse", patternsTextSize, [&]() {
+		for (auto &entry: patternsLib)
+			Pattern::parse(entry.pattern);
+	}, patternsLib.size());
+	run("micro/parseMany", patternsTextSize, [&]() {
+		Pattern::parseMany(patternsStr);
+	}, patternsStr.size());
+
+	// End-to-end scenarios
+	run("e2e/pattern", memory.size, [&]() {
+		Pattern::find(Pattern::parse(BENCH_PATTERNS[0]), memory, 100);
+	});
+	run("e2e/ini1000", memory.size, [&]() {
+		std::vector<std::string> iniPatternsStr;
+		for (auto &entry: parsePatternsIniText(iniText))
+			iniPatternsStr.push_back(entry.pattern);
+		Pattern::findMany(Pattern::parseMany(iniPatternsStr), memory, 1);
+	});
+	run("e2e/xrefs", memory.size, [&]() {
+		Pattern::finXRefs(memory.base + 0x1000, memory, 100);
+	});
+	run("e2e/xrefs/index", memory.size, [&]() {
+		auto index = Pattern::XRefIndex::build(memory);
+		for (uint32_t i = 0; i < 1000; i++)
+			index.find(memory.base + i * 0x100, 100);
+	});
+
+	// Keeps the checks from being optimized away
+	if (matches == SIZE_MAX)
+		fprintf(stderr, "%zu\n", matches);
+
+	return results;
+}
+
+static json resultsToJSON(const Pattern::Memory &memory, const std::vector<BenchResult> &results) {
+	json j;
+	j["memory"] = memory.size;
+	j["scenarios"] = json::array();
+	for (auto &result: results) {
+		json item;
+		item["name"] = result.name;
+		item["elapsed"] = result.elapsed;
+		item["bytes"] = result.bytes;
+		item["ns_per_byte"] = result.elapsed * 1000000.0 / result.bytes;
+		item["mb_per_s"] = result.bytes / 1024.0 / 1024.0 / (result.elapsed / 1000.0);
+		if (result.items)
+			item["patterns_per_s"] = result.items / (result.elapsed / 1000.0);
+		j["scenarios"].push_back(item);
+	}
+	return j;
+}
+
+/*
+ * Returns the number of scenarios which are slower than the baseline by more than threshold percents.
+ * */
+static int compareWithBaseline(const json &current, const json &baseline, double threshold) {
+	int regressions = 0;
+	for (auto &item: current["scenarios"]) {
+		for (auto &baseItem: baseline["scenarios"]) {
+			if (baseItem["name"] != item["name"])
+				continue;
+
+			double ratio = item["ns_per_byte"].get<double>() / baseItem["ns_per_byte"].get<double>();
+			bool isRegression = ratio > 1.0 + threshold / 100.0;
+			fprintf(stderr, "%-32s %+8.1f%%%s\n", item["name"].get<std::string>().c_str(), (ratio - 1.0) * 100.0, isRegression ? "  REGRESSION" : "");
+			regressions += isRegression;
+		}
+	}
+	return regressions;
+}
+
+int main(int argc, char *argv[]) {
+	argparse::ArgumentParser program("ptr89-bench");
+
+	program.add_argument("-f", "--file")
+		.default_value("")
+		.nargs(1);
+	program.add_argument("-i", "--iterations")
+		.default_value(3)
+		.nargs(1)
+		.scan<'i', int>();
+	program.add_argument("--baseline")
+		.default_value("")
+		.nargs(1);
+	program.add_argument("--threshold")
+		.default_value(10.0)
+		.nargs(1)
+		.scan<'g', double>();
+	program.add_argument("-J", "--json")
+		.default_value(false)
+		.implicit_value(true)
+		.nargs(0);
+
+	try {
+		program.parse_args(argc, argv);
+
+		std::shared_ptr<MappedFile> file;
+		std::vector<uint8_t> firmware;
+		Pattern::Memory memory = { 0xA0000000, nullptr, 0, 1 };
+		if (program.get<std::string>("--file").empty()) {
+			firmware = createFirmware(64 * 1024 * 1024);
+			memory.data = &firmware[0];
+			memory.size = firmware.size();
+		} else {
+			file = MappedFile::open(program.get<std::string>("--file"), MAPPED_FILE_ACCESS_SEQUENTIAL);
+			memory.data = file->data();
+			memory.size = file->size();
+		}
+		memory.histogram = Pattern::createHistogram(memory);
+
+		fprintf(stderr, "Memory: %.1f MB\n", memory.size / 1024.0 / 1024.0);
+		auto results = resultsToJSON(memory, runBenchmarks(memory, program.get<int>("--iterations")));
+
+		if (program.get<bool>("--json"))
+			printf("%s\n", results.dump(2).c_str());
+
+		auto baselineFile = program.get<std::string>("--baseline");
+		if (!baselineFile.empty()) {
+			fprintf(stderr, "\nBaseline: %s\n", baselineFile.c_str());
+			int regressions = compareWithBaseline(results, json::parse(readFile(baselineFile)), program.get<double>("--threshold"));
+			if (regressions > 0) {
+				fprintf(stderr, "%d scenarios are regressed.\n", regressions);
+				return 1;
+			}
+		}
+	} catch (const std::exception &err) {
+		fprintf(stderr, "ERROR: %s\n", err.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+#include "main.h"
+
+std::vector<PatternsLibraryItem> parsePatternsIni(const std::string &iniFile) {
+	return parsePatternsIniText(readFile(iniFile));
+}
+
+std::vector<PatternsLibraryItem> parsePatternsIniText(const std::string &iniText) {
+	std::regex exp(R"(^[ \t]*([0-9a-f]+):[ \t]*([^=;\n]+)(?:[ \t]*=[ \t]*([^;:\n]*))?)", std::regex::icase | std::regex::multiline);
+	std::smatch m;
+	std::vector<PatternsLibraryItem> results;
+	auto searchStart = iniText.cbegin();
+	while (std::regex_search(searchStart, iniText.cend(), m, exp)) {
+		auto id = stoi(m[1].str(), NULL, 16);
+		auto funcName = trim(m[2].str());
+		auto patternStr = trim(m[3].str());
+		results.push_back({ id, funcName, patternStr });
+		searchStart = m.suffix().first;
+	}
+	return results;
+}
+
+std::string readFile(const std::string &path) {
+	FILE *fp = fopen(path.c_str(), "r");
+	if (!fp) {
+		throw std::runtime_error("fopen(" + path + ") error: " + strerror(errno));
+	}
+
+	char buff[4096];
+	std::string result;
+	while (!feof(fp)) {
+		int readed = fread(buff, 1, sizeof(buff), fp);
+		if (readed > 0)
+			result.append(buff, readed);
+	}
+	fclose(fp);
+
+	return result;
+}
+
+std::string trim(std::string s) {
+	s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](uint8_t c) {
+		return !isspace(c);
+	}));
+	s.erase(std::find_if(s.rbegin(), s.rend(), [](uint8_t c) {
+		return !isspace(c);
+	}).base(), s.end());
+	return s;
+}
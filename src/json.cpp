@@ -0,0 +1,98 @@
+#include "main.h"
+
+using json = nlohmann::json;
+
+JsonStreamWriter::JsonStreamWriter(FILE *fp): m_fp(fp) {
+
+}
+
+void JsonStreamWriter::beginObject() {
+	beginValue();
+	fputc('{', m_fp);
+	m_levels.push_back({ false, 0 });
+}
+
+void JsonStreamWriter::endObject() {
+	endLevel('}');
+}
+
+void JsonStreamWriter::beginArray() {
+	beginValue();
+	fputc('[', m_fp);
+	m_levels.push_back({ true, 0 });
+}
+
+void JsonStreamWriter::endArray() {
+	endLevel(']');
+}
+
+void JsonStreamWriter::key(const std::string &name) {
+	auto &level = m_levels.back();
+	fputs(level.count > 0 ? ",\n" : "\n", m_fp);
+	writeIndent();
+	fprintf(m_fp, "%s: ", json(name).dump().c_str());
+	level.count++;
+	m_isAfterKey = true;
+}
+
+void JsonStreamWriter::value(const json &value) {
+	beginValue();
+
+	// Nested lines are shifted to the current depth
+	std::string text = value.dump(2);
+	std::string indent(m_levels.size() * 2, ' ');
+	size_t lineStart = 0;
+	size_t lineEnd;
+	while ((lineEnd = text.find('\n', lineStart)) != std::string::npos) {
+		fwrite(text.data() + lineStart, 1, lineEnd - lineStart + 1, m_fp);
+		fputs(indent.c_str(), m_fp);
+		lineStart = lineEnd + 1;
+	}
+	fputs(text.c_str() + lineStart, m_fp);
+}
+
+void JsonStreamWriter::finishWithError(const std::string &error) {
+	if (m_isAfterKey)
+		value(nullptr);
+	if (m_levels.empty())
+		beginObject();
+	while (m_levels.size() > 1)
+		endLevel(m_levels.back().isArray ? ']' : '}');
+	key("error");
+	value(error);
+	endObject();
+}
+
+void JsonStreamWriter::beginValue() {
+	if (m_isAfterKey) {
+		m_isAfterKey = false;
+		return;
+	}
+
+	if (!m_levels.empty()) {
+		auto &level = m_levels.back();
+		fputs(level.count > 0 ? ",\n" : "\n", m_fp);
+		writeIndent();
+		level.count++;
+	}
+}
+
+void JsonStreamWriter::endLevel(char closeTag) {
+	bool isEmpty = m_levels.back().count == 0;
+	m_levels.pop_back();
+	if (!isEmpty) {
+		fputc('\n', m_fp);
+		writeIndent();
+	}
+	fputc(closeTag, m_fp);
+
+	if (m_levels.empty()) {
+		fputc('\n', m_fp);
+		fflush(m_fp);
+	}
+}
+
+void JsonStreamWriter::writeIndent() {
+	for (size_t i = 0; i < m_levels.size(); i++)
+		fputs("  ", m_fp);
+}
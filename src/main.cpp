@@ -1,17 +1,22 @@
 #include "main.h"
 #include "src/Pattern.h"
+#include "src/utils.h"
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <inttypes.h>
+#include <numeric>
 
 using json = nlohmann::json;
 using namespace Ptr89;
 
+static constexpr size_t STATS_SLOWEST_PATTERNS = 10;
+
 int main(int argc, char *argv[]) {
 	argparse::ArgumentParser program("ptr89", "1.0.4");
 
 	program.add_argument("-f", "--file")
-		.required()
+		.default_value("")
 		.nargs(1);
 	program.add_argument("-b", "--base")
 		.default_value("A0000000")
@@ -20,6 +25,10 @@ int main(int argc, char *argv[]) {
 		.default_value(1)
 		.nargs(1)
 		.scan<'i', int>();
+	program.add_argument("-t", "--threads")
+		.default_value(1)
+		.nargs(1)
+		.scan<'i', int>();
 	program.add_argument("-p", "--pattern")
 		.append()
 		.default_value("")
@@ -32,12 +41,44 @@ int main(int argc, char *argv[]) {
 		.default_value(100)
 		.nargs(1)
 		.scan<'i', int>();
+	program.add_argument("--max-mismatch")
+		.default_value(0)
+		.nargs(1)
+		.scan<'i', int>();
 	program.add_argument("--from-ini")
 		.default_value("")
 		.nargs(1);
 	program.add_argument("--prettify")
 		.default_value("")
 		.nargs(1);
+	program.add_argument("--cache-dir")
+		.default_value("")
+		.nargs(1);
+	program.add_argument("--segment")
+		.append()
+		.default_value("")
+		.nargs(1);
+	program.add_argument("--prev-file")
+		.default_value("")
+		.nargs(1);
+	program.add_argument("--prev-results")
+		.default_value("")
+		.nargs(1);
+	program.add_argument("--functions")
+		.default_value(false)
+		.implicit_value(true)
+		.nargs(0);
+	program.add_argument("--stats")
+		.default_value(false)
+		.implicit_value(true)
+		.nargs(0);
+	program.add_argument("--serve")
+		.default_value(false)
+		.implicit_value(true)
+		.nargs(0);
+	program.add_argument("--socket")
+		.default_value("")
+		.nargs(1);
 	program.add_argument("-V", "--verbose")
 		.default_value(false)
 		.implicit_value(true)
@@ -56,18 +97,26 @@ int main(int argc, char *argv[]) {
 		std::cerr << "\n";
 		std::cerr << "Global options:\n";
 		std::cerr << "  -h, --help               show this help\n";
-		std::cerr << "  -f, --file FILE          fullflash file [required]\n";
+		std::cerr << "  -f, --file FILE          fullflash file, - for stdin [required]\n";
 		std::cerr << "  -b, --base HEX           fullflash base address [default: A0000000]\n";
 		std::cerr << "  -a, --align N            search align [default: 1]\n";
+		std::cerr << "  -t, --threads N          search threads, 0 - all cores [default: 1]\n";
+		std::cerr << "  --segment FILE@HEX       other memory dump at the address (e.g. RAM), can be repeated\n";
+		std::cerr << "  --cache-dir DIR          directory for the x-ref index and search results cache\n";
+		std::cerr << "  --prev-file FILE         previous fullflash revision, only the changed ranges are searched\n";
+		std::cerr << "  --prev-results FILE      JSON results of the same search in the --prev-file\n";
 		std::cerr << "  -V, --verbose            enable debug\n";
 		std::cerr << "  -J, --json               output as JSON\n";
+		std::cerr << "  --stats                  show matcher counters and the slowest patterns\n";
+		std::cerr << "  --functions              show the function containing every result\n";
 		std::cerr << "\n";
 		std::cerr << "Find patterns:\n";
 		std::cerr << "  -p, --pattern STRING     pattern to search\n";
 		std::cerr << "  -n, --limit NUMBER       limit results count [default 100]\n";
+		std::cerr << "  --max-mismatch N         allow N mismatched bytes, results are sorted by the mismatches\n";
 		std::cerr << "\n";
 		std::cerr << "Find xrefs:\n";
-		std::cerr << "  -x, --xref HEX           address to search\n";
+		std::cerr << "  -x, --xref HEX           address to search, can be repeated\n";
 		std::cerr << "  -n, --limit NUMBER       limit results count [default 100]\n";
 		std::cerr << "\n";
 		std::cerr << "Find patterns from functions.ini:\n";
@@ -76,9 +125,14 @@ int main(int argc, char *argv[]) {
 		std::cerr << "Prettify pattern:\n";
 		std::cerr << "  --prettify STRING        pattern\n";
 		std::cerr << "\n";
+		std::cerr << "Server mode:\n";
+		std::cerr << "  --serve                  process JSON requests from stdin, one per line\n";
+		std::cerr << "  --socket PATH            listen on the unix socket instead of stdin\n";
+		std::cerr << "\n";
 	};
 
 	json j;
+	std::unique_ptr<JsonStreamWriter> writer;
 
 	try {
 		program.parse_args(argc, argv);
@@ -88,7 +142,8 @@ int main(int argc, char *argv[]) {
 			return 1;
 		}
 
-		if (program.get<bool>("--verbose"))
+		// Debug output would break the server responses
+		if (program.get<bool>("--verbose") && !program.get<bool>("--serve"))
 			Pattern::setDebugHandler(vprintf);
 
 		uint32_t memoryBase = stoll(program.get<std::string>("--base"), NULL, 16);
@@ -96,149 +151,422 @@ int main(int argc, char *argv[]) {
 		if (memoryAlign <= 0)
 			throw std::runtime_error("Invalid align value.");
 
-		auto [memory, memorySize] = readBinaryFile(program.get<std::string>("--file"));
-		Pattern::Memory memoryRegion = { memoryBase, memory, memorySize, memoryAlign };
+		int threads = program.get<int>("--threads");
+		if (threads < 0)
+			throw std::runtime_error("Invalid threads value.");
+
+		// Firmware is optional in the server mode, it can be specified in the each request
+		if (program.get<bool>("--serve")) {
+			runServer({
+				program.get<std::string>("--file"),
+				memoryBase,
+				memoryAlign,
+				threads,
+				program.get<std::string>("--cache-dir")
+			}, program.get<std::string>("--socket"));
+			return 0;
+		}
+
+		auto filePath = program.get<std::string>("--file");
+		if (filePath.empty())
+			throw std::runtime_error("--file: required.");
+
+		std::vector<std::shared_ptr<PtrExp>> parsedPatterns;
+		if (program.is_used("--pattern"))
+			parsedPatterns = Pattern::parseMany(program.get<std::vector<std::string>>("--pattern"));
+
+		// Every pattern is searched separately, so the counters and time belong to the one pattern
+		bool isStats = program.get<bool>("--stats");
+
+		// Approximate search compares only the pattern bytes, results are ranked by the mismatches
+		int maxMismatches = program.get<int>("--max-mismatch");
+		if (maxMismatches < 0)
+			throw std::runtime_error("Invalid max mismatch value.");
+		bool isApprox = program.is_used("--max-mismatch");
+		if (isApprox && !program.is_used("--pattern"))
+			throw std::runtime_error("--max-mismatch: supported only with --pattern.");
+		if (isApprox && isStats)
+			throw std::runtime_error("--stats: not supported with --max-mismatch.");
+
+		// Other dumps of the same address space, e.g. RAM or the external flash
+		bool isSegmented = program.is_used("--segment");
+
+		bool isIncremental = program.is_used("--prev-file");
+		if (isIncremental && !program.is_used("--prev-results"))
+			throw std::runtime_error("--prev-results: required with --prev-file.");
+		if (isIncremental && program.get<bool>("--verbose"))
+			throw std::runtime_error("--prev-file: not supported with --verbose.");
+		if (isIncremental && isStats)
+			throw std::runtime_error("--prev-file: not supported with --stats.");
+		if (isIncremental && isSegmented)
+			throw std::runtime_error("--prev-file: not supported with --segment.");
+		if (isIncremental && isApprox)
+			throw std::runtime_error("--prev-file: not supported with --max-mismatch.");
+
+		// Results are annotated with the enclosing functions from the function starts index
+		bool withFunctions = program.get<bool>("--functions");
+		Pattern::FunctionIndex functionIndex;
+
+		// Plain byte patterns are searched in the pipe by windows, other patterns need the whole dump
+		bool isStreamSearch = parsedPatterns.size() > 0 && !isIncremental && !isStats && !withFunctions && !isSegmented && !isApprox && !program.get<bool>("--verbose") && MappedFile::isStream(filePath) &&
+			std::all_of(parsedPatterns.begin(), parsedPatterns.end(), Pattern::StreamSearch::isStreamable);
+
+		// Mapped dump is shared between processes and loaded lazily
+		std::shared_ptr<MappedFile> firmware;
+		Pattern::Memory memoryRegion = { memoryBase, nullptr, 0, memoryAlign };
+		if (!isStreamSearch) {
+			firmware = MappedFile::open(filePath, MAPPED_FILE_ACCESS_SEQUENTIAL);
+			memoryRegion.data = firmware->data();
+			memoryRegion.size = firmware->size();
+		}
+
+		// Pointers and branches to the other segments are followed, every segment is searched
+		std::vector<std::shared_ptr<MappedFile>> segmentFiles;
+		if (isSegmented) {
+			Pattern::SegmentList segments = { { memoryBase, memoryRegion.data, memoryRegion.size } };
+			for (auto &segmentStr: program.get<std::vector<std::string>>("--segment")) {
+				auto separator = segmentStr.rfind('@');
+				if (separator == std::string::npos || separator == 0 || separator + 1 == segmentStr.size())
+					throw std::runtime_error("--segment: expected FILE@HEX, got '" + segmentStr + "'.");
+				auto segmentFile = MappedFile::open(segmentStr.substr(0, separator), MAPPED_FILE_ACCESS_SEQUENTIAL);
+				uint32_t segmentBase = stoll(segmentStr.substr(separator + 1), NULL, 16);
+				segments.push_back({ segmentBase, segmentFile->data(), segmentFile->size() });
+				segmentFiles.push_back(segmentFile);
+			}
+			memoryRegion.segments = Pattern::createSegments(std::move(segments));
+		}
+
+		// Results of the previous firmware revision are reused for the unchanged ranges
+		std::shared_ptr<MappedFile> prevFirmware;
+		Pattern::MemoryDiff memoryDiff;
+		PrevSearchResults prevResults = {};
+		if (isIncremental) {
+			prevFirmware = MappedFile::open(program.get<std::string>("--prev-file"), MAPPED_FILE_ACCESS_SEQUENTIAL);
+			memoryDiff = Pattern::MemoryDiff::build({ memoryBase, prevFirmware->data(), prevFirmware->size(), memoryAlign }, memoryRegion);
+			prevResults = readPrevResults(program.get<std::string>("--prev-results"), memoryBase, memoryAlign);
+		}
+
+		// Results of the same patterns in the same dump are reused from the previous runs
+		auto cacheDir = program.get<std::string>("--cache-dir");
+		bool useResultCache = !cacheDir.empty() && !isStreamSearch && !isStats && !isSegmented && !isApprox && !program.get<bool>("--verbose");
 
 		auto asJSON = program.get<bool>("--json");
 		if (program.is_used("--pattern")) {
 			uint32_t limit = program.get<int>("--limit");
 
 			auto patterns = program.get<std::vector<std::string>>("--pattern");
-			j["patterns"] = json::array();
 
-			auto start = duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-			for (auto &patternStr: patterns) {
-				auto pattern = Pattern::parse(patternStr);
-				auto results = Pattern::find(pattern, memoryRegion, limit);
-				if (asJSON) {
-					json patternJson;
-					patternJson["pattern"] = patternStr;
-					patternJson["results"] = json::array();
-					for (auto &result: results) {
-						json item;
-						item["address"] = result.address;
-						item["offset"] = result.offset;
-						item["value"] = result.value;
-
-						if (pattern->type == PATTERN_TYPE_OFFSET) {
-							item["type"] = "offset";
-						} else if (pattern->type == PATTERN_TYPE_POINTER) {
-							item["type"] = "pointer";
-						} else if (pattern->type == PATTERN_TYPE_REFERENCE) {
-							item["type"] = "reference";
-						} else if (pattern->type == PATTERN_TYPE_BRANCH_REFERENCE) {
-							item["type"] = "branch";
-						} else if (pattern->type == PATTERN_TYPE_STATIC_VALUE) {
-							item["type"] = "static_value";
-						}
+			// Byte frequencies for the search planning, one pass is cheaper than searching with bad anchors
+			auto prepareMemory = [&]() {
+				if (!memoryRegion.histogram) {
+					memoryRegion.histogram = Pattern::createHistogram(memoryRegion);
+					memoryRegion.thunks = Pattern::ThunkMap::build(memoryRegion);
+				}
+			};
+			if (patterns.size() > 1 && !isStreamSearch && !useResultCache && !isApprox)
+				prepareMemory();
+
+			auto findPatterns = [&](const std::vector<size_t> &indexes) {
+				std::vector<std::string> searchPatternsStr;
+				std::vector<std::shared_ptr<PtrExp>> searchPatterns;
+				for (auto i: indexes) {
+					searchPatternsStr.push_back(patterns[i]);
+					searchPatterns.push_back(parsedPatterns[i]);
+				}
+				if (isIncremental)
+					return findManyIncremental(searchPatternsStr, searchPatterns, memoryRegion, memoryDiff, prevResults, limit, threads);
+				if (isSegmented)
+					return findManySegmented(searchPatterns, memoryRegion, limit, threads);
+				if (searchPatterns.size() == 1)
+					return std::vector<std::vector<Pattern::SearchResult>> { Pattern::find(searchPatterns[0], memoryRegion, limit, threads) };
+				prepareMemory();
+				return Pattern::findMany(searchPatterns, memoryRegion, limit, threads);
+			};
+
+			std::vector<size_t> allIndexes(patterns.size());
+			std::iota(allIndexes.begin(), allIndexes.end(), 0);
+
+			auto start = duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+			// Patterns are searched concurrently, the debug output must stay in the patterns order
+			std::vector<std::vector<Pattern::SearchResult>> patternsResults;
+			std::vector<SearchStats> patternsStats;
+			if (isStats) {
+				patternsStats.resize(patterns.size());
+				if (isSegmented) {
+					patternsResults = findManySegmented(parsedPatterns, memoryRegion, limit, threads, &patternsStats);
+				} else {
+					for (size_t i = 0; i < patterns.size(); i++)
+						patternsResults.push_back(Pattern::find(parsedPatterns[i], memoryRegion, limit, threads, &patternsStats[i]));
+				}
+			} else if (isStreamSearch) {
+				patternsResults = searchStream(filePath, parsedPatterns, memoryRegion, limit);
+			} else if (useResultCache) {
+				patternsResults = findManyCached(parsedPatterns, memoryRegion, limit, cacheDir, findPatterns);
+			} else if (isIncremental || (patterns.size() > 1 && !isApprox && !program.get<bool>("--verbose"))) {
+				patternsResults = findPatterns(allIndexes);
+			}
 
-						patternJson["results"].push_back(item);
-					}
-					j["patterns"].push_back(patternJson);
+			if (withFunctions)
+				functionIndex = Pattern::FunctionIndex::build(memoryRegion, threads);
+
+			// Results are written as soon as they are found, so the memory usage doesn't depend on the limit
+			auto functions = withFunctions ? &functionIndex : nullptr;
+			if (asJSON) {
+				writer = std::make_unique<JsonStreamWriter>(stdout);
+				writer->beginObject();
+				// Search settings are checked when the results are reused by --prev-results
+				writer->key("base");
+				writer->value(memoryBase);
+				writer->key("align");
+				writer->value(memoryAlign);
+				writer->key("limit");
+				writer->value(limit);
+				writer->key("patterns");
+				writer->beginArray();
+			}
+
+			for (size_t i = 0; i < patterns.size(); i++) {
+				auto &patternStr = patterns[i];
+				auto &pattern = parsedPatterns[i];
+
+				if (asJSON) {
+					writer->beginObject();
+					writer->key("pattern");
+					writer->value(patternStr);
+					writer->key("results");
+					writer->beginArray();
 				} else {
 					printf("Pattern: '%s'\n", patternStr.c_str());
-					printf("Found %" PRIu64 "d matches:\n", results.size());
-					for (auto &result: results) {
-						if (pattern->type == PATTERN_TYPE_OFFSET) {
-							printf("  %08X: %08X (offset)\n", result.address, result.value);
-						} else if (pattern->type == PATTERN_TYPE_POINTER) {
-							printf("  %08X: %08X (pointer)\n", result.address, result.value);
-						} else if (pattern->type == PATTERN_TYPE_REFERENCE) {
-							printf("  %08X: %08X (reference)\n", result.address, result.value);
-						} else if (pattern->type == PATTERN_TYPE_BRANCH_REFERENCE) {
-							printf("  %08X: %08X (branch)\n", result.address, result.value);
-						} else if (pattern->type == PATTERN_TYPE_STATIC_VALUE) {
-							printf("  %08X (static value)\n", result.value);
+				}
+
+				size_t resultsCnt = 0;
+				auto onResult = [&](const Pattern::SearchResult &result) {
+					if (asJSON) {
+						writer->value(searchResultToJSON(pattern, result, functions));
+					} else {
+						printSearchResult(pattern, result, functions);
+					}
+					resultsCnt++;
+					return !limit || resultsCnt < limit;
+				};
+
+				if (isApprox) {
+					for (auto &approxResult: findApproxSegmented(pattern, memoryRegion, maxMismatches, limit, threads)) {
+						if (asJSON) {
+							auto item = searchResultToJSON(pattern, approxResult.result, functions);
+							item["mismatches"] = approxResult.mismatches;
+							writer->value(item);
+						} else {
+							printSearchResult(pattern, approxResult.result, functions, approxResult.mismatches);
 						}
+						resultsCnt++;
 					}
+				} else if (patternsResults.empty()) {
+					// Segments are searched in the address order, static value doesn't depend on the memory
+					bool isStopped = false;
+					for (auto &segmentMemory: Pattern::getSegmentsMemory(memoryRegion)) {
+						Pattern::find(pattern, segmentMemory, [&](const Pattern::SearchResult &result) {
+							if (onResult(result))
+								return true;
+							Pattern::debug("Maximum search results are reached.\n");
+							isStopped = true;
+							return false;
+						}, threads);
+						if (isStopped || pattern->type == PATTERN_TYPE_STATIC_VALUE)
+							break;
+					}
+				} else {
+					for (auto &result: patternsResults[i])
+						onResult(result);
+				}
+
+				if (asJSON) {
+					writer->endArray();
+					writer->endObject();
+				} else {
+					printf("Found %zu matches\n", resultsCnt);
 					printf("\n");
 				}
+				fflush(stdout);
 			}
-			auto end = duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-			j["elapsed"] = end - start;
 
-			if (!asJSON) {
+			if (asJSON)
+				writer->endArray();
+
+			auto end = duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+			if (isStats && !asJSON)
+				printSearchStats(patterns, patternsStats);
+
+			if (asJSON) {
+				writer->key("elapsed");
+				writer->value(end - start);
+				if (isStats) {
+					writer->key("stats");
+					writer->value(searchStatsToJSON(patterns, patternsStats));
+				}
+				writer->endObject();
+				writer.reset();
+			} else {
 				printf("Search done in %" PRIu64 " ms\n", end - start);
 			}
 		} else if (program.is_used("--xrefs")) {
-			uint32_t addr = stoll(program.get<std::string>("--xrefs"), NULL, 16);
 			uint32_t limit = program.get<int>("--limit");
 
-			j["results"] = json::array();
-			auto start = duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-			auto results = Pattern::finXRefs(addr, memoryRegion, limit);
+			std::vector<uint32_t> addresses;
+			for (auto &addrStr: program.get<std::vector<std::string>>("--xrefs"))
+				addresses.push_back(stoll(addrStr, NULL, 16));
+
+			auto start = duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+			// Decoding all instructions once is cheaper than the full sweep for each address
+			Pattern::XRefIndex xrefIndex;
+			bool useIndex = (addresses.size() > 1 || !cacheDir.empty()) && !isSegmented && !program.get<bool>("--verbose");
+			if (useIndex)
+				xrefIndex = getXRefIndex(memoryRegion, cacheDir, threads);
+			if (withFunctions)
+				functionIndex = Pattern::FunctionIndex::build(memoryRegion, threads);
+
+			auto functions = withFunctions ? &functionIndex : nullptr;
 			if (asJSON) {
-				for (auto &result: results) {
-					json item;
-					item["address"] = result.address;
-					item["offset"] = result.offset;
-
-					if (result.type == XREF_TYPE_REFERENCE) {
-						item["type"] = "reference";
-					} else if (result.type == XREF_TYPE_BRANCH_CALL) {
-						item["type"] = "branch";
-					} else if (result.type == XREF_TYPE_POINTER) {
-						item["type"] = "pointer";
-					}
+				writer = std::make_unique<JsonStreamWriter>(stdout);
+				writer->beginObject();
+				if (addresses.size() > 1) {
+					writer->key("xrefs");
+					writer->beginArray();
+				}
+			}
 
-					j["results"].push_back(item);
+			for (auto addr: addresses) {
+				if (asJSON) {
+					if (addresses.size() > 1) {
+						writer->beginObject();
+						writer->key("address");
+						writer->value(addr);
+					}
+					writer->key("results");
+					writer->beginArray();
+				} else {
+					printf("Searching x-refs for %08X\n", addr);
 				}
-			} else {
-				printf("Searching x-refs for %08X\n", addr);
-				printf("Found %" PRIu64 "d matches:\n", results.size());
-				for (auto &result: results) {
-					if (result.type == XREF_TYPE_REFERENCE) {
-						printf("  %08X (reference)\n", result.address);
-					} else if (result.type == XREF_TYPE_BRANCH_CALL) {
-						printf("  %08X (branch call)\n", result.address);
-					} else if (result.type == XREF_TYPE_POINTER) {
-						printf("  %08X (pointer)\n", result.address);
+
+				size_t resultsCnt = 0;
+				auto onResult = [&](const Pattern::XRefSearchResult &result) {
+					if (asJSON) {
+						writer->value(xrefResultToJSON(result, functions));
+					} else {
+						printXRefResult(result, functions);
+					}
+					resultsCnt++;
+					return !limit || resultsCnt < limit;
+				};
+
+				if (useIndex) {
+					for (auto &result: xrefIndex.find(addr, limit))
+						onResult(result);
+				} else {
+					bool isStopped = false;
+					for (auto &segmentMemory: Pattern::getSegmentsMemory(memoryRegion)) {
+						Pattern::finXRefs(addr, segmentMemory, [&](const Pattern::XRefSearchResult &result) {
+							if (onResult(result))
+								return true;
+							Pattern::debug("Maximum search results are reached.\n");
+							isStopped = true;
+							return false;
+						});
+						if (isStopped)
+							break;
 					}
 				}
-				printf("\n");
+
+				if (asJSON) {
+					writer->endArray();
+					if (addresses.size() > 1)
+						writer->endObject();
+				} else {
+					printf("Found %zu matches\n", resultsCnt);
+					printf("\n");
+				}
+				fflush(stdout);
 			}
-			auto end = duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-			j["elapsed"] = end - start;
+			auto end = duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 
-			if (!asJSON) {
+			if (asJSON) {
+				if (addresses.size() > 1)
+					writer->endArray();
+				writer->key("elapsed");
+				writer->value(end - start);
+				writer->endObject();
+				writer.reset();
+			} else {
 				printf("Search done in %" PRIu64 " ms\n", end - start);
 			}
 		} else if (program.is_used("--from-ini")) {
-			auto start = duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			auto start = duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 			auto patternsLib = parsePatternsIni(program.get<std::string>("--from-ini"));
 
+			std::vector<std::string> patternsStr;
+			for (auto &entry: patternsLib)
+				patternsStr.push_back(entry.pattern);
+			auto patterns = Pattern::parseMany(patternsStr);
+
+			auto findPatterns = [&](const std::vector<size_t> &indexes) {
+				if (!memoryRegion.histogram) {
+					memoryRegion.histogram = Pattern::createHistogram(memoryRegion);
+					memoryRegion.thunks = Pattern::ThunkMap::build(memoryRegion);
+				}
+
+				std::vector<std::string> searchPatternsStr;
+				std::vector<std::shared_ptr<PtrExp>> searchPatterns;
+				for (auto i: indexes) {
+					searchPatternsStr.push_back(patternsLib[i].pattern);
+					searchPatterns.push_back(patterns[i]);
+				}
+				if (isIncremental)
+					return findManyIncremental(searchPatternsStr, searchPatterns, memoryRegion, memoryDiff, prevResults, 1, threads);
+				if (isSegmented)
+					return findManySegmented(searchPatterns, memoryRegion, 1, threads);
+				return Pattern::findMany(searchPatterns, memoryRegion, 1, threads);
+			};
+
+			std::vector<std::vector<Pattern::SearchResult>> patternsResults;
+			std::vector<SearchStats> patternsStats;
+			if (isStats) {
+				memoryRegion.histogram = Pattern::createHistogram(memoryRegion);
+				memoryRegion.thunks = Pattern::ThunkMap::build(memoryRegion);
+				patternsStats.resize(patterns.size());
+				if (isSegmented) {
+					patternsResults = findManySegmented(patterns, memoryRegion, 1, threads, &patternsStats);
+				} else {
+					for (size_t i = 0; i < patterns.size(); i++)
+						patternsResults.push_back(Pattern::find(patterns[i], memoryRegion, 1, threads, &patternsStats[i]));
+				}
+			} else if (useResultCache) {
+				patternsResults = findManyCached(patterns, memoryRegion, 1, cacheDir, findPatterns);
+			} else {
+				std::vector<size_t> allIndexes(patterns.size());
+				std::iota(allIndexes.begin(), allIndexes.end(), 0);
+				patternsResults = findPatterns(allIndexes);
+			}
+
+			// Search settings are checked when the results are reused by --prev-results
+			j["base"] = memoryBase;
+			j["align"] = memoryAlign;
+			j["limit"] = 1;
 			j["patterns"] = json::array();
 
-			for (auto &entry: patternsLib) {
-				auto pattern = Pattern::parse(entry.pattern);
-				auto results = Pattern::find(pattern, memoryRegion, 1);
+			for (size_t i = 0; i < patternsLib.size(); i++) {
+				auto &entry = patternsLib[i];
+				auto &pattern = patterns[i];
+				auto &results = patternsResults[i];
 
 				if (asJSON) {
 					json patternJson;
 					patternJson["pattern"] = entry.pattern;
 					patternJson["id"] = entry.id;
 					patternJson["function"] = entry.funcName;
-					patternJson["results"] = json::array();
-					for (auto &result: results) {
-						json item;
-						item["address"] = result.address;
-						item["offset"] = result.offset;
-						item["value"] = result.value;
-
-						if (pattern->type == PATTERN_TYPE_OFFSET) {
-							item["type"] = "offset";
-						} else if (pattern->type == PATTERN_TYPE_POINTER) {
-							item["type"] = "pointer";
-						} else if (pattern->type == PATTERN_TYPE_REFERENCE) {
-							item["type"] = "reference";
-						} else if (pattern->type == PATTERN_TYPE_BRANCH_REFERENCE) {
-							item["type"] = "branch";
-						} else if (pattern->type == PATTERN_TYPE_STATIC_VALUE) {
-							item["type"] = "static_value";
-						}
-
-						patternJson["results"].push_back(item);
-					}
+					patternJson["results"] = searchResultsToJSON(pattern, results);
 					j["patterns"].push_back(patternJson);
 				} else {
 					if (entry.id > 0 && (entry.id & 0xF) == 0)
@@ -252,8 +580,20 @@ int main(int argc, char *argv[]) {
 					}
 				}
 			}
-			auto end = duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			auto end = duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 			j["elapsed"] = end - start;
+
+			// Stats are printed to stderr, so swilib.vkp is not broken
+			if (isStats) {
+				std::vector<std::string> names;
+				for (auto &entry: patternsLib)
+					names.push_back(strprintf("%03X: %s", entry.id, entry.funcName.c_str()));
+				if (asJSON) {
+					j["stats"] = searchStatsToJSON(names, patternsStats);
+				} else {
+					printSearchStats(names, patternsStats);
+				}
+			}
 		} else if (program.is_used("--prettify")) {
 			auto patternStr = program.get<std::string>("--prettify");
 			if (asJSON) {
@@ -263,13 +603,14 @@ int main(int argc, char *argv[]) {
 			}
 		}
 
-		if (asJSON) {
+		// Patterns and x-refs are already written by the stream writer
+		if (asJSON && !j.is_null()) {
 			printf("%s\n", j.dump(2).c_str());
 		}
-
-		delete[] memory;
 	} catch (const std::exception &err) {
-		if (program.get<bool>("--json")) {
+		if (writer) {
+			writer->finishWithError(err.what());
+		} else if (program.get<bool>("--json")) {
 			j["error"] = err.what();
 			printf("%s\n", j.dump(2).c_str());
 		} else {
@@ -282,69 +623,341 @@ int main(int argc, char *argv[]) {
 	return 0;
 }
 
-std::vector<PatternsLibraryItem> parsePatternsIni(const std::string &iniFile) {
-	auto iniText = readFile(iniFile);
-	std::regex exp(R"(^[ \t]*([0-9a-f]+):[ \t]*([^=;\n]+)(?:[ \t]*=[ \t]*([^;:\n]*))?)", std::regex::icase | std::regex::multiline);
-	std::smatch m;
-	std::vector<PatternsLibraryItem> results;
-	auto searchStart = iniText.cbegin();
-	while (std::regex_search(searchStart, iniText.cend(), m, exp)) {
-		auto id = stoi(m[1].str(), NULL, 16);
-		auto funcName = trim(m[2].str());
-		auto patternStr = trim(m[3].str());
-		results.push_back({ id, funcName, patternStr });
-		searchStart = m.suffix().first;
+std::string functionToString(const Pattern::FunctionIndex *functions, uint32_t addr) {
+	if (!functions)
+		return "";
+	auto [isFound, function] = functions->findContaining(addr);
+	return isFound ? strprintf(" in %08X", function) : " in ?";
+}
+
+static json functionToJSON(const Pattern::FunctionIndex &functions, uint32_t addr) {
+	auto [isFound, function] = functions.findContaining(addr);
+	return isFound ? json(function) : json(nullptr);
+}
+
+json searchResultToJSON(const std::shared_ptr<PtrExp> &pattern, const Pattern::SearchResult &result, const Pattern::FunctionIndex *functions) {
+	json item;
+	item["address"] = result.address;
+	item["offset"] = result.offset;
+	item["value"] = result.value;
+
+	if (functions && pattern->type != PATTERN_TYPE_STATIC_VALUE)
+		item["function"] = functionToJSON(*functions, result.address);
+
+	if (pattern->type == PATTERN_TYPE_OFFSET) {
+		item["type"] = "offset";
+	} else if (pattern->type == PATTERN_TYPE_POINTER) {
+		item["type"] = "pointer";
+	} else if (pattern->type == PATTERN_TYPE_REFERENCE) {
+		item["type"] = "reference";
+	} else if (pattern->type == PATTERN_TYPE_BRANCH_REFERENCE) {
+		item["type"] = "branch";
+	} else if (pattern->type == PATTERN_TYPE_STATIC_VALUE) {
+		item["type"] = "static_value";
 	}
-	return results;
+
+	return item;
+}
+
+json searchResultsToJSON(const std::shared_ptr<PtrExp> &pattern, const std::vector<Pattern::SearchResult> &results, const Pattern::FunctionIndex *functions) {
+	json resultsJson = json::array();
+	for (auto &result: results)
+		resultsJson.push_back(searchResultToJSON(pattern, result, functions));
+	return resultsJson;
+}
+
+void printSearchResult(const std::shared_ptr<PtrExp> &pattern, const Pattern::SearchResult &result, const Pattern::FunctionIndex *functions, int mismatches) {
+	// Approximate results show the distance to the pattern
+	std::string details = mismatches >= 0 ? strprintf(", %d mismatches", mismatches) : "";
+	if (pattern->type == PATTERN_TYPE_OFFSET) {
+		printf("  %08X: %08X (offset%s)%s\n", result.address, result.value, details.c_str(), functionToString(functions, result.address).c_str());
+	} else if (pattern->type == PATTERN_TYPE_POINTER) {
+		printf("  %08X: %08X (pointer%s)%s\n", result.address, result.value, details.c_str(), functionToString(functions, result.address).c_str());
+	} else if (pattern->type == PATTERN_TYPE_REFERENCE) {
+		printf("  %08X: %08X (reference%s)%s\n", result.address, result.value, details.c_str(), functionToString(functions, result.address).c_str());
+	} else if (pattern->type == PATTERN_TYPE_BRANCH_REFERENCE) {
+		printf("  %08X: %08X (branch%s)%s\n", result.address, result.value, details.c_str(), functionToString(functions, result.address).c_str());
+	} else if (pattern->type == PATTERN_TYPE_STATIC_VALUE) {
+		printf("  %08X (static value)\n", result.value);
+	}
+}
+
+static json searchCountersToJSON(const SearchStats &stats) {
+	json item;
+	item["scanned_bytes"] = stats.scannedBytes;
+	item["candidates"] = stats.candidates;
+	item["fuzzy_rejects"] = stats.fuzzyRejects;
+	item["follows"] = {
+		{ "branch_4b", stats.follows[SUB_PATTERN_TYPE_BRANCH_4B] },
+		{ "branch_2b", stats.follows[SUB_PATTERN_TYPE_BRANCH_2B] },
+		{ "ldr_4b", stats.follows[SUB_PATTERN_TYPE_LDR_4B] },
+		{ "ldr_2b", stats.follows[SUB_PATTERN_TYPE_LDR_2B] },
+	};
+	item["sub_pattern_rejects"] = stats.subPatternRejects;
+	item["decode_failures"] = stats.decodeFailures;
+	item["matches"] = stats.matches;
+	item["elapsed_us"] = stats.elapsedUs;
+	return item;
+}
+
+static std::vector<size_t> getSlowestPatterns(const std::vector<SearchStats> &patternsStats) {
+	std::vector<size_t> indexes(patternsStats.size());
+	std::iota(indexes.begin(), indexes.end(), 0);
+	std::stable_sort(indexes.begin(), indexes.end(), [&](size_t a, size_t b) {
+		return patternsStats[a].elapsedUs > patternsStats[b].elapsedUs;
+	});
+	return indexes;
+}
+
+json searchStatsToJSON(const std::vector<std::string> &names, const std::vector<SearchStats> &patternsStats) {
+	SearchStats total;
+	for (auto &stats: patternsStats)
+		total += stats;
+
+	json statsJson;
+	statsJson["total"] = searchCountersToJSON(total);
+	statsJson["slowest"] = json::array();
+	for (auto i: getSlowestPatterns(patternsStats)) {
+		json item = searchCountersToJSON(patternsStats[i]);
+		item["index"] = i;
+		item["pattern"] = names[i];
+		statsJson["slowest"].push_back(item);
+	}
+	return statsJson;
 }
 
-std::string readFile(const std::string &path) {
-	FILE *fp = fopen(path.c_str(), "r");
-	if (!fp) {
-		throw std::runtime_error("fopen(" + path + ") error: " + strerror(errno));
+void printSearchStats(const std::vector<std::string> &names, const std::vector<SearchStats> &patternsStats) {
+	auto printCounters = [](const SearchStats &stats) {
+		fprintf(stderr, "%10.3f ms  scanned=%" PRIu64 " candidates=%" PRIu64 " fuzzy_rejects=%" PRIu64 " follows=%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64
+			" sub_rejects=%" PRIu64 " decode_failures=%" PRIu64 " matches=%" PRIu64,
+			stats.elapsedUs / 1000.0, stats.scannedBytes, stats.candidates, stats.fuzzyRejects,
+			stats.follows[SUB_PATTERN_TYPE_BRANCH_4B], stats.follows[SUB_PATTERN_TYPE_BRANCH_2B], stats.follows[SUB_PATTERN_TYPE_LDR_4B], stats.follows[SUB_PATTERN_TYPE_LDR_2B],
+			stats.subPatternRejects, stats.decodeFailures, stats.matches);
+	};
+
+	SearchStats total;
+	for (auto &stats: patternsStats)
+		total += stats;
+
+	auto slowest = getSlowestPatterns(patternsStats);
+	fprintf(stderr, "Slowest patterns (follows: {}/[]/LDR{}/LDR[]):\n");
+	for (size_t i = 0; i < std::min(slowest.size(), STATS_SLOWEST_PATTERNS); i++) {
+		fprintf(stderr, "  ");
+		printCounters(patternsStats[slowest[i]]);
+		fprintf(stderr, "  %s\n", names[slowest[i]].c_str());
 	}
+	fprintf(stderr, "Total:\n  ");
+	printCounters(total);
+	fprintf(stderr, "\n\n");
+}
+
+json xrefResultToJSON(const Pattern::XRefSearchResult &result, const Pattern::FunctionIndex *functions) {
+	json item;
+	item["address"] = result.address;
+	item["offset"] = result.offset;
 
-	char buff[4096];
-	std::string result;
-	while (!feof(fp)) {
-		int readed = fread(buff, 1, sizeof(buff), fp);
-		if (readed > 0)
-			result.append(buff, readed);
+	if (functions)
+		item["function"] = functionToJSON(*functions, result.address);
+
+	if (result.type == XREF_TYPE_REFERENCE) {
+		item["type"] = "reference";
+	} else if (result.type == XREF_TYPE_BRANCH_CALL) {
+		item["type"] = "branch";
+	} else if (result.type == XREF_TYPE_POINTER) {
+		item["type"] = "pointer";
 	}
-	fclose(fp);
 
-	return result;
+	return item;
+}
+
+json xrefResultsToJSON(const std::vector<Pattern::XRefSearchResult> &results, const Pattern::FunctionIndex *functions) {
+	json resultsJson = json::array();
+	for (auto &result: results)
+		resultsJson.push_back(xrefResultToJSON(result, functions));
+	return resultsJson;
 }
 
-std::pair<uint8_t *, size_t> readBinaryFile(const std::string &path) {
-	FILE *fp = fopen(path.c_str(), "r");
-	if (!fp) {
-		throw std::runtime_error("fopen(" + path + ") error: " + strerror(errno));
+void printXRefResult(const Pattern::XRefSearchResult &result, const Pattern::FunctionIndex *functions) {
+	if (result.type == XREF_TYPE_REFERENCE) {
+		printf("  %08X (reference)%s\n", result.address, functionToString(functions, result.address).c_str());
+	} else if (result.type == XREF_TYPE_BRANCH_CALL) {
+		printf("  %08X (branch call)%s\n", result.address, functionToString(functions, result.address).c_str());
+	} else if (result.type == XREF_TYPE_POINTER) {
+		printf("  %08X (pointer)%s\n", result.address, functionToString(functions, result.address).c_str());
 	}
+}
+
+Pattern::XRefIndex getXRefIndex(const Pattern::Memory &memory, const std::string &cacheDir, int threads) {
+	if (cacheDir.empty())
+		return Pattern::XRefIndex::build(memory, threads);
 
-	size_t maxFileSize = std::filesystem::file_size(path);
-	uint8_t *bytes = new uint8_t[maxFileSize];
+	// The same dump can be loaded with different base addresses
+	uint64_t memoryHash = Pattern::hashMemory(memory);
+	char fileName[64];
+	snprintf(fileName, sizeof(fileName), "%016" PRIx64 "-%08X.xrefs", memoryHash, memory.base);
+	auto path = (std::filesystem::path(cacheDir) / fileName).string();
 
-	size_t readed = 0;
-	while (!feof(fp) && readed < maxFileSize) {
-		int ret = fread(bytes + readed, 1, std::min(static_cast<size_t>(4096), maxFileSize - readed), fp);
-		if (ret > 0) {
-			readed += ret;
-		} else if (ret < 0) {
-			throw std::runtime_error("fread(" + path + ") error: " + strerror(errno));
+	auto [isLoaded, index] = Pattern::XRefIndex::load(path, memory, memoryHash);
+	if (isLoaded)
+		return index;
+
+	index = Pattern::XRefIndex::build(memory, threads);
+	std::filesystem::create_directories(cacheDir);
+	index.save(path, memoryHash);
+	return index;
+}
+
+/*
+ * Patterns found earlier in the same dump with the same or a larger limit are taken from the cache.
+ * Other patterns are searched with search() and added to the cache.
+ * */
+std::vector<std::vector<Pattern::SearchResult>> findManyCached(const std::vector<std::shared_ptr<PtrExp>> &patterns, const Pattern::Memory &memory, size_t limit,
+		const std::string &cacheDir, const PatternsSearch &search) {
+	uint64_t memoryHash = Pattern::hashMemory(memory);
+	char fileName[64];
+	snprintf(fileName, sizeof(fileName), "%016" PRIx64 "-%08X-%d.results", memoryHash, memory.base, memory.align);
+	auto path = (std::filesystem::path(cacheDir) / fileName).string();
+
+	auto cache = Pattern::ResultCache::load(path, memory, memoryHash);
+
+	// Canonical form, so the formatting of the same pattern doesn't matter
+	std::vector<std::string> keys;
+	std::vector<size_t> missedIndexes;
+	std::vector<std::vector<Pattern::SearchResult>> patternsResults(patterns.size());
+	for (size_t i = 0; i < patterns.size(); i++) {
+		keys.push_back(Pattern::stringify(patterns[i]));
+		auto [isFound, results] = cache.find(keys[i], limit);
+		if (isFound) {
+			patternsResults[i] = std::move(results);
+		} else {
+			missedIndexes.push_back(i);
 		}
 	}
-	fclose(fp);
 
-	return { bytes, readed };
+	if (missedIndexes.empty())
+		return patternsResults;
+
+	auto missedResults = search(missedIndexes);
+	for (size_t i = 0; i < missedIndexes.size(); i++) {
+		cache.add(keys[missedIndexes[i]], limit, missedResults[i]);
+		patternsResults[missedIndexes[i]] = std::move(missedResults[i]);
+	}
+
+	if (cache.isChanged()) {
+		std::filesystem::create_directories(cacheDir);
+		cache.save(path);
+	}
+
+	return patternsResults;
 }
 
-std::string trim(std::string s) {
-	s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](uint8_t c) {
-		return !isspace(c);
-	}));
-	s.erase(std::find_if(s.rbegin(), s.rend(), [](uint8_t c) {
-		return !isspace(c);
-	}).base(), s.end());
-	return s;
+/*
+ * Results found with the other base or align are not reused, all patterns fall back to the full search.
+ * */
+PrevSearchResults readPrevResults(const std::string &path, uint32_t base, int align) {
+	auto j = json::parse(readFile(path));
+	if (j.contains("error"))
+		throw std::runtime_error("Previous results contain error: " + j["error"].get<std::string>());
+
+	PrevSearchResults prevResults = {};
+	if (!j.contains("base") || !j.contains("align") || !j.contains("limit"))
+		return prevResults;
+	if (j["base"].get<uint32_t>() != base || j["align"].get<int>() != align)
+		return prevResults;
+
+	prevResults.limit = j["limit"].get<size_t>();
+	for (auto &patternJson: j.at("patterns")) {
+		auto &results = prevResults.patterns[patternJson.at("pattern").get<std::string>()];
+		for (auto &item: patternJson.at("results"))
+			results.push_back({ item.at("address").get<uint32_t>(), item.at("offset").get<uint32_t>(), item.at("value").get<uint32_t>() });
+	}
+	return prevResults;
+}
+
+/*
+ * Self-contained patterns from the previous results are searched only in the changed ranges.
+ * Other patterns depend on the whole memory and are searched as usual.
+ * */
+std::vector<std::vector<Pattern::SearchResult>> findManyIncremental(const std::vector<std::string> &patternsStr, const std::vector<std::shared_ptr<PtrExp>> &patterns,
+		const Pattern::Memory &memory, const Pattern::MemoryDiff &diff, const PrevSearchResults &prevResults, size_t limit, int threads) {
+	std::vector<std::vector<Pattern::SearchResult>> patternsResults(patterns.size());
+	std::vector<std::shared_ptr<PtrExp>> otherPatterns;
+	std::vector<size_t> otherIndexes;
+
+	for (size_t i = 0; i < patterns.size(); i++) {
+		auto it = prevResults.patterns.find(patternsStr[i]);
+		if (it != prevResults.patterns.end() && Pattern::isSelfContained(patterns[i])) {
+			patternsResults[i] = Pattern::findIncremental(patterns[i], diff, it->second, prevResults.limit, limit);
+		} else {
+			otherPatterns.push_back(patterns[i]);
+			otherIndexes.push_back(i);
+		}
+	}
+
+	auto otherResults = Pattern::findMany(otherPatterns, memory, limit, threads);
+	for (size_t i = 0; i < otherIndexes.size(); i++)
+		patternsResults[otherIndexes[i]] = std::move(otherResults[i]);
+
+	return patternsResults;
+}
+
+/*
+ * Segments are searched in the address order, the limit is applied to the merged results.
+ * Static values don't depend on the memory, so they are taken only from the first segment.
+ * */
+std::vector<std::vector<Pattern::SearchResult>> findManySegmented(const std::vector<std::shared_ptr<PtrExp>> &patterns, const Pattern::Memory &memory, size_t limit, int threads,
+		std::vector<SearchStats> *patternsStats) {
+	std::vector<std::vector<Pattern::SearchResult>> patternsResults(patterns.size());
+	bool isFirstSegment = true;
+	for (auto &segmentMemory: Pattern::getSegmentsMemory(memory)) {
+		std::vector<std::shared_ptr<PtrExp>> searchPatterns;
+		std::vector<size_t> indexes;
+		for (size_t i = 0; i < patterns.size(); i++) {
+			if (limit && patternsResults[i].size() >= limit)
+				continue;
+			if (!isFirstSegment && patterns[i]->type == PATTERN_TYPE_STATIC_VALUE)
+				continue;
+			searchPatterns.push_back(patterns[i]);
+			indexes.push_back(i);
+		}
+		isFirstSegment = false;
+
+		if (indexes.empty())
+			break;
+
+		std::vector<std::vector<Pattern::SearchResult>> segmentResults;
+		if (patternsStats) {
+			for (auto i: indexes)
+				segmentResults.push_back(Pattern::find(patterns[i], segmentMemory, limit, threads, &(*patternsStats)[i]));
+		} else {
+			segmentResults = Pattern::findMany(searchPatterns, segmentMemory, limit, threads);
+		}
+
+		for (size_t i = 0; i < indexes.size(); i++) {
+			auto &results = patternsResults[indexes[i]];
+			size_t resultsCnt = limit ? std::min(limit - results.size(), segmentResults[i].size()) : segmentResults[i].size();
+			results.insert(results.end(), segmentResults[i].begin(), segmentResults[i].begin() + resultsCnt);
+		}
+	}
+	return patternsResults;
+}
+
+/*
+ * Closest results of all segments, segments are in the address order and the results of each are sorted by the mismatches.
+ * */
+std::vector<Pattern::ApproxSearchResult> findApproxSegmented(const std::shared_ptr<PtrExp> &pattern, const Pattern::Memory &memory, int maxMismatches, size_t limit, int threads) {
+	std::vector<Pattern::ApproxSearchResult> results;
+	for (auto &segmentMemory: Pattern::getSegmentsMemory(memory)) {
+		auto segmentResults = Pattern::findApprox(pattern, segmentMemory, maxMismatches, limit, threads);
+		results.insert(results.end(), segmentResults.begin(), segmentResults.end());
+		if (pattern->type == PATTERN_TYPE_STATIC_VALUE)
+			break;
+	}
+
+	std::stable_sort(results.begin(), results.end(), [](const Pattern::ApproxSearchResult &a, const Pattern::ApproxSearchResult &b) {
+		return a.mismatches < b.mismatches;
+	});
+	if (limit && results.size() > limit)
+		results.resize(limit);
+	return results;
 }
@@ -7,6 +7,7 @@
 #include <cassert>
 #include <regex>
 #include <filesystem>
+#include <functional>
 #include <ptr89.h>
 #include <argparse/argparse.hpp>
 #include <nlohmann/json.hpp>
@@ -17,7 +18,73 @@ struct PatternsLibraryItem {
 	std::string pattern;
 };
 
+// Results of the previous run with its search settings
+struct PrevSearchResults {
+	size_t limit;
+	std::map<std::string, std::vector<Ptr89::Pattern::SearchResult>> patterns;
+};
+
+struct ServerOptions {
+	std::string file;
+	uint32_t base;
+	int align;
+	int threads;
+	std::string cacheDir;
+};
+
+/*
+ * JSON output without the whole document in memory, formatted like nlohmann::json::dump(2).
+ * */
+class JsonStreamWriter {
+	public:
+		explicit JsonStreamWriter(FILE *fp);
+		void beginObject();
+		void endObject();
+		void beginArray();
+		void endArray();
+		void key(const std::string &name);
+		void value(const nlohmann::json &value);
+
+		// Closes all opened arrays and objects, the error is added to the root object
+		void finishWithError(const std::string &error);
+	private:
+		struct Level {
+			bool isArray;
+			size_t count;
+		};
+
+		FILE *m_fp;
+		std::vector<Level> m_levels;
+		bool m_isAfterKey = false;
+
+		void beginValue();
+		void endLevel(char closeTag);
+		void writeIndent();
+};
+
+typedef std::function<std::vector<std::vector<Ptr89::Pattern::SearchResult>>(const std::vector<size_t> &indexes)> PatternsSearch;
+
+void runServer(const ServerOptions &options, const std::string &socketPath);
 std::string readFile(const std::string &path);
-std::pair<uint8_t *, size_t> readBinaryFile(const std::string &path);
+std::vector<std::vector<Ptr89::Pattern::SearchResult>> searchStream(const std::string &path, const std::vector<std::shared_ptr<Ptr89::PtrExp>> &patterns, const Ptr89::Pattern::Memory &memory, size_t limit);
+PrevSearchResults readPrevResults(const std::string &path, uint32_t base, int align);
+std::vector<std::vector<Ptr89::Pattern::SearchResult>> findManyIncremental(const std::vector<std::string> &patternsStr, const std::vector<std::shared_ptr<Ptr89::PtrExp>> &patterns,
+		const Ptr89::Pattern::Memory &memory, const Ptr89::Pattern::MemoryDiff &diff, const PrevSearchResults &prevResults, size_t limit, int threads);
+std::vector<std::vector<Ptr89::Pattern::SearchResult>> findManyCached(const std::vector<std::shared_ptr<Ptr89::PtrExp>> &patterns, const Ptr89::Pattern::Memory &memory, size_t limit,
+		const std::string &cacheDir, const PatternsSearch &search);
+std::vector<std::vector<Ptr89::Pattern::SearchResult>> findManySegmented(const std::vector<std::shared_ptr<Ptr89::PtrExp>> &patterns, const Ptr89::Pattern::Memory &memory, size_t limit, int threads,
+		std::vector<Ptr89::SearchStats> *patternsStats = nullptr);
+std::vector<Ptr89::Pattern::ApproxSearchResult> findApproxSegmented(const std::shared_ptr<Ptr89::PtrExp> &pattern, const Ptr89::Pattern::Memory &memory, int maxMismatches, size_t limit, int threads);
+Ptr89::Pattern::XRefIndex getXRefIndex(const Ptr89::Pattern::Memory &memory, const std::string &cacheDir, int threads);
 std::vector<PatternsLibraryItem> parsePatternsIni(const std::string &iniFile);
+std::vector<PatternsLibraryItem> parsePatternsIniText(const std::string &iniText);
+nlohmann::json searchResultToJSON(const std::shared_ptr<Ptr89::PtrExp> &pattern, const Ptr89::Pattern::SearchResult &result, const Ptr89::Pattern::FunctionIndex *functions = nullptr);
+nlohmann::json searchResultsToJSON(const std::shared_ptr<Ptr89::PtrExp> &pattern, const std::vector<Ptr89::Pattern::SearchResult> &results, const Ptr89::Pattern::FunctionIndex *functions = nullptr);
+nlohmann::json searchStatsToJSON(const std::vector<std::string> &names, const std::vector<Ptr89::SearchStats> &patternsStats);
+void printSearchStats(const std::vector<std::string> &names, const std::vector<Ptr89::SearchStats> &patternsStats);
+nlohmann::json xrefResultToJSON(const Ptr89::Pattern::XRefSearchResult &result, const Ptr89::Pattern::FunctionIndex *functions = nullptr);
+nlohmann::json xrefResultsToJSON(const std::vector<Ptr89::Pattern::XRefSearchResult> &results, const Ptr89::Pattern::FunctionIndex *functions = nullptr);
+void printSearchResult(const std::shared_ptr<Ptr89::PtrExp> &pattern, const Ptr89::Pattern::SearchResult &result, const Ptr89::Pattern::FunctionIndex *functions = nullptr, int mismatches = -1);
+void printXRefResult(const Ptr89::Pattern::XRefSearchResult &result, const Ptr89::Pattern::FunctionIndex *functions = nullptr);
+std::string functionToString(const Ptr89::Pattern::FunctionIndex *functions, uint32_t addr);
 std::string trim(std::string s);
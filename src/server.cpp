@@ -0,0 +1,368 @@
+#include "main.h"
+#include "src/Pattern.h"
+#include "src/utils.h"
+#include <cinttypes>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using json = nlohmann::json;
+using namespace Ptr89;
+
+/*
+ * Firmware loaded once and reused by all requests.
+ * Everything derived from the dump lives here and is dropped when the file is changed on disk.
+ * */
+struct ServerImage {
+	std::shared_ptr<MappedFile> file;
+	std::filesystem::file_time_type mtime;
+	std::shared_ptr<const Pattern::ByteHistogram> histogram;
+	std::map<uint32_t, Pattern::XRefIndex> xrefIndexes;
+	std::map<uint32_t, std::shared_ptr<const Pattern::ThunkMap>> thunkMaps; // veneers addresses depend on the base
+	std::unordered_map<std::string, json> results;
+};
+
+class Server {
+	public:
+		explicit Server(const ServerOptions &options) : m_options(options) { }
+
+		void preload(const std::string &path);
+		void serveStream(FILE *in, FILE *out);
+		void serveSocket(const std::string &path);
+	private:
+		static constexpr size_t MAX_CACHED_RESULTS = 64 * 1024;
+
+		ServerOptions m_options;
+		std::mutex m_mutex;
+		std::map<std::string, std::shared_ptr<ServerImage>> m_images;
+		std::unordered_map<std::string, std::shared_ptr<PtrExp>> m_patterns;
+
+		json handleRequest(const json &request);
+		json handleFind(const json &request);
+		json handleXRefs(const json &request);
+		json handleIni(const json &request);
+		json handleLoad(const json &request);
+
+		std::shared_ptr<ServerImage> getImage(const std::string &path);
+		std::pair<std::shared_ptr<ServerImage>, Pattern::Memory> getMemory(const json &request);
+		std::shared_ptr<PtrExp> getPattern(const std::string &patternStr);
+		void cacheResults(ServerImage &image, const std::string &key, const json &results);
+};
+
+static bool readLine(FILE *fp, std::string &line) {
+	char buff[4096];
+	line.clear();
+	while (fgets(buff, sizeof(buff), fp)) {
+		line += buff;
+		if (line.back() == '\n')
+			return true;
+	}
+	return !line.empty();
+}
+
+static int64_t getCurrentTimeMs() {
+	return duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::shared_ptr<ServerImage> Server::getImage(const std::string &path) {
+	if (path.empty())
+		throw std::runtime_error("Fullflash file is not specified.");
+
+	auto mtime = std::filesystem::last_write_time(path);
+	auto it = m_images.find(path);
+	if (it != m_images.end() && it->second->mtime == mtime)
+		return it->second;
+
+	auto image = std::make_shared<ServerImage>();
+	image->file = MappedFile::open(path, MAPPED_FILE_ACCESS_SEQUENTIAL);
+	image->mtime = mtime;
+	image->histogram = Pattern::createHistogram({ 0, image->file->data(), image->file->size() });
+	m_images[path] = image;
+	return image;
+}
+
+std::pair<std::shared_ptr<ServerImage>, Pattern::Memory> Server::getMemory(const json &request) {
+	auto image = getImage(request.value("file", m_options.file));
+
+	uint32_t base = m_options.base;
+	if (request.contains("base"))
+		base = stoll(request["base"].get<std::string>(), NULL, 16);
+
+	int align = request.value("align", m_options.align);
+	if (align <= 0)
+		throw std::runtime_error("Invalid align value.");
+
+	Pattern::Memory memory = { base, image->file->data(), image->file->size(), align, image->histogram };
+	auto it = image->thunkMaps.find(base);
+	if (it == image->thunkMaps.end())
+		it = image->thunkMaps.emplace(base, Pattern::ThunkMap::build(memory)).first;
+	memory.thunks = it->second;
+
+	return { image, memory };
+}
+
+std::shared_ptr<PtrExp> Server::getPattern(const std::string &patternStr) {
+	auto it = m_patterns.find(patternStr);
+	if (it != m_patterns.end())
+		return it->second;
+
+	if (m_patterns.size() >= MAX_CACHED_RESULTS)
+		m_patterns.clear();
+
+	auto pattern = Pattern::parse(patternStr);
+	m_patterns[patternStr] = pattern;
+	return pattern;
+}
+
+void Server::cacheResults(ServerImage &image, const std::string &key, const json &results) {
+	if (image.results.size() >= MAX_CACHED_RESULTS)
+		image.results.clear();
+	image.results[key] = results;
+}
+
+json Server::handleFind(const json &request) {
+	auto [image, memory] = getMemory(request);
+	size_t limit = request.value("limit", 100);
+
+	std::vector<std::string> patterns;
+	if (request.contains("pattern"))
+		patterns.push_back(request["pattern"].get<std::string>());
+	if (request.contains("patterns"))
+		patterns = request["patterns"].get<std::vector<std::string>>();
+
+	json response;
+	response["patterns"] = json::array();
+	for (auto &patternStr: patterns) {
+		auto key = strprintf("find:%08X:%d:%zu:%s", memory.base, memory.align, limit, patternStr.c_str());
+		auto it = image->results.find(key);
+		if (it == image->results.end()) {
+			auto pattern = getPattern(patternStr);
+			cacheResults(*image, key, searchResultsToJSON(pattern, Pattern::find(pattern, memory, limit, m_options.threads)));
+			it = image->results.find(key);
+		}
+
+		json patternJson;
+		patternJson["pattern"] = patternStr;
+		patternJson["results"] = it->second;
+		response["patterns"].push_back(patternJson);
+	}
+	return response;
+}
+
+json Server::handleXRefs(const json &request) {
+	auto [image, memory] = getMemory(request);
+	size_t limit = request.value("limit", 100);
+
+	std::vector<uint32_t> addresses;
+	if (request.contains("address"))
+		addresses.push_back(stoll(request["address"].get<std::string>(), NULL, 16));
+	if (request.contains("addresses")) {
+		for (auto &addrStr: request["addresses"].get<std::vector<std::string>>())
+			addresses.push_back(stoll(addrStr, NULL, 16));
+	}
+
+	// The index doesn't depend on the search align
+	auto it = image->xrefIndexes.find(memory.base);
+	if (it == image->xrefIndexes.end())
+		it = image->xrefIndexes.emplace(memory.base, getXRefIndex(memory, m_options.cacheDir, m_options.threads)).first;
+
+	json response;
+	if (addresses.size() == 1) {
+		response["results"] = xrefResultsToJSON(it->second.find(addresses[0], limit));
+	} else {
+		response["xrefs"] = json::array();
+		for (auto addr: addresses) {
+			json xrefJson;
+			xrefJson["address"] = addr;
+			xrefJson["results"] = xrefResultsToJSON(it->second.find(addr, limit));
+			response["xrefs"].push_back(xrefJson);
+		}
+	}
+	return response;
+}
+
+json Server::handleIni(const json &request) {
+	auto [image, memory] = getMemory(request);
+
+	std::string iniText;
+	if (request.contains("text")) {
+		iniText = request["text"].get<std::string>();
+	} else {
+		iniText = readFile(request.at("path").get<std::string>());
+	}
+
+	auto key = strprintf("ini:%08X:%d:", memory.base, memory.align) + iniText;
+	auto it = image->results.find(key);
+	if (it == image->results.end()) {
+		auto patternsLib = parsePatternsIniText(iniText);
+
+		std::vector<std::shared_ptr<PtrExp>> patterns;
+		for (auto &entry: patternsLib)
+			patterns.push_back(getPattern(entry.pattern));
+
+		auto patternsResults = Pattern::findMany(patterns, memory, 1, m_options.threads);
+
+		json patternsJson = json::array();
+		for (size_t i = 0; i < patternsLib.size(); i++) {
+			json patternJson;
+			patternJson["pattern"] = patternsLib[i].pattern;
+			patternJson["id"] = patternsLib[i].id;
+			patternJson["function"] = patternsLib[i].funcName;
+			patternJson["results"] = searchResultsToJSON(patterns[i], patternsResults[i]);
+			patternsJson.push_back(patternJson);
+		}
+		cacheResults(*image, key, patternsJson);
+		it = image->results.find(key);
+	}
+
+	json response;
+	response["patterns"] = it->second;
+	return response;
+}
+
+json Server::handleLoad(const json &request) {
+	auto [image, memory] = getMemory(request);
+	json response;
+	response["file"] = request.value("file", m_options.file);
+	response["size"] = memory.size;
+	return response;
+}
+
+void Server::preload(const std::string &path) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	getImage(path);
+}
+
+json Server::handleRequest(const json &request) {
+	json response;
+	if (request.contains("id"))
+		response["id"] = request["id"];
+
+	try {
+		auto start = getCurrentTimeMs();
+		auto cmd = request.at("cmd").get<std::string>();
+		if (cmd == "find") {
+			response.update(handleFind(request));
+		} else if (cmd == "xrefs") {
+			response.update(handleXRefs(request));
+		} else if (cmd == "ini") {
+			response.update(handleIni(request));
+		} else if (cmd == "prettify") {
+			response["pattern"] = Pattern::stringify(getPattern(request.at("pattern").get<std::string>()));
+		} else if (cmd == "load") {
+			response.update(handleLoad(request));
+		} else {
+			throw std::runtime_error("Unknown command: " + cmd);
+		}
+		response["elapsed"] = getCurrentTimeMs() - start;
+	} catch (const std::exception &err) {
+		response["error"] = err.what();
+	}
+
+	return response;
+}
+
+void Server::serveStream(FILE *in, FILE *out) {
+	std::string line;
+	while (readLine(in, line)) {
+		std::string requestStr = trim(line);
+		if (requestStr.empty())
+			continue;
+
+		json response;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			try {
+				response = handleRequest(json::parse(requestStr));
+			} catch (const std::exception &err) {
+				response["error"] = err.what();
+			}
+		}
+
+		auto responseStr = response.dump() + "\n";
+		if (fwrite(responseStr.c_str(), 1, responseStr.size(), out) != responseStr.size() || fflush(out) != 0)
+			break;
+	}
+}
+
+void Server::serveSocket(const std::string &path) {
+	#if !defined(_WIN32)
+	// Client can disconnect before reading the response
+	signal(SIGPIPE, SIG_IGN);
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("Socket path is too long: " + path);
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	// Stale socket from the previous run, other files are never removed
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			throw std::runtime_error("Not a socket: " + path);
+		unlink(path.c_str());
+	}
+
+	int serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (serverFd < 0)
+		throw std::runtime_error(std::string("socket() error: ") + strerror(errno));
+
+	if (bind(serverFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(serverFd, 16) != 0) {
+		close(serverFd);
+		throw std::runtime_error("bind(" + path + ") error: " + strerror(errno));
+	}
+
+	while (true) {
+		int clientFd = accept(serverFd, nullptr, nullptr);
+		if (clientFd < 0) {
+			if (errno == EINTR)
+				continue;
+			close(serverFd);
+			throw std::runtime_error(std::string("accept() error: ") + strerror(errno));
+		}
+
+		std::thread([this, clientFd]() {
+			// Raw fd is owned by the stream only when fdopen() succeeds
+			FILE *in = fdopen(clientFd, "r");
+			if (!in) {
+				close(clientFd);
+				return;
+			}
+			int outFd = dup(clientFd);
+			FILE *out = outFd >= 0 ? fdopen(outFd, "w") : nullptr;
+			if (out) {
+				serveStream(in, out);
+				fclose(out);
+			} else if (outFd >= 0) {
+				close(outFd);
+			}
+			fclose(in);
+		}).detach();
+	}
+	#else
+	throw std::runtime_error("Unix sockets are not supported on this platform.");
+	#endif
+}
+
+void runServer(const ServerOptions &options, const std::string &socketPath) {
+	Server server(options);
+
+	// Fail early on the wrong default file
+	if (!options.file.empty())
+		server.preload(options.file);
+
+	if (socketPath.empty()) {
+		server.serveStream(stdin, stdout);
+	} else {
+		server.serveSocket(socketPath);
+	}
+}
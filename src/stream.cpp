@@ -0,0 +1,93 @@
+#include "main.h"
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace Ptr89;
+
+static constexpr size_t STREAM_BLOCK_SIZE = 1024 * 1024;
+static constexpr size_t STREAM_MAX_QUEUED_BLOCKS = 4;
+
+/*
+ * Dump is read by the separate thread, so the search in one block overlaps with the reading of the next ones.
+ * Memory usage is bounded by the queued blocks and the search window.
+ * */
+std::vector<std::vector<Pattern::SearchResult>> searchStream(const std::string &path, const std::vector<std::shared_ptr<PtrExp>> &patterns, const Pattern::Memory &memory, size_t limit) {
+	FILE *fp = (path == "-" ? stdin : fopen(path.c_str(), "rb"));
+	if (!fp)
+		throw std::runtime_error("fopen(" + path + ") error: " + strerror(errno));
+
+	Pattern::StreamSearch search(patterns, memory.base, memory.align, limit);
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::vector<uint8_t>> blocks;
+	bool isEof = false;
+	bool isStopped = false;
+	std::string readError;
+
+	std::thread reader([&]() {
+		while (true) {
+			std::vector<uint8_t> block(STREAM_BLOCK_SIZE);
+			size_t readed = fread(block.data(), 1, block.size(), fp);
+			block.resize(readed);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			if (readed > 0)
+				blocks.push_back(std::move(block));
+
+			// fread() returns less only at the end of the stream or on error
+			if (readed < STREAM_BLOCK_SIZE) {
+				if (ferror(fp))
+					readError = strerror(errno);
+				isEof = true;
+				cv.notify_all();
+				return;
+			}
+
+			cv.notify_all();
+			cv.wait(lock, [&]() { return blocks.size() < STREAM_MAX_QUEUED_BLOCKS || isStopped; });
+			if (isStopped)
+				return;
+		}
+	});
+
+	auto stopReader = [&]() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isStopped = true;
+			cv.notify_all();
+		}
+		reader.join();
+		if (fp != stdin)
+			fclose(fp);
+	};
+
+	try {
+		while (!search.isDone()) {
+			std::vector<uint8_t> block;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&]() { return !blocks.empty() || isEof; });
+				if (blocks.empty())
+					break;
+				block = std::move(blocks.front());
+				blocks.pop_front();
+				cv.notify_all();
+			}
+			search.feed(block.data(), block.size());
+		}
+	} catch (...) {
+		stopReader();
+		throw;
+	}
+
+	stopReader();
+
+	if (!readError.empty())
+		throw std::runtime_error("fread(" + path + ") error: " + readError);
+
+	return search.finish();
+}
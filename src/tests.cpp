@@ -1,7 +1,12 @@
 #include <cstdint>
 #include <ptr89.h>
+#include <src/ThreadPool.h>
+#include <atomic>
 #include <cassert>
 #include <cstdio>
+#include <filesystem>
+#include <stdexcept>
+#include <vector>
 
 using namespace Ptr89;
 
@@ -73,11 +78,788 @@ static void testArmDecoder() {
 	assert(Pattern::decodeArmLDR(0xA0000100, I({ 0x00, 0xF1, 0x1F, 0xE5 })) == std::tuple(true, 0xA0000008, true));
 }
 
+static void testDecodeAtEnd() {
+	// THUMB BL split by the end of the memory, the second half is outside of it
+	std::vector<uint8_t> firmware(0x1004);
+	firmware[0x1000] = 0xFE;
+	firmware[0x1001] = 0xF7;
+	firmware[0x1002] = 0xFE;
+	firmware[0x1003] = 0xFF;
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], 0x1002, 1 };
+	assert(Pattern::find(Pattern::parse("&BL( FE F7 )"), memory).empty());
+	assert(Pattern::decodeBranchReference<NoTrace>(0x1000, memory) == std::make_pair(false, 0U));
+	assert(Pattern::decodeReference<NoTrace>(0x1000, memory) == std::make_pair(false, 0U));
 
+	memory.size = firmware.size();
+	assert(Pattern::find(Pattern::parse("&BL( FE F7 )"), memory).size() == 1);
+}
+
+static std::vector<uint8_t> createTestFirmware(size_t size) {
+	std::vector<uint8_t> firmware(size);
+	uint32_t seed = 0x89;
+	for (size_t i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		firmware[i] = (seed >> 16) & 0x0F;
+	}
+	// Overlapping matches for the skip-after-match logic
+	for (size_t i = 0x1000; i < size; i += 0x7FF1) {
+		for (int j = 0; j < 12; j++)
+			firmware[i + j] = 0xAA;
+	}
+	return firmware;
+}
+
+static bool isEqualResults(const std::vector<Pattern::SearchResult> &a, const std::vector<Pattern::SearchResult> &b) {
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].address != b[i].address || a[i].offset != b[i].offset || a[i].value != b[i].value)
+			return false;
+	}
+	return true;
+}
+
+static void testParallelSearch() {
+	auto firmware = createTestFirmware(4 * 1024 * 1024);
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+
+	const char *patterns[] = { "AA AA AA AA", "?? AA AA AA AA", "AA AA ?? AA", "0? 0? 01 02", "AA", "?? 0A 0B" };
+	for (auto patternStr: patterns) {
+		auto pattern = Pattern::parse(patternStr);
+		for (size_t limit: { 0, 1, 3, 100 }) {
+			for (int align: { 1, 2, 4 }) {
+				memory.align = align;
+				auto expected = Pattern::find(pattern, memory, limit, 1);
+				assert(isEqualResults(Pattern::find(pattern, memory, limit, 3), expected));
+				assert(isEqualResults(Pattern::find(pattern, memory, limit, 8), expected));
+			}
+		}
+	}
+}
+
+static void testMultiPatternSearch() {
+	auto firmware = createTestFirmware(1024 * 1024);
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+
+	std::vector<std::shared_ptr<PtrExp>> patterns;
+	for (auto patternStr: { "AA AA AA AA", "?? AA AA AA AA", "0? 01 02 03 04 0?", "01 02 03 04", "AA ?? AA", "< A8000000 >", "", "01 02 03 04 { ?? 0? }" })
+		patterns.push_back(Pattern::parse(patternStr));
+
+	// Chunks of the pass are merged by the same rules as the sequential search
+	for (int threads: { 1, 4 }) {
+		for (size_t limit: { 0, 1, 2, 5 }) {
+			for (int align: { 1, 2 }) {
+				memory.align = align;
+				auto results = Pattern::findMany(patterns, memory, limit, threads);
+				assert(results.size() == patterns.size());
+				for (size_t i = 0; i < patterns.size(); i++)
+					assert(isEqualResults(results[i], Pattern::find(patterns[i], memory, limit)));
+			}
+		}
+	}
+}
+
+static void testThreadPool() {
+	for (int threads: { 1, 3, 8 }) {
+		for (size_t tasksCnt: { 0, 1, 2, 100 }) {
+			std::vector<std::atomic<int>> executed(tasksCnt);
+			std::vector<size_t> order;
+			ThreadPool pool(threads);
+			pool.run(tasksCnt, [&](size_t taskIndex) {
+				executed[taskIndex]++;
+				if (threads == 1)
+					order.push_back(taskIndex);
+			});
+			for (auto &count: executed)
+				assert(count == 1);
+			for (size_t i = 0; i < order.size(); i++)
+				assert(order[i] == i);
+		}
+	}
+
+	// Workers are reused by the next runs, the task exception stops the run and is rethrown
+	for (int threads: { 1, 4 }) {
+		ThreadPool pool(threads);
+		for (size_t run = 0; run < 50; run++) {
+			size_t tasksCnt = run % 7;
+			std::vector<std::atomic<int>> executed(tasksCnt);
+			pool.run(tasksCnt, [&](size_t taskIndex) {
+				executed[taskIndex]++;
+			});
+			for (auto &count: executed)
+				assert(count == 1);
+
+			bool isThrown = false;
+			try {
+				pool.run(100, [&](size_t taskIndex) {
+					if (taskIndex == run)
+						throw std::runtime_error("task error");
+				});
+			} catch (const std::runtime_error &) {
+				isThrown = true;
+			}
+			assert(isThrown);
+		}
+	}
+	assert(ThreadPool::resolveThreads(3) == 3);
+	assert(ThreadPool::resolveThreads(0) >= 1);
+}
+
+static std::vector<Pattern::SearchResult> findNaive(const std::shared_ptr<PtrExp> &pattern, const Pattern::Memory &memory, size_t limit) {
+	std::vector<Pattern::SearchResult> results;
+	size_t patternSize = pattern->bytes.size();
+	for (size_t offset = 0; offset + patternSize <= memory.size; offset += memory.align) {
+		bool found = true;
+		for (size_t i = 0; i < patternSize && found; i++)
+			found = (memory.data[offset + i] & pattern->masks[i]) == (pattern->bytes[i] & pattern->masks[i]);
+		if (!found)
+			continue;
+
+		uint32_t address = memory.base + offset;
+		results.push_back({ address, static_cast<uint32_t>(offset), address });
+		if (limit && results.size() >= limit)
+			break;
+
+		// Leading wildcards are not skipped with align=1
+		size_t skip = patternSize;
+		for (size_t i = 0; i < patternSize && memory.align == 1 && pattern->masks[i] == 0; i++)
+			skip--;
+
+		offset += skip;
+		offset += (memory.align - (offset % memory.align)) % memory.align;
+		offset -= memory.align;
+	}
+	return results;
+}
+
+static void testScanKernels() {
+	auto firmware = createTestFirmware(1024 * 1024);
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+
+	for (auto kernel: { SCAN_KERNEL_DISABLED, SCAN_KERNEL_SCALAR, SCAN_KERNEL_SSE2, SCAN_KERNEL_AVX2 }) {
+		if (!Scanner::setKernel(kernel))
+			continue;
+
+		for (auto patternStr: { "AA AA AA AA", "?? AA AA AA AA", "0? 01 02 03 04 0?", "01 ?? 03", "0A", "AA [0000....] AA", "?? ?? ?1", "1? ?2", "[1111....] ?? 0? ??", "?A" }) {
+			auto pattern = Pattern::parse(patternStr);
+			for (int align: { 1, 2, 4 }) {
+				memory.align = align;
+				assert(isEqualResults(Pattern::find(pattern, memory, 0), findNaive(pattern, memory, 0)));
+				assert(isEqualResults(Pattern::find(pattern, memory, 7), findNaive(pattern, memory, 7)));
+			}
+		}
+	}
+	Scanner::setKernel(SCAN_KERNEL_AUTO);
+}
+
+static void testMaskedMatcher() {
+	uint32_t seed = 0x89;
+	auto random = [&seed]() {
+		seed = seed * 1103515245 + 12345;
+		return seed >> 8;
+	};
+
+	// Memory is exactly as long as the pattern, the overlapped blocks must not read past it
+	for (size_t size = 1; size <= 40; size++) {
+		for (int iteration = 0; iteration < 200; iteration++) {
+			static const uint8_t maskTypes[] = { 0xFF, 0xFF, 0x00, 0xF0, 0x0F, 0xA5 };
+			std::vector<uint8_t> bytes(size), masks(size), memory(size);
+			for (size_t i = 0; i < size; i++) {
+				bytes[i] = random();
+				masks[i] = maskTypes[random() % std::size(maskTypes)];
+				memory[i] = (random() % 8) ? (bytes[i] & masks[i]) | (random() & ~masks[i]) : random();
+			}
+
+			bool expected = true;
+			for (size_t i = 0; i < size; i++)
+				expected = expected && (memory[i] & masks[i]) == (bytes[i] & masks[i]);
+			assert(MaskedMatcher(bytes.data(), masks.data(), size).match(memory.data()) == expected);
+
+			bool isShiftAndMatched = false;
+			ShiftAndMatcher(bytes.data(), masks.data(), size).scan(memory.data(), 0, 1, [&](size_t offset) {
+				isShiftAndMatched = offset == 0;
+				return true;
+			});
+			assert(isShiftAndMatched == expected);
+		}
+	}
+	assert(MaskedMatcher().match(nullptr));
+}
+
+static void testParser() {
+	std::vector<std::string> patternsStr = { "AA ?? 1? ?2 [1.0.....] + 4", "*(01 02 { ?? 0? } 03 - 8) - 2", "&(LDR[ 01 02 ] 03) + 1", "&BL(01 [ 02 ] 03)", "01 _BLF(02 { 03 }) 04", "<0xA0001234>", "" };
+	auto patterns = Pattern::parseMany(patternsStr);
+	assert(patterns.size() == patternsStr.size());
+	for (size_t i = 0; i < patterns.size(); i++)
+		assert(Pattern::stringify(patterns[i]) == Pattern::stringify(Pattern::parse(patternsStr[i])));
+
+	// Sub-patterns keep the shared arena alive
+	auto subPattern = patterns[1]->subPatterns.at(2).pattern;
+	patterns.clear();
+	assert(Pattern::stringify(subPattern) == "?? 0?");
+
+	// Input is not copied, tokens at the end of the input must not be read past it
+	std::string text = "01 02 ?";
+	assert(Pattern::parse(std::string_view(text).substr(0, 5))->bytes.size() == 2);
+
+	for (auto patternStr: { "01 02 +", "01 ?2 + ?4", "01 + FFFFFFFFFF", "<1 2>", "01 {02", "01 _bl" }) {
+		bool isFailed = false;
+		try {
+			Pattern::parse(patternStr);
+		} catch (const PatternError &) {
+			isFailed = true;
+		}
+		assert(isFailed);
+	}
+}
+
+static void testCompiledPattern() {
+	// Full bytes range with real branches and references into the same memory
+	std::vector<uint8_t> firmware(64 * 1024);
+	uint32_t seed = 0x89;
+	auto random = [&seed]() {
+		seed = seed * 1103515245 + 12345;
+		return seed >> 8;
+	};
+	for (auto &byte: firmware)
+		byte = random();
+
+	auto put32 = [&firmware](size_t offset, uint32_t value) {
+		for (int i = 0; i < 4; i++)
+			firmware[offset + i] = value >> (i * 8);
+	};
+	for (size_t i = 0; i + 64 <= firmware.size(); i += 64) {
+		uint32_t branchOffset = (random() % firmware.size() & ~1) - (i + 4);
+		uint32_t hi = (branchOffset >> 12) & 0x7FF;
+		uint32_t lo = (branchOffset >> 1) & 0x7FF;
+		put32(i, (hi | 0xF000) | ((lo | 0xF800) << 16));	// THUMB BL
+		put32(i + 8, 0x4802 | (random() & 0x700));			// THUMB LDR Rd, [PC, #8]
+		put32(i + 20, 0xA0000000 + random() % firmware.size());
+		put32(i + 24, 0xE59F0008);							// ARM LDR R0, [PC, #8]
+		put32(i + 40, 0xA0000000 + random() % firmware.size());
+	}
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+
+	const char *patterns[] = {
+		"{ ?? 0? } ??",
+		"[ 1? ] ?? ??",
+		"LDR{ ?? ?? } [ ?? ]",
+		"?? LDR[ 0? ?? ]",
+		"{ [ ?? ] ?? } ??",
+		"*(LDR{ [0.......] ?? } + 2) + 1",
+		"< A8000000 >",
+	};
+	for (auto patternStr: patterns) {
+		auto pattern = Pattern::parse(patternStr);
+		auto program = Pattern::compile(pattern);
+		PtrProgramMemo memo;
+		size_t matches = 0;
+		for (size_t offset = 0; offset < firmware.size(); offset++) {
+			bool isMatched = Pattern::checkPattern(pattern, offset, memory);
+			assert(Pattern::checkPattern(*program, offset, memory) == isMatched);
+			assert(Pattern::checkPattern(*program, offset, memory, &memo) == isMatched);
+			matches += isMatched;
+		}
+		assert(matches > 0);
+	}
+}
+
+static bool isEqualXRefs(const std::vector<Pattern::XRefSearchResult> &a, const std::vector<Pattern::XRefSearchResult> &b) {
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].type != b[i].type || a[i].address != b[i].address || a[i].offset != b[i].offset)
+			return false;
+	}
+	return true;
+}
+
+static void testXRefIndex() {
+	auto firmware = createTestFirmware(256 * 1024);
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+
+	auto put = [&firmware](size_t offset, const std::vector<uint8_t> &bytes) {
+		for (size_t i = 0; i < bytes.size(); i++)
+			firmware[offset + i] = bytes[i];
+	};
+
+	put(0x1000, { 0xFE, 0xF7, 0xFE, 0xFF });		// THUMB BL #0xA0000000
+	put(0x2000, { 0xFE, 0xFB, 0xFF, 0xFA });		// ARM BLX #0xA0001000
+	put(0x3000, { 0x00, 0x00, 0x9F, 0xE5 });		// ARM LDR R0, [PC, #0] ; 0xA0003008
+	put(0x3008, { 0x00, 0x00, 0x00, 0xA0 });
+	put(0x4000, { 0x00, 0x00, 0x00, 0xA0 });
+	put(0x4006, { 0x01, 0x00, 0x00, 0xA0 });
+
+	auto index = Pattern::XRefIndex::build(memory, 3);
+	for (uint32_t addr: std::vector<uint32_t> { 0xA0000000, 0xA0000001, 0xA0001008, 0x0F0F0F0F, 0x00000000, 0x0A0B0C0E }) {
+		for (size_t limit: { 0, 1, 2 })
+			assert(isEqualXRefs(index.find(addr, limit), Pattern::finXRefs(addr, memory, limit)));
+	}
+	assert(index.find(0xA0000000).size() == 5);
+
+	// Cache file
+	auto path = (std::filesystem::temp_directory_path() / "ptr89-tests.xrefs").string();
+	uint64_t memoryHash = Pattern::hashMemory(memory);
+	index.save(path, memoryHash);
+
+	auto [isLoaded, loadedIndex] = Pattern::XRefIndex::load(path, memory, memoryHash);
+	assert(isLoaded && loadedIndex.size() == index.size());
+	for (uint32_t addr: std::vector<uint32_t> { 0xA0000000, 0xA0001008, 0xA0003008 })
+		assert(isEqualXRefs(loadedIndex.find(addr), Pattern::finXRefs(addr, memory)));
+
+	assert(!Pattern::XRefIndex::load(path, memory, memoryHash + 1).first);
+	Pattern::Memory rebasedMemory = { 0xA8000000, &firmware[0], firmware.size(), 1 };
+	assert(!Pattern::XRefIndex::load(path, rebasedMemory, memoryHash).first);
+	assert(!Pattern::XRefIndex::load(path + ".missing", memory, memoryHash).first);
+
+	// Valid header with the broken body
+	auto writeAt = [&path](long position, uint64_t value, size_t size) {
+		FILE *fp = fopen(path.c_str(), "r+b");
+		assert(fp && fseek(fp, position, position < 0 ? SEEK_END : SEEK_SET) == 0 && fwrite(&value, size, 1, fp) == 1);
+		fclose(fp);
+	};
+	index.save(path, memoryHash);
+	writeAt(-4, 0xFFFFFFF0, 4);
+	assert(!Pattern::XRefIndex::load(path, memory, memoryHash).first);
+	index.save(path, memoryHash);
+	writeAt(40, 0x2000000000000000ULL, 8);		// referencesCnt, the expected size overflows to the real one
+	assert(!Pattern::XRefIndex::load(path, memory, memoryHash).first);
+	std::filesystem::remove(path);
+}
+
+static void testSearchCallback() {
+	auto firmware = createTestFirmware(4 * 1024 * 1024 + 123);
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+
+	auto findAll = [&memory](const std::shared_ptr<PtrExp> &pattern, size_t limit, int threads) {
+		std::vector<Pattern::SearchResult> results;
+		Pattern::find(pattern, memory, [&](const Pattern::SearchResult &result) {
+			results.push_back(result);
+			return !limit || results.size() < limit;
+		}, threads);
+		return results;
+	};
+
+	const char *patterns[] = { "AA AA AA AA", "AA AA ?? AA", "?? 0A 0B", "0x12345678" };
+	for (auto patternStr: patterns) {
+		auto pattern = Pattern::parse(patternStr);
+		for (size_t limit: { 0, 1, 3 }) {
+			for (int align: { 1, 2 }) {
+				memory.align = align;
+				auto expected = Pattern::find(pattern, memory, limit, 1);
+				assert(isEqualResults(findAll(pattern, limit, 1), expected));
+				assert(isEqualResults(findAll(pattern, limit, 3), expected));
+			}
+		}
+	}
+	memory.align = 1;
+
+	for (uint32_t addr: std::vector<uint32_t> { 0x0F0F0F0F, 0x0A0B0C0E }) {
+		for (size_t limit: { 0, 2 }) {
+			std::vector<Pattern::XRefSearchResult> results;
+			Pattern::finXRefs(addr, memory, [&](const Pattern::XRefSearchResult &result) {
+				results.push_back(result);
+				return !limit || results.size() < limit;
+			});
+			assert(isEqualXRefs(results, Pattern::finXRefs(addr, memory, limit)));
+		}
+	}
+}
+
+static void testThunkMap() {
+	std::vector<uint8_t> firmware(256);
+	auto put32 = [&firmware](size_t offset, uint32_t value) {
+		for (int i = 0; i < 4; i++)
+			firmware[offset + i] = value >> (i * 8);
+	};
+	put32(0x00, 0xE59FF018);	// LDR PC, [PC, #0x18] -> A0000040
+	put32(0x20, 0xA0000040);
+	put32(0x40, 0xE59FF018);	// LDR PC, [PC, #0x18] -> A0000081
+	put32(0x60, 0xA0000081);
+	put32(0x80, 0xE59FF010);	// LDR PC, [PC, #0x10] -> A00000A0
+	put32(0x98, 0xA00000A0);
+	put32(0xA0, 0xE59FF010);	// LDR PC, [PC, #0x10] -> A0000080
+	put32(0xB8, 0xA0000080);
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+
+	auto thunks = Pattern::ThunkMap::build(memory);
+	assert(thunks->size() == 2);
+
+	// Chain, cycle and not a veneer
+	const std::pair<uint32_t, uint32_t> expected[] = {
+		{ 0xA0000000, 0xA0000081 },
+		{ 0xA0000040, 0xA0000081 },
+		{ 0xA0000080, 0xA0000080 },
+		{ 0xA00000A0, 0xA00000A0 },
+		{ 0xA00000C0, 0xA00000C0 },
+		{ 0x90000000, 0x90000000 },
+	};
+	for (auto [addr, target]: expected) {
+		assert(thunks->resolve(addr) == target);
+		assert(Pattern::resolveThunks<NoTrace>(addr, memory) == target);
+		assert(Pattern::resolveThunks(addr, memory) == target);
+	}
+
+	Pattern::Memory thunksMemory = memory;
+	thunksMemory.thunks = thunks;
+	assert(Pattern::resolveThunks<NoTrace>(0xA0000000, thunksMemory) == 0xA0000081);
+}
+
+static void testStreamSearch() {
+	auto firmware = createTestFirmware(256 * 1024);
+
+	std::vector<std::shared_ptr<PtrExp>> patterns;
+	for (auto patternStr: { "AA AA AA AA", "?? AA AA AA AA", "0? 01 02 03 04 0?", "AA ?? AA", "*(0? 01 0? ?? + 6) + 1", "*(01 0? 0? - 8)", "< A8000000 >", "" })
+		patterns.push_back(Pattern::parse(patternStr));
+	for (auto &pattern: patterns)
+		assert(Pattern::StreamSearch::isStreamable(pattern));
+	assert(!Pattern::StreamSearch::isStreamable(Pattern::parse("01 02 { ?? ?? }")));
+	assert(!Pattern::StreamSearch::isStreamable(Pattern::parse("&(01 02 03 04)")));
+
+	// Windows and parts much smaller than the memory
+	for (size_t limit: { 0, 1, 5 }) {
+		for (int align: { 1, 2 }) {
+			Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), align };
+			Pattern::StreamSearch search(patterns, memory.base, align, limit, 4096);
+			for (size_t offset = 0, partSize = 1; offset < firmware.size(); offset += partSize, partSize = partSize * 3 % 10007) {
+				partSize = std::min(partSize, firmware.size() - offset);
+				search.feed(&firmware[offset], partSize);
+			}
+			auto results = search.finish();
+			for (size_t i = 0; i < patterns.size(); i++)
+				assert(isEqualResults(results[i], Pattern::find(patterns[i], memory, limit)));
+		}
+	}
+}
+
+static void testIncrementalSearch() {
+	auto prevFirmware = createTestFirmware(256 * 1024);
+	Pattern::Memory prevMemory = { 0xA0000000, &prevFirmware[0], prevFirmware.size(), 1 };
+
+	auto sameDiff = Pattern::MemoryDiff::build(prevMemory, prevMemory);
+	assert(sameDiff.getSegments().size() == 1 && sameDiff.getIdenticalSize() == prevFirmware.size());
+
+	// Inserted, removed, changed and moved bytes
+	auto firmware = prevFirmware;
+	firmware.insert(firmware.begin() + 0x9000, { 0xAA, 0xAA, 0xAA, 0xAA, 0x01, 0x02, 0x03 });
+	firmware.erase(firmware.begin() + 0x20000, firmware.begin() + 0x20100);
+	for (size_t i = 0x30000; i < 0x30010; i++)
+		firmware[i] = 0xAA;
+	std::copy(prevFirmware.begin() + 0x1000, prevFirmware.begin() + 0x1020, firmware.begin() + 0x80);
+
+	std::vector<std::shared_ptr<PtrExp>> patterns;
+	for (auto patternStr: { "AA AA AA AA", "?? AA AA AA AA", "0? 01 02 03 04 0?", "AA ?? AA", "*(0? 01 0? ?? + 6) + 1", "*(01 0? 0? - 8)", "01 02 { ?? 0? }" })
+		patterns.push_back(Pattern::parse(patternStr));
+
+	for (size_t limit: { 0, 1, 5 }) {
+		for (int align: { 1, 2 }) {
+			prevMemory.align = align;
+			Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), align };
+			auto diff = Pattern::MemoryDiff::build(prevMemory, memory);
+			assert(diff.getIdenticalSize() > firmware.size() / 2);
+
+			for (auto &pattern: patterns) {
+				auto results = Pattern::find(pattern, memory, limit);
+
+				// Previous search with the other limit stopped at the other offset
+				for (size_t prevLimit: { 0, 1, 5 }) {
+					auto prevResults = Pattern::find(pattern, prevMemory, prevLimit);
+					assert(isEqualResults(Pattern::findIncremental(pattern, diff, prevResults, prevLimit, limit), results));
+				}
+
+				// Results not matched in the previous memory fall back to the full search
+				assert(isEqualResults(Pattern::findIncremental(pattern, diff, { { 0xA0000000 + 0xFFFFF, 0xFFFFF, 0 } }, limit, limit), results));
+			}
+
+			// Offsets skipped by the other align in the previous memory are not known
+			Pattern::Memory otherAlignMemory = { 0xA0000000, &prevFirmware[0], prevFirmware.size(), 3 - align };
+			auto otherAlignDiff = Pattern::MemoryDiff::build(otherAlignMemory, memory);
+			for (auto &pattern: patterns) {
+				auto prevResults = Pattern::find(pattern, otherAlignMemory, limit);
+				assert(isEqualResults(Pattern::findIncremental(pattern, otherAlignDiff, prevResults, limit, limit), Pattern::find(pattern, memory, limit)));
+			}
+		}
+	}
+}
+
+static void testResultCache() {
+	// Canonical pattern text is parsed back to the same pattern
+	for (auto patternStr: { "AA ?? 1? ?2 [1.0.....] + 4", "*(01 02 { ?? 0? } 03 - 8) - 2", "&(LDR[ 01 02 ] 03) + 1", "&BL(01 [ 02 ] 03)", "<A0001234>" }) {
+		auto text = Pattern::stringify(Pattern::parse(patternStr));
+		assert(Pattern::stringify(Pattern::parse(text)) == text);
+	}
+	assert(Pattern::stringify(Pattern::parse("AA??BB+4")) == Pattern::stringify(Pattern::parse("AA ?? BB + 0x4")));
+
+	auto firmware = createTestFirmware(256 * 1024);
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 2 };
+	auto pattern = Pattern::parse("0? 01 0? ??");
+	auto key = Pattern::stringify(pattern);
+	auto allResults = Pattern::find(pattern, memory);
+	assert(allResults.size() > 10);
+
+	// Results with the smaller limit are the first results with the larger limit
+	Pattern::ResultCache cache;
+	cache.add(key, 10, Pattern::find(pattern, memory, 10));
+	assert(isEqualResults(cache.find(key, 5).second, Pattern::find(pattern, memory, 5)));
+	assert(!cache.find(key, 11).first && !cache.find(key).first && !cache.find("AA").first);
+
+	cache.add(key, 0, allResults);
+	assert(isEqualResults(cache.find(key, 11).second, Pattern::find(pattern, memory, 11)));
+	assert(isEqualResults(cache.find(key).second, allResults));
+
+	// Not found patterns are complete for any limit
+	cache.add("AA BB CC DD EE", 1, {});
+	assert(cache.find("AA BB CC DD EE", 100).first);
+
+	// Cache file
+	auto path = (std::filesystem::temp_directory_path() / "ptr89-tests.results").string();
+	uint64_t memoryHash = Pattern::hashMemory(memory);
+	auto emptyCache = Pattern::ResultCache::load(path + ".missing", memory, memoryHash);
+	assert(emptyCache.size() == 0);
+	emptyCache.add(key, 0, allResults);
+	emptyCache.add("AA BB CC DD EE", 1, {});
+	emptyCache.save(path);
+
+	auto loadedCache = Pattern::ResultCache::load(path, memory, memoryHash);
+	assert(loadedCache.size() == 2 && !loadedCache.isChanged());
+	assert(isEqualResults(loadedCache.find(key, 3).second, Pattern::find(pattern, memory, 3)));
+	assert(loadedCache.find("AA BB CC DD EE").first);
+
+	Pattern::Memory unalignedMemory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+	assert(Pattern::ResultCache::load(path, unalignedMemory, memoryHash).size() == 0);
+	assert(Pattern::ResultCache::load(path, memory, memoryHash + 1).size() == 0);
+	std::filesystem::remove(path);
+}
+
+static void testSearchStats() {
+	auto firmware = createTestFirmware(4 * 1024 * 1024);
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+
+	for (auto patternStr: { "0? 01 0? ??", "01 02 { ?? 0? }", "*(0? 01 0? ?? + 6) + 1" }) {
+		auto pattern = Pattern::parse(patternStr);
+		auto results = Pattern::find(pattern, memory);
+
+		// Counters don't change the results, chunks of the parallel search are summed
+		for (int threads: { 1, 4 }) {
+			SearchStats stats;
+			assert(isEqualResults(Pattern::find(pattern, memory, 0, threads, &stats), results));
+			assert(stats.scannedBytes == firmware.size() - pattern->bytes.size() + 1);
+			assert(stats.candidates >= stats.fuzzyRejects + stats.matches);
+			assert(stats.matches + stats.subPatternRejects <= stats.candidates - stats.fuzzyRejects);
+			assert(threads > 1 || stats.matches == results.size());
+		}
+
+		// The search is stopped after the first result
+		SearchStats stats;
+		auto firstResult = Pattern::find(pattern, memory, 1, 1, &stats);
+		assert(firstResult.size() == 1 && stats.matches == 1);
+		assert(stats.scannedBytes == firstResult[0].offset - pattern->inputOffset + 1);
+	}
+
+	SearchStats stats;
+	Pattern::find(Pattern::parse("01 02 { ?? 0? }"), memory, 0, 1, &stats);
+	assert(stats.follows[SUB_PATTERN_TYPE_BRANCH_4B] > 0 && stats.follows[SUB_PATTERN_TYPE_LDR_2B] == 0);
+}
+
+static void testFunctionIndex() {
+	std::vector<uint8_t> firmware(256 * 1024);
+	Pattern::Memory memory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+
+	auto put = [&firmware](size_t offset, const std::vector<uint8_t> &bytes) {
+		for (size_t i = 0; i < bytes.size(); i++)
+			firmware[offset + i] = bytes[i];
+	};
+
+	put(0x0100, { 0x10, 0xB5 });					// THUMB PUSH {R4, LR}
+	put(0x0200, { 0x10, 0x40, 0x2D, 0xE9 });		// ARM STMFD SP!, {R4, LR}
+	put(0x1000, { 0xFE, 0xF7, 0xFE, 0xFF });		// THUMB BL #0xA0000000
+	put(0x2000, { 0xFE, 0xFB, 0xFF, 0xFA });		// ARM BLX #0xA0001008
+	put(0x3000, { 0x00, 0x00, 0x00, 0xEA });		// ARM B #0xA0003008, not a call
+
+	auto index = Pattern::FunctionIndex::build(memory, 3);
+	assert(index.size() == 4);
+	assert(index.findContaining(0xA0000000) == std::make_pair(true, 0xA0000001U));
+	assert(index.findContaining(0xA0000100) == std::make_pair(true, 0xA0000101U));
+	assert(index.findContaining(0xA0000150) == std::make_pair(true, 0xA0000101U));
+	assert(index.findContaining(0xA0003010) == std::make_pair(true, 0xA0001001U));
+	assert(!index.findContaining(0x9FFFFFFE).first);
+	assert(index.findNext(0xA0000101) == std::make_pair(true, 0xA0000200U));
+	assert(!index.findNext(0xA0001000).first);
+	assert(index.findPrev(0xA0000200) == std::make_pair(true, 0xA0000101U));
+	assert(!index.findPrev(0xA0000001).first);
+
+	auto functions = index.findRange(0xA0000100, 0xA0001000);
+	assert(std::vector<uint32_t>(functions.begin(), functions.end()) == std::vector<uint32_t>({ 0xA0000101, 0xA0000200 }));
+	assert(index.findRange(0xA0000202, 0xA0001000).empty());
+
+	// Chunks don't change the index
+	auto randomFirmware = createTestFirmware(1024 * 1024);
+	Pattern::Memory randomMemory = { 0xA0000000, &randomFirmware[0], randomFirmware.size(), 1 };
+	auto singleIndex = Pattern::FunctionIndex::build(randomMemory, 1);
+	auto parallelIndex = Pattern::FunctionIndex::build(randomMemory, 4);
+	auto allFunctions = singleIndex.findRange(0, 0xFFFFFFFE);
+	auto allParallelFunctions = parallelIndex.findRange(0, 0xFFFFFFFE);
+	assert(singleIndex.size() > 0 && std::equal(allFunctions.begin(), allFunctions.end(), allParallelFunctions.begin(), allParallelFunctions.end()));
+}
+
+static void testSegments() {
+	// Flash with the far jumps into the RAM code, the RAM dump is the separate buffer
+	std::vector<uint8_t> flash(4096), ram(4096);
+	auto put = [](std::vector<uint8_t> &data, size_t offset, const std::vector<uint8_t> &bytes) {
+		for (size_t i = 0; i < bytes.size(); i++)
+			data[offset + i] = bytes[i];
+	};
+	put(flash, 0x100, { 0x00, 0xF0, 0x9F, 0xE5 });		// ARM LDR PC, [PC, #0]
+	put(flash, 0x108, { 0x00, 0x02, 0x00, 0xA8 });		// 0xA8000200
+	put(flash, 0x200, { 0x01, 0x48 });					// THUMB LDR R0, [PC, #4]
+	put(flash, 0x208, { 0x01, 0x03, 0x00, 0xA8 });		// 0xA8000301
+	put(ram, 0x200, { 0x11, 0x22, 0x33, 0x44 });
+	put(ram, 0x300, { 0x55, 0x66, 0x77, 0x88 });
+
+	Pattern::Memory memory = { 0xA0000000, &flash[0], flash.size(), 1 };
+	memory.segments = Pattern::createSegments({ { 0xA8000000, &ram[0], ram.size() }, { 0xA0000000, &flash[0], flash.size() } });
+	assert(memory.segments->at(0).base == 0xA0000000);
+	assert(Pattern::findSegment(*memory.segments, 0xA8000FFC, 4) == &memory.segments->at(1));
+	assert(!Pattern::findSegment(*memory.segments, 0xA8000FFE, 4));
+	assert(!Pattern::findSegment(*memory.segments, 0x9FFFFFFF));
+
+	// Sub-patterns and pointers are resolved in the RAM
+	auto branchResults = Pattern::find(Pattern::parse("{ 11 22 33 44 }"), memory, 0, 1);
+	assert(branchResults.size() == 1 && branchResults[0].address == 0xA0000100);
+	auto ldrResults = Pattern::find(Pattern::parse("LDR[ 66 77 ] ?? ??"), memory, 0, 1);
+	assert(ldrResults.size() == 1 && ldrResults[0].address == 0xA0000200);
+	auto pointerResults = Pattern::find(Pattern::parse("*(01 48 ?? ?? ?? ?? ?? ?? + 8)"), memory, 0, 1);
+	assert(pointerResults.size() == 1 && pointerResults[0].value == 0xA8000301);
+	auto compiledPattern = Pattern::compile(Pattern::parse("{ 11 22 33 44 }"));
+	assert(Pattern::checkPattern(*compiledPattern, 0x100, memory));
+	assert(!Pattern::checkPattern(*compiledPattern, 0x104, memory));
+
+	// Without the segments the same targets are not mapped
+	Pattern::Memory flashMemory = { 0xA0000000, &flash[0], flash.size(), 1 };
+	assert(Pattern::find(Pattern::parse("{ 11 22 33 44 }"), flashMemory, 0, 1).empty());
+
+	// Every segment is searched separately, offsets are relative to the segment
+	auto segmentsMemory = Pattern::getSegmentsMemory(memory);
+	assert(segmentsMemory.size() == 2 && segmentsMemory[0].data == memory.data);
+	assert(Pattern::find(Pattern::parse("55 66 77 88"), segmentsMemory[0], 0, 1).empty());
+	auto ramResults = Pattern::find(Pattern::parse("55 66 77 88"), segmentsMemory[1], 0, 1);
+	assert(ramResults.size() == 1 && ramResults[0].address == 0xA8000300 && ramResults[0].offset == 0x300);
+
+	bool isFailed = false;
+	try {
+		Pattern::createSegments({ { 0xA0000000, &flash[0], flash.size() }, { 0xA0000F00, &ram[0], ram.size() } });
+	} catch (const std::runtime_error &) {
+		isFailed = true;
+	}
+	assert(isFailed);
+}
+
+static void testApproxSearch() {
+	uint32_t seed = 0x89;
+	auto random = [&seed]() {
+		seed = seed * 1103515245 + 12345;
+		return seed >> 8;
+	};
+
+	// Counters of all widths and the multi-word states are compared with the byte-by-byte count
+	std::vector<uint8_t> memory(4096);
+	for (auto &byte: memory)
+		byte = random() % 4;
+	for (size_t size: { 1, 5, 21, 22, 40, 64, 90, 200 }) {
+		for (int maxMismatches: { 0, 1, 3, 4, 9 }) {
+			static const uint8_t maskTypes[] = { 0xFF, 0xFF, 0xFF, 0x00, 0xF0, 0x03 };
+			std::vector<uint8_t> bytes(size), masks(size);
+			for (size_t i = 0; i < size; i++) {
+				bytes[i] = random() % 4;
+				masks[i] = (i == 0 || i == size - 1) && size > 2 ? 0x00 : maskTypes[random() % std::size(maskTypes)];
+			}
+
+			std::vector<std::pair<size_t, int>> expected;
+			for (size_t offset = 100; offset + size <= memory.size() - 50; offset++) {
+				int mismatches = 0;
+				for (size_t i = 0; i < size; i++)
+					mismatches += (memory[offset + i] & masks[i]) != (bytes[i] & masks[i]);
+				if (mismatches <= maxMismatches)
+					expected.push_back({ offset, mismatches });
+			}
+
+			std::vector<std::pair<size_t, int>> found;
+			ShiftAddMatcher(bytes.data(), masks.data(), size, maxMismatches).scan(memory.data(), 100, memory.size() - 50 - size + 1, [&](size_t offset, int mismatches) {
+				found.push_back({ offset, mismatches });
+				return true;
+			});
+			assert(found == expected);
+		}
+	}
+
+	// Pattern copies with 0..3 changed bytes, the closest results are first
+	auto firmware = createTestFirmware(1024 * 1024);
+	Pattern::Memory firmwareMemory = { 0xA0000000, &firmware[0], firmware.size(), 1 };
+	auto pattern = Pattern::parse("10 B5 04 1C ?? 48 ?? 68 0? 29 01 D0 00 20 10 BD");
+	for (int i = 0; i < 4; i++) {
+		size_t offset = 0x10000 + i * 0x40000;
+		for (size_t j = 0; j < pattern->bytes.size(); j++)
+			firmware[offset + j] = pattern->bytes[j];
+		for (int j = 0; j < i; j++)
+			firmware[offset + 2 + j * 5] ^= 0x80;
+	}
+	auto results = Pattern::findApprox(pattern, firmwareMemory, 3, 4);
+	assert(results.size() == 4);
+	for (int i = 0; i < 4; i++)
+		assert(results[i].mismatches == i && results[i].result.address == 0xA0010000 + i * 0x40000 && results[i].result.value == 0xA0010001 + i * 0x40000);
+	auto parallelResults = Pattern::findApprox(pattern, firmwareMemory, 3, 4, 4);
+	for (int i = 0; i < 4; i++)
+		assert(parallelResults[i].result.address == results[i].result.address);
+	assert(Pattern::findApprox(pattern, firmwareMemory, 1, 0, 3).size() == 2);
+
+	// Worse results come first, more than 2 * limit of them are found before the closest ones
+	std::vector<uint8_t> data(4096, 0xEE);
+	for (size_t i = 0; i < 27; i++) {
+		std::vector<uint8_t> copy = { 0x11, 0x22, 0x33, 0x44 };
+		if (i < 25)
+			copy[3] = 0x00;
+		if (i < 20)
+			copy[2] = 0x00;
+		std::copy(copy.begin(), copy.end(), data.begin() + i * 64);
+	}
+	Pattern::Memory dataMemory = { 0xA0000000, &data[0], data.size(), 1 };
+	auto limitedResults = Pattern::findApprox(Pattern::parse("11 22 33 44"), dataMemory, 2, 3);
+	assert(limitedResults.size() == 3);
+	assert(limitedResults[0].mismatches == 0 && limitedResults[0].result.address == 0xA0000000 + 25 * 64);
+	assert(limitedResults[1].mismatches == 0 && limitedResults[1].result.address == 0xA0000000 + 26 * 64);
+	assert(limitedResults[2].mismatches == 1 && limitedResults[2].result.address == 0xA0000000 + 20 * 64);
+	auto allResults = Pattern::findApprox(Pattern::parse("11 22 33 44"), dataMemory, 2);
+	for (size_t limit = 1; limit <= allResults.size(); limit++) {
+		auto results = Pattern::findApprox(Pattern::parse("11 22 33 44"), dataMemory, 2, limit);
+		assert(results.size() == limit);
+		for (size_t i = 0; i < limit; i++)
+			assert(results[i].mismatches == allResults[i].mismatches && results[i].result.address == allResults[i].result.address);
+	}
+}
 
 int main() {
 	Pattern::setDebugHandler(vprintf);
 	testArmDecoder();
+
+	Pattern::setDebugHandler(nullptr);
+	testDecodeAtEnd();
+	testParallelSearch();
+	testSearchCallback();
+	testSearchStats();
+	testMultiPatternSearch();
+	testThreadPool();
+	testStreamSearch();
+	testIncrementalSearch();
+	testScanKernels();
+	testMaskedMatcher();
+	testParser();
+	testCompiledPattern();
+	testXRefIndex();
+	testResultCache();
+	testThunkMap();
+	testFunctionIndex();
+	testSegments();
+	testApproxSearch();
 	printf("All tests passed.\n");
 	return 0;
 }